@@ -9,6 +9,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
 
 
 extern int xml_load(const char *xml);
@@ -117,48 +123,210 @@ char* loadLastcore()
 
 }
 
-char *findCore(const char *name, char *coreName, int indent)
+// Core catalog: every RBF/MRA/MGL in the root and the '_' folders below it.
+// It's kept in config/cores.idx with the mtime of each folder, so only folders
+// changed since the last boot are read again.
+
+#define CORECAT_FILE CONFIG_DIR "/cores.idx"
+#define CORECAT_HDR  "MiSTer core catalog 1"
+
+struct corecat_dir_t
 {
-	char *spl;
-	DIR *dir;
-	struct dirent *entry;
+	long long mtime;
+	std::vector<std::string> files;
+	std::vector<std::string> subdirs;
+};
+
+static std::map<std::string, corecat_dir_t> corecat_dirs;
+static std::unordered_map<std::string, std::string> corecat_exact;
+static std::unordered_map<std::string, std::string> corecat_names;
+static int corecat_ready = 0;
+
+static long long corecat_mtime(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st) < 0) return -1;
+	return (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+static void corecat_load(const char *idx)
+{
+	FILE *fp = fopen(idx, "r");
+	if (!fp) return;
 
-	if (!(dir = opendir(name)))
+	char line[1024];
+	corecat_dir_t *dir = NULL;
+	if (fgets(line, sizeof(line), fp) && !strncmp(line, CORECAT_HDR, strlen(CORECAT_HDR)))
 	{
-		return NULL;
+		while (fgets(line, sizeof(line), fp))
+		{
+			int len = strlen(line);
+			while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = 0;
+			if (len < 2 || line[1] != ' ') continue;
+
+			if (line[0] == 'D')
+			{
+				char *name = strchr(line + 2, ' ');
+				if (!name) continue;
+				*name++ = 0;
+				dir = &corecat_dirs[name];
+				dir->mtime = strtoll(line + 2, NULL, 10);
+			}
+			else if (dir && line[0] == 'F') dir->files.push_back(line + 2);
+			else if (dir && line[0] == 'S') dir->subdirs.push_back(line + 2);
+		}
 	}
+	fclose(fp);
+}
+
+static void corecat_save(const char *idx)
+{
+	char tmp[1024];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", idx);
+	FILE *fp = fopen(tmp, "w");
+	if (!fp) return;
+
+	fprintf(fp, CORECAT_HDR "\n");
+	for (auto &it : corecat_dirs)
+	{
+		fprintf(fp, "D %lld %s\n", it.second.mtime, it.first.c_str());
+		for (auto &f : it.second.files) fprintf(fp, "F %s\n", f.c_str());
+		for (auto &d : it.second.subdirs) fprintf(fp, "S %s\n", d.c_str());
+	}
+
+	int ok = !ferror(fp);
+	if (fclose(fp) || !ok || rename(tmp, idx))
+	{
+		printf("Core catalog: cannot write %s\n", idx);
+		unlink(tmp);
+	}
+}
+
+static void corecat_add(const std::string &rel, const std::string &name)
+{
+	std::string &exact = corecat_exact[name];
+	if (exact.empty()) exact = rel;
+
+	// date-stripped key of RBFs, keeping the newest core of the same name
+	char key[256];
+	snprintf(key, sizeof(key), "%s", name.c_str());
+	char *spl = strrchr(key, '.');
+	if (!spl || strcmp(spl, ".rbf")) return;
+	*spl = 0;
+	if ((spl = strrchr(key, '_'))) *spl = 0;
+
+	std::string &latest = corecat_names[key];
+	const char *base = strrchr(latest.c_str(), '/');
+	base = base ? base + 1 : latest.c_str();
+	if (latest.empty() || strcmp(base, name.c_str()) < 0) latest = rel;
+}
+
+static void corecat_build()
+{
+	const char *root = getRootDir();
+	char idx[1024];
+	snprintf(idx, sizeof(idx), "%s/" CORECAT_FILE, root);
+
+	std::map<std::string, corecat_dir_t> old;
+	corecat_load(idx);
+	old.swap(corecat_dirs);
+
+	int rescanned = 0;
+	std::vector<std::string> queue = { "" };
+	while (!queue.empty())
+	{
+		std::string rel = queue.back();
+		queue.pop_back();
 
+		std::string full = rel.empty() ? std::string(root) : std::string(root) + "/" + rel;
+		long long mtime = corecat_mtime(full.c_str());
+		if (mtime < 0) continue;
 
-	char *indir;
-	char* path = new char[256];
-	while ((entry = readdir(dir)) != NULL) {
-		if (entry->d_type == DT_DIR) {
-			if (entry->d_name[0] != '_')
-				continue;
-			snprintf(path, 256, "%s/%s", name, entry->d_name);
-			indir = findCore(path, coreName, indent + 2);
-			if (indir != NULL)
+		corecat_dir_t &dir = corecat_dirs[rel];
+		auto it = old.find(rel);
+		if (it != old.end() && it->second.mtime == mtime)
+		{
+			dir = it->second;
+		}
+		else
+		{
+			DIR *d = opendir(full.c_str());
+			if (!d) continue;
+
+			dir.mtime = mtime;
+			struct dirent *entry;
+			while ((entry = readdir(d)) != NULL)
 			{
-				closedir(dir);
-				delete[] path;
-				return indir;
+				if (entry->d_type == DT_DIR)
+				{
+					if (entry->d_name[0] == '_') dir.subdirs.push_back(entry->d_name);
+				}
+				else
+				{
+					char *spl = strrchr(entry->d_name, '.');
+					if (spl && (!strcmp(spl, ".rbf") || !strcmp(spl, ".mra") || !strcmp(spl, ".mgl"))) dir.files.push_back(entry->d_name);
+				}
 			}
+			closedir(d);
+			rescanned++;
+		}
+
+		for (auto &sub : dir.subdirs) queue.push_back(rel.empty() ? sub : rel + "/" + sub);
+	}
+
+	int files = 0;
+	for (auto &it : corecat_dirs)
+	{
+		for (auto &f : it.second.files)
+		{
+			corecat_add(it.first.empty() ? f : it.first + "/" + f, f);
+			files++;
 		}
-		else {
-			snprintf(path, 256, "%s/%s", name, entry->d_name);
-			if (strstr(path, coreName) != NULL) {
-				spl = strrchr(path, '.');
-				if (spl && (!strcmp(spl, ".rbf") || !strcmp(spl, ".mra") || !strcmp(spl, ".mgl")))
+	}
+
+	if (rescanned || old.size() != corecat_dirs.size()) corecat_save(idx);
+	printf("Core catalog: %d files in %d folders, %d folders read.\n", files, (int)corecat_dirs.size(), rescanned);
+	corecat_ready = 1;
+}
+
+// The exact file name and the RBF name without date are looked up directly, the newest dated RBF
+// wins for the latter. Other names fall back to a substring search of the catalog paths.
+static char *corecat_find(const char *coreName)
+{
+	if (!corecat_ready) corecat_build();
+
+	const std::string *rel = NULL;
+	auto it = corecat_exact.find(coreName);
+	if (it != corecat_exact.end()) rel = &it->second;
+	else if ((it = corecat_names.find(coreName)) != corecat_names.end()) rel = &it->second;
+
+	std::string full;
+	if (rel)
+	{
+		full = std::string(getRootDir()) + "/" + *rel;
+	}
+	else
+	{
+		for (auto &dir : corecat_dirs)
+		{
+			for (auto &f : dir.second.files)
+			{
+				std::string path = std::string(getRootDir()) + (dir.first.empty() ? "" : "/" + dir.first) + "/" + f;
+				if (strstr(path.c_str(), coreName))
 				{
-					closedir(dir);
-					return path;
+					full = path;
+					break;
 				}
 			}
+			if (!full.empty()) break;
 		}
 	}
-	closedir(dir);
-	delete[] path;
-	return NULL;
+
+	if (full.empty() || full.size() >= 256) return NULL;
+
+	char *path = new char[256];
+	strcpy(path, full.c_str());
+	return path;
 }
 
 void bootcore_init(const char *path)
@@ -189,7 +357,7 @@ void bootcore_init(const char *path)
 		strcpy(bootcoretype, isExactcoreName(cfg.bootcore) ? "exactcorename" : "corename");
 	}
 
-	auxpointer = findCore(rootdir, bootcore, 0);
+	auxpointer = corecat_find(bootcore);
 	if (auxpointer != NULL)
 	{
 		strcpy(bootcore, auxpointer);
@@ -9,7 +9,6 @@ char *getcoreName(char *path);
 char *getcoreExactName(char *path);
 char *replaceStr(const char *str, const char *oldstr, const char *newstr);
 char *loadLastcore();
-char *findCore(const char *name, char *coreName, int indent);
 void bootcore_init(const char *path);
 
 extern char bootcoretype[64];
@@ -129,6 +129,13 @@ static const ini_var_t ini_vars[] =
 	{ "CONTROLLER_UNIQUE_MAPPING", (void *)(cfg.controller_unique_mapping), UINT32ARR, 0, sizeof(cfg.controller_unique_mapping) / sizeof(cfg.controller_unique_mapping[0]) },
 	{ "OSD_LOCK", (void*)(&(cfg.osd_lock)), STRING, 0, sizeof(cfg.osd_lock) - 1 },
 	{ "OSD_LOCK_TIME", (void*)(&(cfg.osd_lock_time)), UINT16, 0, 60 },
+	{ "SAVESTATE_COMPRESS", (void*)(&(cfg.savestate_compress)), UINT8, 0, 1 },
+	{ "SD_WRITEBACK", (void*)(&(cfg.sd_writeback)), UINT8, 0, 1 },
+	{ "EVENT_SCHEDULER", (void*)(&(cfg.event_scheduler)), UINT8, 0, 20 },
+	{ "INPUT_THREAD", (void*)(&(cfg.input_thread)), UINT8, 0, 1 },
+	{ "MRA_CACHE", (void*)(&(cfg.mra_cache)), UINT8, 0, 1 },
+	{ "FIO_FAST", (void*)(&(cfg.fio_fast)), UINT8, 0, 1 },
+	{ "FIO_BENCH", (void*)(&(cfg.fio_bench)), UINT8, 0, 1 },
 	{ "DEBUG", (void *)(&(cfg.debug)), UINT8, 0, 1 },
 	{ "MAIN", (void*)(&(cfg.main)), STRING, 0, sizeof(cfg.main) - 1 },
 };
@@ -97,6 +97,13 @@ typedef struct {
 	uint32_t controller_unique_mapping[256];
 	char osd_lock[25];
 	uint16_t osd_lock_time;
+	uint8_t savestate_compress;
+	uint8_t sd_writeback;
+	uint8_t event_scheduler;
+	uint8_t input_thread;
+	uint8_t mra_cache;
+	uint8_t fio_fast;
+	uint8_t fio_bench;
 	char debug;
 	char main[1024];
 } cfg_t;
@@ -15,10 +15,13 @@
 #include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <linux/magic.h>
+#include <pthread.h>
 #include <algorithm>
 #include <vector>
 #include <string>
 #include <set>
+#include <unordered_map>
+#include <memory>
 #include "lib/miniz/miniz.h"
 #include "osd.h"
 #include "fpga_io.h"
@@ -31,9 +34,12 @@
 #include "miniz.h"
 #include "scheduler.h"
 #include "video.h"
+#include "str_util.h"
 #include "support.h"
+#include "offload.h"
 
 #define MIN(a,b) (((a)<(b)) ? (a) : (b))
+#define MAX(a,b) (((a)>(b)) ? (a) : (b))
 
 typedef std::vector<direntext_t> DirentVector;
 typedef std::set<std::string> DirNameSet;
@@ -86,14 +92,211 @@ int fileTYPE::opened()
 	return filp || zip;
 }
 
+struct zipSeekIndex;
+
 struct fileZipArchive
 {
 	mz_zip_archive                    archive;
 	int                               index;
 	mz_zip_reader_extract_iter_state* iter;
 	__off64_t                         offset;
+	zipSeekIndex*                     seek;
+};
+
+// Seek index for deflated zip members.
+// The inflate state (including the 32K window) is snapshotted at intervals while a member is being
+// decompressed, so later seeks resume from the nearest checkpoint instead of inflating from the start.
+// Indexes are kept per archive member and survive closing/reopening the file.
+#define ZIP_CHECKPOINT_MIN  (512 * 1024)
+#define ZIP_CHECKPOINT_MAX  128
+#define ZIP_SEEK_CACHE      4
+
+struct zipCheckpoint
+{
+	mz_zip_reader_extract_iter_state state;
+	uint8_t                          dict[TINFL_LZ_DICT_SIZE];
 };
 
+struct zipSeekIndex
+{
+	char                        path[1024];
+	int                         index;
+	time_t                      mtime;
+	__off64_t                   interval;
+	int                         refs;
+	uint32_t                    stamp;
+	std::vector<zipCheckpoint*> points;
+};
+
+static zipSeekIndex *zip_seek_cache[ZIP_SEEK_CACHE] = {};
+static uint32_t zip_seek_stamp = 0;
+static pthread_mutex_t zip_seek_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void zip_seek_clear(zipSeekIndex *idx)
+{
+	for (auto cp : idx->points) delete cp;
+	idx->points.clear();
+}
+
+static void zip_seek_attach(fileZipArchive *zip, const char *path, __off64_t size)
+{
+	zip->seek = nullptr;
+
+	// stored members are seeked directly, small ones are cheap to rewind
+	if (!zip->iter->file_stat.m_method || size <= ZIP_CHECKPOINT_MIN) return;
+
+	struct stat64 st;
+	if (stat64(path, &st) < 0) return;
+
+	pthread_mutex_lock(&zip_seek_lock);
+
+	zipSeekIndex *idx = nullptr;
+	for (int i = 0; i < ZIP_SEEK_CACHE; i++)
+	{
+		zipSeekIndex *c = zip_seek_cache[i];
+		if (c && c->index == zip->index && !strcmp(c->path, path))
+		{
+			idx = c;
+			break;
+		}
+	}
+
+	if (idx && idx->mtime != st.st_mtime)
+	{
+		// archive has changed, index is stale
+		if (idx->refs) idx = nullptr;
+		else zip_seek_clear(idx);
+	}
+	else if (!idx)
+	{
+		int slot = -1;
+		for (int i = 0; i < ZIP_SEEK_CACHE; i++)
+		{
+			zipSeekIndex *c = zip_seek_cache[i];
+			if (!c)
+			{
+				slot = i;
+				break;
+			}
+
+			if (!c->refs && (slot < 0 || (zip_seek_stamp - c->stamp) > (zip_seek_stamp - zip_seek_cache[slot]->stamp))) slot = i;
+		}
+
+		if (slot >= 0)
+		{
+			if (!zip_seek_cache[slot]) zip_seek_cache[slot] = new zipSeekIndex{};
+			idx = zip_seek_cache[slot];
+			zip_seek_clear(idx);
+			strcpyz(idx->path, sizeof(idx->path), path);
+			idx->index = zip->index;
+		}
+	}
+
+	if (idx)
+	{
+		if (idx->points.empty())
+		{
+			idx->mtime = st.st_mtime;
+			idx->interval = MAX(ZIP_CHECKPOINT_MIN, size / ZIP_CHECKPOINT_MAX + 1);
+		}
+
+		idx->refs++;
+		idx->stamp = ++zip_seek_stamp;
+		zip->seek = idx;
+	}
+
+	pthread_mutex_unlock(&zip_seek_lock);
+}
+
+static void zip_seek_detach(fileZipArchive *zip)
+{
+	if (!zip->seek) return;
+
+	pthread_mutex_lock(&zip_seek_lock);
+	zip->seek->refs--;
+	pthread_mutex_unlock(&zip_seek_lock);
+	zip->seek = nullptr;
+}
+
+// snapshot the iterator if it went past the area covered by the index
+static void zip_seek_record(fileZipArchive *zip)
+{
+	if (!zip->seek || zip->iter->status < 0) return;
+
+	pthread_mutex_lock(&zip_seek_lock);
+	zipSeekIndex *idx = zip->seek;
+	__off64_t next = idx->points.empty() ? idx->interval : (__off64_t)idx->points.back()->state.out_buf_ofs + idx->interval;
+	if (zip->offset >= next && idx->points.size() < ZIP_CHECKPOINT_MAX)
+	{
+		zipCheckpoint *cp = new zipCheckpoint;
+		cp->state = *zip->iter;
+		memcpy(cp->dict, zip->iter->pWrite_buf, TINFL_LZ_DICT_SIZE);
+		idx->points.push_back(cp);
+	}
+	pthread_mutex_unlock(&zip_seek_lock);
+}
+
+// position stored (uncompressed) members without reading through them
+static int zip_seek_stored(fileZipArchive *zip, __off64_t offset)
+{
+	mz_zip_reader_extract_iter_state *it = zip->iter;
+	if (it->file_stat.m_method || (it->flags & MZ_ZIP_FLAG_COMPRESSED_DATA)) return 0;
+	if (offset < 0 || offset > (__off64_t)it->file_stat.m_uncomp_size) return 0;
+
+	__off64_t delta = offset - (__off64_t)it->out_buf_ofs;
+	it->cur_file_ofs += delta;
+	it->comp_remaining -= delta;
+	it->out_buf_ofs += delta;
+	zip->offset = offset;
+	return 1;
+}
+
+// move the iterator to the last checkpoint at or before offset if it's closer than the current position
+static int zip_seek_restore(fileZipArchive *zip, __off64_t offset)
+{
+	if (!zip->seek) return 0;
+
+	int res = 0;
+	pthread_mutex_lock(&zip_seek_lock);
+
+	zipCheckpoint *best = nullptr;
+	for (auto cp : zip->seek->points)
+	{
+		if ((__off64_t)cp->state.out_buf_ofs > offset) break;
+		best = cp;
+	}
+
+	if (best && (offset < zip->offset || (__off64_t)best->state.out_buf_ofs > zip->offset))
+	{
+		mz_zip_reader_extract_iter_state *it = zip->iter;
+		mz_zip_archive *pZip = it->pZip;
+		void *read_buf = it->pRead_buf;
+		void *write_buf = it->pWrite_buf;
+		mz_uint64 read_buf_size = it->read_buf_size;
+
+		*it = best->state;
+		it->pZip = pZip;
+		it->pRead_buf = read_buf;
+		it->pWrite_buf = write_buf;
+		it->read_buf_size = read_buf_size;
+		memcpy(write_buf, best->dict, TINFL_LZ_DICT_SIZE);
+
+		// unconsumed input is re-read from the archive
+		it->read_buf_ofs = 0;
+		res = 1;
+		if (it->read_buf_avail && pZip->m_pRead(pZip->m_pIO_opaque, it->cur_file_ofs - it->read_buf_avail, read_buf, (size_t)it->read_buf_avail) != it->read_buf_avail)
+		{
+			it->status = TINFL_STATUS_FAILED;
+			res = -1;
+		}
+
+		zip->offset = it->out_buf_ofs;
+	}
+
+	pthread_mutex_unlock(&zip_seek_lock);
+	return res;
+}
+
 
 static int OpenZipfileCached(char *path, int flags)
 {
@@ -282,6 +485,7 @@ void FileClose(fileTYPE *file)
 {
 	if (file->zip)
 	{
+		zip_seek_detach(file->zip);
 		if (file->zip->iter)
 		{
 			mz_zip_reader_extract_iter_free(file->zip->iter);
@@ -388,6 +592,7 @@ int FileOpenZip(fileTYPE *file, const char *name, uint32_t crc32)
 	file->zip->offset = 0;
 	file->offset = 0;
 	file->mode = O_RDONLY;
+	zip_seek_attach(file->zip, zip_path, file->size);
 	return 1;
 }
 
@@ -452,6 +657,7 @@ int FileOpenEx(fileTYPE *file, const char *name, int mode, char mute, int use_zi
 		file->zip->offset = 0;
 		file->offset = 0;
 		file->mode = mode;
+		zip_seek_attach(file->zip, zip_path, file->size);
 	}
 	else
 	{
@@ -563,7 +769,16 @@ int FileSeek(fileTYPE *file, __off64_t offset, int origin)
 			offset = file->size - offset;
 		}
 
-		if (offset < file->zip->offset)
+		if (zip_seek_stored(file->zip, offset))
+		{
+			file->offset = offset;
+			return 1;
+		}
+
+		int restored = zip_seek_restore(file->zip, offset);
+		if (restored < 0) printf("FileSeek(zip_seek_restore) Failed to read checkpoint data, rewinding.\n");
+
+		if (restored < 0 || offset < file->zip->offset)
 		{
 			mz_zip_reader_extract_iter_state *iter = mz_zip_reader_extract_iter_new(&file->zip->archive, file->zip->index, 0);
 			if (!iter)
@@ -584,6 +799,7 @@ int FileSeek(fileTYPE *file, __off64_t offset, int origin)
 			const size_t want_len = MIN((__off64_t)sizeof(buf), offset - file->zip->offset);
 			const size_t read_len = mz_zip_reader_extract_iter_read(file->zip->iter, buf, want_len);
 			file->zip->offset += read_len;
+			zip_seek_record(file->zip);
 			if (read_len < want_len)
 			{
 				printf("FileSeek(mz_zip_reader_extract_iter_read) Failed to advance iterator, error:%s\n",
@@ -632,6 +848,7 @@ int FileReadAdv(fileTYPE *file, void *pBuffer, int length, int failres)
 			return failres;
 		}
 		file->zip->offset += ret;
+		zip_seek_record(file->zip);
 	}
 	else
 	{
@@ -1370,11 +1587,536 @@ static void get_display_name(direntext_t *dext, const char *ext, int options)
 	if (fext) *fext = 0;
 }
 
+// Resolve the real type of regular files and symbolic links, full_path has to hold the directory.
+static void scan_resolve_type(char *full_path, int path_len, struct dirent64 *de)
+{
+	sprintf(full_path + path_len, "/%s", de->d_name);
+
+	struct stat entrystat;
+
+	if (!stat(full_path, &entrystat))
+	{
+		if (S_ISREG(entrystat.st_mode))
+		{
+			de->d_type = DT_REG;
+		}
+		else if (S_ISDIR(entrystat.st_mode))
+		{
+			de->d_type = DT_DIR;
+		}
+	}
+}
+
+// Returns 1 if the entry has to be listed. Also used by the directory index refresh thread.
+static int scan_accept(struct dirent64 *de, const char *path, const char *extension, int options, const char *prefix, int has_trd, int *isZip)
+{
+	int extlen = strlen(extension);
+
+	if (de->d_type == DT_DIR)
+	{
+		// skip System Volume Information folder
+		if (!strcmp(de->d_name, "System Volume Information")) return 0;
+		if (!strcmp(de->d_name, ".."))
+		{
+			if (!strlen(path)) return 0;
+		}
+		else
+		{
+			// skip hidden folder
+			if (!strncasecmp(de->d_name, ".", 1)) return 0;
+		}
+
+		if (!(options & SCANO_DIR))
+		{
+			if (de->d_name[0] != '_' && strcmp(de->d_name, "..")) return 0;
+			if (!(options & SCANO_CORES)) return 0;
+		}
+	}
+	else if (de->d_type == DT_REG)
+	{
+		// skip hidden files
+		if (!strncasecmp(de->d_name, ".", 1)) return 0;
+		//skip non-selectable files
+		if (!strcasecmp(de->d_name, "menu.rbf")) return 0;
+		if (!strncasecmp(de->d_name, "menu_20", 7)) return 0;
+		if (!strcasecmp(de->d_name, "boot.rom")) return 0;
+
+		//check the prefix if given
+		if (prefix && strncasecmp(prefix, de->d_name, strlen(prefix))) return 0;
+
+		if (extlen > 0)
+		{
+			const char *ext = extension;
+			int found = (has_trd && x2trd_ext_supp(de->d_name));
+			if (!found && !(options & SCANO_NOZIP) && !strcasecmp(de->d_name + strlen(de->d_name) - 4, ".zip") && (options & SCANO_DIR))
+			{
+				// Fake that zip-file is a directory.
+				de->d_type = DT_DIR;
+				*isZip = 1;
+				found = 1;
+			}
+			if (!found && is_minimig() && !memcmp(extension, "HDF", 3))
+			{
+				found = !strcasecmp(de->d_name + strlen(de->d_name) - 4, ".iso");
+			}
+
+			char *fext = strrchr(de->d_name, '.');
+			if (fext) fext++;
+			while (!found && *ext && fext)
+			{
+				char e[4];
+				memcpy(e, ext, 3);
+				if (e[2] == ' ')
+				{
+					e[2] = 0;
+					if (e[1] == ' ') e[1] = 0;
+				}
+
+				e[3] = 0;
+				found = 1;
+				for (int i = 0; i < 4; i++)
+				{
+					if (e[i] == '*') break;
+					if (e[i] == '?' && fext[i]) continue;
+
+					if (tolower(e[i]) != tolower(fext[i])) found = 0;
+
+					if (!e[i] || !found) break;
+				}
+				if (found) break;
+
+				if (strlen(ext) < 3) break;
+				ext += 3;
+			}
+			if (!found) return 0;
+		}
+	}
+	else
+	{
+		return 0;
+	}
+
+	return 1;
+}
+
+// Persistent directory index.
+// The filtered and sorted listing of a directory is kept in config/dirindex, keyed by
+// the path and scan options and validated by the mtime of the directory (or zip file).
+// An outdated index is shown right away while a thread rescans the directory, the
+// result is merged into the listing by flist_Refresh() reusing the known display names.
+
+#define DIRIDX_MAGIC 0x58444944 // "DIDX"
+#define DIRIDX_DIR   CONFIG_DIR "/dirindex"
+#define DIRIDX_KEY   1536
+
+struct diridx_hdr_t
+{
+	uint32_t magic;
+	uint32_t count;
+	uint64_t dir_mtime;
+	uint64_t names_mtime;
+	char key[DIRIDX_KEY];
+};
+
+struct diridx_ent_t
+{
+	std::string name;
+	uint8_t type;
+	uint8_t zip;
+};
+
+struct diridx_job_t
+{
+	std::string dir;
+	std::string path;
+	std::string extension;
+	std::string prefix;
+	std::string key;
+	int options;
+	int has_trd;
+	int use_prefix;
+
+	uint64_t dir_mtime;
+	std::vector<diridx_ent_t> ents;
+	int ok;
+	OffloadEvent done;
+};
+
+static char diridx_key[DIRIDX_KEY] = {};
+static uint64_t diridx_dir_mtime = 0;
+static std::shared_ptr<diridx_job_t> diridx_job;
+
+static uint64_t diridx_mtime(const char *full)
+{
+	struct stat64 st;
+	if (stat64(full, &st) < 0) return 0;
+	return (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+}
+
+static uint64_t diridx_names_mtime()
+{
+	char full[1024];
+	snprintf(full, sizeof(full), "%s/names.txt", getRootDir());
+	return diridx_mtime(full);
+}
+
+static void diridx_file(char *name, int size, const char *key)
+{
+	uint32_t hash = 2166136261u;
+	for (const char *p = key; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+	snprintf(name, size, "dirindex/%08X.idx", hash);
+}
+
+static int diridx_load(const char *key, uint64_t *dir_mtime)
+{
+	char name[64], full[1024];
+	diridx_file(name, sizeof(name), key);
+	snprintf(full, sizeof(full), "%s/" CONFIG_DIR "/%s", getRootDir(), name);
+
+	int fd = open(full, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	struct stat64 st;
+	int size = (fstat64(fd, &st) < 0) ? 0 : (int)st.st_size;
+	std::vector<char> buf(size + 1);
+	if (size <= (int)sizeof(diridx_hdr_t) || read(fd, buf.data(), size) != size) size = 0;
+	close(fd);
+	if (!size) return 0;
+	buf[size] = 0;
+
+	diridx_hdr_t *hdr = (diridx_hdr_t*)buf.data();
+	if (hdr->magic != DIRIDX_MAGIC || strncmp(hdr->key, key, sizeof(hdr->key))) return 0;
+	if (hdr->names_mtime != diridx_names_mtime()) return 0;
+
+	// entry: type, flags, d_name, altname, datecode
+	const char *p = buf.data() + sizeof(diridx_hdr_t);
+	const char *end = buf.data() + size;
+	DirItem.reserve(hdr->count);
+	for (uint32_t i = 0; i < hdr->count; i++)
+	{
+		if (end - p < 5) break;
+
+		direntext_t dext;
+		memset(&dext, 0, sizeof(dext));
+		dext.de.d_type = *p++;
+		dext.flags = *p++;
+		strcpyz(dext.de.d_name, sizeof(dext.de.d_name), p); p += strlen(p) + 1;
+		if (p >= end) break;
+		strcpyz(dext.altname, sizeof(dext.altname), p); p += strlen(p) + 1;
+		if (p >= end) break;
+		strcpyz(dext.datecode, sizeof(dext.datecode), p); p += strlen(p) + 1;
+		if (p > end) break;
+		DirItem.push_back(dext);
+	}
+
+	if (DirItem.size() != hdr->count)
+	{
+		printf("Directory index %s is damaged.\n", name);
+		DirItem.clear();
+		return 0;
+	}
+
+	*dir_mtime = hdr->dir_mtime;
+	return 1;
+}
+
+static void diridx_save(const char *key, uint64_t dir_mtime)
+{
+	std::vector<char> *buf = new std::vector<char>(sizeof(diridx_hdr_t));
+	buf->reserve(sizeof(diridx_hdr_t) + DirItem.size() * 64);
+
+	diridx_hdr_t *hdr = (diridx_hdr_t*)buf->data();
+	hdr->magic = DIRIDX_MAGIC;
+	hdr->count = DirItem.size();
+	hdr->dir_mtime = dir_mtime;
+	hdr->names_mtime = diridx_names_mtime();
+	strcpyz(hdr->key, sizeof(hdr->key), key);
+
+	for (auto &dext : DirItem)
+	{
+		buf->push_back(dext.de.d_type);
+		buf->push_back(dext.flags);
+		buf->insert(buf->end(), dext.de.d_name, dext.de.d_name + strlen(dext.de.d_name) + 1);
+		buf->insert(buf->end(), dext.altname, dext.altname + strlen(dext.altname) + 1);
+		buf->insert(buf->end(), dext.datecode, dext.datecode + strlen(dext.datecode) + 1);
+	}
+
+	char name[64];
+	diridx_file(name, sizeof(name), key);
+	FileCreatePath(DIRIDX_DIR);
+	std::string idx_path = std::string(getRootDir()) + "/" CONFIG_DIR "/" + name;
+
+	// write a temporary file and rename it, so a power loss can't leave a partial index
+	offload_add_work([=]
+	{
+		std::string tmp = idx_path + ".tmp";
+		int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+		if (fd >= 0)
+		{
+			int ok = (write(fd, buf->data(), buf->size()) == (ssize_t)buf->size());
+			fsync(fd);
+			close(fd);
+			if (!ok || rename(tmp.c_str(), idx_path.c_str()))
+			{
+				printf("Couldn't write directory index %s\n", idx_path.c_str());
+				unlink(tmp.c_str());
+			}
+		}
+		delete buf;
+	});
+}
+
+// A single refresher thread scans the directories. Only the newest request is kept, a job
+// replaced before it started is dropped. Once per session, when it's idle for the first time,
+// the thread removes the indexes of folders which don't exist anymore.
+static pthread_mutex_t diridx_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t diridx_cond = PTHREAD_COND_INITIALIZER;
+static std::shared_ptr<diridx_job_t> diridx_pending;
+static int diridx_thread_started = 0;
+
+static void diridx_scan(diridx_job_t *job)
+{
+	char full_path[1024];
+	snprintf(full_path, sizeof(full_path), "%s", job->dir.c_str());
+	int path_len = strlen(full_path);
+
+	// take the mtime first, so changes made during the scan are seen next time
+	job->dir_mtime = diridx_mtime(full_path);
+
+	DIR *d = opendir(full_path);
+	if (d)
+	{
+		struct dirent64 *de;
+		while ((de = readdir64(d)))
+		{
+			if (de->d_type == DT_LNK || de->d_type == DT_REG) scan_resolve_type(full_path, path_len, de);
+
+			int isZip = 0;
+			if (!scan_accept(de, job->path.c_str(), job->extension.c_str(), job->options, job->use_prefix ? job->prefix.c_str() : NULL, job->has_trd, &isZip)) continue;
+
+			diridx_ent_t ent;
+			ent.name = de->d_name;
+			ent.type = de->d_type;
+			ent.zip = isZip;
+			job->ents.push_back(ent);
+		}
+		closedir(d);
+		job->ok = 1;
+	}
+
+	job->done.signal();
+}
+
+static void diridx_prune()
+{
+	char dir[1024];
+	snprintf(dir, sizeof(dir), "%s/" DIRIDX_DIR, getRootDir());
+	DIR *d = opendir(dir);
+	if (!d) return;
+
+	static diridx_hdr_t hdr;
+	int removed = 0;
+	struct dirent *de;
+	while ((de = readdir(d)))
+	{
+		const char *ext = strrchr(de->d_name, '.');
+		if (!ext || strcmp(ext, ".idx")) continue;
+
+		char idx[1300];
+		snprintf(idx, sizeof(idx), "%s/%s", dir, de->d_name);
+		int fd = open(idx, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) continue;
+		int ok = read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == DIRIDX_MAGIC;
+		close(fd);
+
+		int stale = !ok;
+		if (ok)
+		{
+			// the key starts with the path, a zipped folder is checked by its zip file
+			hdr.key[sizeof(hdr.key) - 1] = 0;
+			char *sep = strchr(hdr.key, '|');
+			if (sep) *sep = 0;
+			char *zip = strcasestr(hdr.key, ".zip/");
+			if (zip) zip[4] = 0;
+
+			char folder[2048];
+			snprintf(folder, sizeof(folder), (hdr.key[0] == '/') ? "%s" : "%s/%s", (hdr.key[0] == '/') ? hdr.key : getRootDir(), hdr.key);
+			stale = !diridx_mtime(folder);
+		}
+
+		if (stale && !unlink(idx)) removed++;
+	}
+	closedir(d);
+
+	if (removed) printf("Directory index: removed %d index(es) of missing folders\n", removed);
+}
+
+static void* diridx_refresh_thread(void *)
+{
+	int pruned = 0;
+	pthread_mutex_lock(&diridx_lock);
+	while (1)
+	{
+		if (!diridx_pending)
+		{
+			if (!pruned)
+			{
+				pruned = 1;
+				pthread_mutex_unlock(&diridx_lock);
+				diridx_prune();
+				pthread_mutex_lock(&diridx_lock);
+				continue;
+			}
+
+			pthread_cond_wait(&diridx_cond, &diridx_lock);
+			continue;
+		}
+
+		std::shared_ptr<diridx_job_t> job = diridx_pending;
+		diridx_pending.reset();
+		pthread_mutex_unlock(&diridx_lock);
+
+		diridx_scan(job.get());
+		job.reset();
+
+		pthread_mutex_lock(&diridx_lock);
+	}
+
+	return NULL;
+}
+
+static void diridx_refresh_start(const char *dir, const char *path, const char *extension, int options, const char *prefix, int has_trd)
+{
+	std::shared_ptr<diridx_job_t> job = std::make_shared<diridx_job_t>();
+	job->dir = dir;
+	job->path = path;
+	job->extension = extension;
+	job->prefix = prefix ? prefix : "";
+	job->use_prefix = prefix != NULL;
+	job->key = diridx_key;
+	job->options = options;
+	job->has_trd = has_trd;
+	job->dir_mtime = 0;
+	job->ok = 0;
+
+	pthread_mutex_lock(&diridx_lock);
+	if (!diridx_thread_started)
+	{
+		pthread_t tid;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		diridx_thread_started = !pthread_create(&tid, &attr, diridx_refresh_thread, NULL);
+		pthread_attr_destroy(&attr);
+	}
+
+	if (diridx_thread_started)
+	{
+		// a job of a directory which is not browsed anymore is dropped or finishes on its own
+		diridx_pending = job;
+		diridx_job = job;
+		pthread_cond_signal(&diridx_cond);
+	}
+	pthread_mutex_unlock(&diridx_lock);
+}
+
+// Set the selection on the given name (if any), returns the number of entries.
+static int scan_select(const char *file_name)
+{
+	if (file_name[0])
+	{
+		int pos = -1;
+		for (int i = 0; i < flist_nDirEntries(); i++)
+		{
+			if (!strcmp(file_name, DirItem[i].de.d_name))
+			{
+				pos = i;
+				break;
+			}
+			else if (!strcasecmp(file_name, DirItem[i].de.d_name))
+			{
+				pos = i;
+			}
+		}
+
+		if(pos>=0)
+		{
+			iSelectedEntry = pos;
+			if (iSelectedEntry + (OsdGetSize() / 2) >= flist_nDirEntries()) iFirstEntry = flist_nDirEntries() - OsdGetSize();
+			else iFirstEntry = iSelectedEntry - (OsdGetSize() / 2) + 1;
+			if (iFirstEntry < 0) iFirstEntry = 0;
+		}
+	}
+	return flist_nDirEntries();
+}
+
+// Merge the result of a finished index refresh into the listing.
+// Returns 1 if the listing has changed and has to be redrawn.
+int flist_Refresh()
+{
+	if (!diridx_job || !diridx_job->done.is_set()) return 0;
+
+	std::shared_ptr<diridx_job_t> job = diridx_job;
+	diridx_job.reset();
+	if (!job->ok || strcmp(job->key.c_str(), diridx_key)) return 0;
+
+	std::unordered_map<std::string, size_t> known;
+	known.reserve(DirItem.size());
+	for (size_t i = 0; i < DirItem.size(); i++) known[DirItem[i].de.d_name] = i;
+
+	DirentVector items;
+	items.reserve(job->ents.size());
+	int added = 0;
+	for (auto &ent : job->ents)
+	{
+		auto it = known.find(ent.name);
+		if (it != known.end() && DirItem[it->second].de.d_type == ent.type)
+		{
+			items.push_back(DirItem[it->second]);
+			continue;
+		}
+
+		direntext_t dext;
+		memset(&dext, 0, sizeof(dext));
+		strcpyz(dext.de.d_name, sizeof(dext.de.d_name), ent.name.c_str());
+		dext.de.d_type = ent.type;
+		if (ent.zip) dext.flags |= DT_EXT_ZIP;
+		get_display_name(&dext, job->extension.c_str(), job->options);
+		items.push_back(dext);
+		added++;
+	}
+
+	int removed = (int)DirItem.size() + added - (int)items.size();
+	diridx_dir_mtime = job->dir_mtime;
+	if (!added && !removed)
+	{
+		diridx_save(diridx_key, diridx_dir_mtime);
+		return 0;
+	}
+
+	printf("Directory index refreshed: %d added, %d removed\n", added, removed);
+
+	char selected[256] = {};
+	if (iSelectedEntry < flist_nDirEntries()) strcpyz(selected, sizeof(selected), DirItem[iSelectedEntry].de.d_name);
+
+	std::sort(items.begin(), items.end(), DirentComp());
+	DirItem.swap(items);
+	iSelectedEntry = 0;
+	iFirstEntry = 0;
+	scan_select(selected);
+
+	diridx_save(diridx_key, diridx_dir_mtime);
+	return 1;
+}
+
 int ScanDirectory(char* path, int mode, const char *extension, int options, const char *prefix, const char *filter)
 {
 	static char file_name[1024];
 	static char full_path[1024];
 
+	int browse = options & SCANO_BROWSE;
+	options &= ~SCANO_BROWSE;
+
 	int has_trd = 0;
 	const char *ext = extension;
 	while (*ext)
@@ -1383,7 +2125,6 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 		ext += 3;
 	}
 
-	int extlen = strlen(extension);
     int filterlen = filter ? strlen(filter) : 0;
 	//printf("scan dir\n");
 
@@ -1433,6 +2174,33 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 		char *zip_path, *file_path_in_zip = (char*)"";
 		FileIsZipped(full_path, &zip_path, &file_path_in_zip);
 
+		// besides the arguments only is_minimig() changes the listing (HDF also lists ISO)
+		diridx_key[0] = 0;
+		diridx_job.reset();
+		if (!filter && !(options & SCANO_NEOGEO))
+		{
+			int n = snprintf(diridx_key, sizeof(diridx_key), "%s|%s|%d|%s|%d", path, extension, options, prefix ? prefix : "", is_minimig());
+			if (n >= (int)sizeof(diridx_key)) diridx_key[0] = 0;
+		}
+
+		if (diridx_key[0])
+		{
+			// full_path is the zip file itself for zipped folders
+			uint64_t idx_mtime = 0;
+			diridx_dir_mtime = diridx_mtime(full_path);
+			if (diridx_dir_mtime && diridx_load(diridx_key, &idx_mtime))
+			{
+				// only the file browser merges the refreshed listing (flist_Refresh)
+				if (idx_mtime == diridx_dir_mtime || (browse && !is_zipped))
+				{
+					printf("Got %d dir entries from index%s\n", flist_nDirEntries(), (idx_mtime == diridx_dir_mtime) ? "" : ", refreshing");
+					if (idx_mtime != diridx_dir_mtime) diridx_refresh_start(full_path, path, extension, options, prefix, has_trd);
+					return scan_select(file_name);
+				}
+				DirItem.clear();
+			}
+		}
+
 		DIR *d = nullptr;
 		mz_zip_archive *z = nullptr;
 		if (is_zipped)
@@ -1520,21 +2288,7 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 			// Handle (possible) symbolic link type in the directory entry
 			else if (de->d_type == DT_LNK || de->d_type == DT_REG)
 			{
-				sprintf(full_path + path_len, "/%s", de->d_name);
-
-				struct stat entrystat;
-
-				if (!stat(full_path, &entrystat))
-				{
-					if (S_ISREG(entrystat.st_mode))
-					{
-						de->d_type = DT_REG;
-					}
-					else if (S_ISDIR(entrystat.st_mode))
-					{
-						de->d_type = DT_DIR;
-					}
-				}
+				scan_resolve_type(full_path, path_len, de);
 			}
 
             if (filter)
@@ -1596,99 +2350,14 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 			}
 			else
 			{
-				if (de->d_type == DT_DIR)
-				{
-					// skip System Volume Information folder
-					if (!strcmp(de->d_name, "System Volume Information")) continue;
-					if (!strcmp(de->d_name, ".."))
-					{
-						if (!strlen(path)) continue;
-					}
-					else
-					{
-						// skip hidden folder
-						if (!strncasecmp(de->d_name, ".", 1)) continue;
-					}
+				if (!scan_accept(de, path, extension, options, prefix, has_trd, &isZip)) continue;
 
-					if (!(options & SCANO_DIR))
-					{
-						if (de->d_name[0] != '_' && strcmp(de->d_name, "..")) continue;
-						if (!(options & SCANO_CORES)) continue;
-					}
-				}
-				else if (de->d_type == DT_REG)
-				{
-					// skip hidden files
-					if (!strncasecmp(de->d_name, ".", 1)) continue;
-					//skip non-selectable files
-					if (!strcasecmp(de->d_name, "menu.rbf")) continue;
-					if (!strncasecmp(de->d_name, "menu_20", 7)) continue;
-					if (!strcasecmp(de->d_name, "boot.rom")) continue;
-
-					//check the prefix if given
-					if (prefix && strncasecmp(prefix, de->d_name, strlen(prefix))) continue;
-
-					if (extlen > 0)
-					{
-						const char *ext = extension;
-						int found = (has_trd && x2trd_ext_supp(de->d_name));
-						if (!found && !(options & SCANO_NOZIP) && !strcasecmp(de->d_name + strlen(de->d_name) - 4, ".zip") && (options & SCANO_DIR))
-						{
-							// Fake that zip-file is a directory.
-							de->d_type = DT_DIR;
-							isZip = 1;
-							found = 1;
-						}
-						if (!found && is_minimig() && !memcmp(extension, "HDF", 3))
-						{
-							found = !strcasecmp(de->d_name + strlen(de->d_name) - 4, ".iso");
-						}
-
-						char *fext = strrchr(de->d_name, '.');
-						if (fext) fext++;
-						while (!found && *ext && fext)
-						{
-							char e[4];
-							memcpy(e, ext, 3);
-							if (e[2] == ' ')
-							{
-								e[2] = 0;
-								if (e[1] == ' ') e[1] = 0;
-							}
-
-							e[3] = 0;
-							found = 1;
-							for (int i = 0; i < 4; i++)
-							{
-								if (e[i] == '*') break;
-								if (e[i] == '?' && fext[i]) continue;
-
-								if (tolower(e[i]) != tolower(fext[i])) found = 0;
-
-								if (!e[i] || !found) break;
-							}
-							if (found) break;
-
-							if (strlen(ext) < 3) break;
-							ext += 3;
-						}
-						if (!found) continue;
-					}
-				}
-				else
-				{
-					continue;
-				}
-
-        {
-			      direntext_t dext;
-				    memset(&dext, 0, sizeof(dext));
-				    memcpy(&dext.de, de, sizeof(dext.de));
-				    if (isZip)
-				        dext.flags |= DT_EXT_ZIP;
-				    get_display_name(&dext, extension, options);
-				    DirItem.push_back(dext);
-        }
+				direntext_t dext;
+				memset(&dext, 0, sizeof(dext));
+				memcpy(&dext.de, de, sizeof(dext.de));
+				if (isZip) dext.flags |= DT_EXT_ZIP;
+				get_display_name(&dext, extension, options);
+				DirItem.push_back(dext);
 			}
 		}
 
@@ -1713,31 +2382,8 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 		if (!flist_nDirEntries()) return 0;
 
 		std::sort(DirItem.begin(), DirItem.end(), DirentComp());
-		if (file_name[0])
-		{
-			int pos = -1;
-			for (int i = 0; i < flist_nDirEntries(); i++)
-			{
-				if (!strcmp(file_name, DirItem[i].de.d_name))
-				{
-					pos = i;
-					break;
-				}
-				else if (!strcasecmp(file_name, DirItem[i].de.d_name))
-				{
-					pos = i;
-				}
-			}
-
-			if(pos>=0)
-			{
-				iSelectedEntry = pos;
-				if (iSelectedEntry + (OsdGetSize() / 2) >= flist_nDirEntries()) iFirstEntry = flist_nDirEntries() - OsdGetSize();
-				else iFirstEntry = iSelectedEntry - (OsdGetSize() / 2) + 1;
-				if (iFirstEntry < 0) iFirstEntry = 0;
-			}
-		}
-		return flist_nDirEntries();
+		if (diridx_key[0] && diridx_dir_mtime) diridx_save(diridx_key, diridx_dir_mtime);
+		return scan_select(file_name);
 	}
 	else
 	{
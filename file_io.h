@@ -53,6 +53,7 @@ int flist_iSelectedEntry();
 direntext_t* flist_DirItem(int n);
 direntext_t* flist_SelectedItem();
 char* flist_Path();
+int flist_Refresh();
 char* flist_GetPrevNext(const char* base_path, const char* file, const char* ext, int next);
 
 // scanning flags
@@ -74,6 +75,7 @@ char* flist_GetPrevNext(const char* base_path, const char* file, const char* ext
 #define SCANO_NOZIP      0b001000000
 #define SCANO_CLEAR      0b010000000 // allow backspace key, clear FC option
 #define SCANO_SAVES      0b100000000
+#define SCANO_BROWSE    0b1000000000 // interactive listing, may be served from an outdated index while it's refreshed
 
 void FindStorage();
 int  getStorage(int from_setting);
@@ -0,0 +1,42 @@
+#ifndef FPGA_BUS_H
+#define FPGA_BUS_H
+
+#include <stdint.h>
+
+// Access to the HPS GPO/GPI registers the SPI bridge to the core runs on.
+// The backend is selected at build time, so the unrolled loops in fpga_spi.cpp stay plain
+// register accesses: normally the registers mapped from /dev/mem, with FPGA_SIM defined the
+// software FPGA model in sim/fpga_sim.cpp (see "make sim-bench").
+
+#ifdef FPGA_SIM
+
+void fpga_sim_gpo_write(uint32_t value);
+int fpga_sim_gpi_read();
+
+#define fpga_bus_gpo_write(value) fpga_sim_gpo_write(value)
+#define fpga_bus_gpi_read() fpga_sim_gpi_read()
+
+#else
+
+// GPO at [0], GPI at [1], set by fpga_io_init()
+extern volatile uint32_t *fpga_bus_regs;
+
+#define fpga_bus_gpo_write(value) (fpga_bus_regs[0] = (value))
+#define fpga_bus_gpi_read() ((int)fpga_bus_regs[1])
+
+#endif
+
+// GPO can't be read back, the last written value is kept
+extern uint32_t fpga_gpo_copy;
+
+static inline void fpga_gpo_write(uint32_t value)
+{
+	fpga_gpo_copy = value;
+	fpga_bus_gpo_write(value);
+}
+
+#define fpga_gpo_writeN(value) fpga_bus_gpo_write(value)
+#define fpga_gpo_read() fpga_gpo_copy
+#define fpga_gpi_read() fpga_bus_gpi_read()
+
+#endif // FPGA_BUS_H
@@ -10,12 +10,14 @@
 #include <sys/stat.h>
 
 #include "fpga_io.h"
+#include "fpga_bus.h"
 #include "file_io.h"
 #include "input.h"
 #include "osd.h"
 #include "menu.h"
 #include "shmem.h"
 #include "offload.h"
+#include "user_io.h"
 
 #include "fpga_base_addr_ac5.h"
 #include "fpga_manager.h"
@@ -505,17 +507,6 @@ int fpga_load_rbf(const char *name, const char *cfg, const char *xml)
 	return ret;
 }
 
-static uint32_t gpo_copy = 0;
-void inline fpga_gpo_write(uint32_t value)
-{
-	gpo_copy = value;
-	writel(value, (void*)(SOCFPGA_MGR_ADDRESS + 0x10));
-}
-
-#define fpga_gpo_writeN(value) writel((value), (void*)(SOCFPGA_MGR_ADDRESS + 0x10))
-#define fpga_gpo_read() gpo_copy //readl((void*)(SOCFPGA_MGR_ADDRESS + 0x10))
-#define fpga_gpi_read() (int)readl((void*)(SOCFPGA_MGR_ADDRESS + 0x14))
-
 void fpga_core_write(uint32_t offset, uint32_t value)
 {
 	if (offset <= 0x1FFFFF) writel(value, (void*)(SOCFPGA_LWFPGASLAVES_ADDRESS + (offset & ~3)));
@@ -532,6 +523,7 @@ int fpga_io_init()
 	map_base = (uint32_t*)shmem_map(FPGA_REG_BASE, FPGA_REG_SIZE);
 	if (!map_base) return -1;
 
+	fpga_bus_regs = MAP_ADDR(SOCFPGA_MGR_ADDRESS + 0x10);
 	fpga_gpo_write(0);
 	return 0;
 }
@@ -612,6 +604,8 @@ char *getappname()
 
 void app_restart(const char *path, const char *xml, const char *exe)
 {
+	user_io_sd_flush(1);
+	shmem_print_stats();
 	sync();
 	fpga_core_reset(1);
 
@@ -644,15 +638,6 @@ int is_fpga_ready(int quick)
 	return fpgamgr_test_fpga_ready();
 }
 
-#define SSPI_STROBE  (1<<17)
-#define SSPI_ACK     SSPI_STROBE
-
-void fpga_spi_en(uint32_t mask, uint32_t en)
-{
-	uint32_t gpo = fpga_gpo_read() | 0x80000000;
-	fpga_gpo_write(en ? gpo | mask : gpo & ~mask);
-}
-
 void fpga_wait_to_reset()
 {
 	printf("FPGA is not ready. JTAG uploading?\n");
@@ -666,345 +651,3 @@ void fpga_wait_to_reset()
 	}
 	reboot(0);
 }
-
-uint16_t fpga_spi(uint16_t word)
-{
-	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE)) | word;
-
-	fpga_gpo_write(gpo);
-	fpga_gpo_write(gpo | SSPI_STROBE);
-
-	int gpi;
-	do
-	{
-		gpi = fpga_gpi_read();
-		if (gpi < 0)
-		{
-			printf("GPI[31]==1. FPGA is uninitialized?\n");
-			fpga_wait_to_reset();
-			return 0;
-		}
-	} while (!(gpi & SSPI_ACK));
-
-	fpga_gpo_write(gpo);
-
-	do
-	{
-		gpi = fpga_gpi_read();
-		if (gpi < 0)
-		{
-			printf("GPI[31]==1. FPGA is uninitialized?\n");
-			fpga_wait_to_reset();
-			return 0;
-		}
-	} while (gpi & SSPI_ACK);
-
-	return (uint16_t)gpi;
-}
-
-uint16_t fpga_spi_fast(uint16_t word)
-{
-	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE)) | word;
-	fpga_gpo_write(gpo);
-	fpga_gpo_write(gpo | SSPI_STROBE);
-	fpga_gpo_write(gpo);
-	return (uint16_t)fpga_gpi_read();
-}
-
-void fpga_spi_fast_block_write(const uint16_t *buf, uint32_t length)
-{
-	uint32_t gpoH = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
-	uint32_t gpo = gpoH;
-
-	// should be optimized for speed by compiler automatically
-	while (length--)
-	{
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-	}
-	fpga_gpo_write(gpo);
-}
-
-void fpga_spi_fast_block_read(uint16_t *buf, uint32_t length)
-{
-	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
-	uint32_t rem = length % 16;
-	length /= 16;
-
-	// not optimized by compiler automatically
-	// so do manual optimization for speed.
-	while (length--)
-	{
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-	}
-
-	while (rem--)
-	{
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-	}
-}
-
-void fpga_spi_fast_block_write_8(const uint8_t *buf, uint32_t length)
-{
-	uint32_t gpoH = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
-	uint32_t gpo = gpoH;
-	uint32_t rem = length % 16;
-	length /= 16;
-
-	// not optimized by compiler automatically
-	// so do manual optimization for speed.
-	while (length--)
-	{
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-	}
-
-	while (rem--)
-	{
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-	}
-
-	fpga_gpo_write(gpo);
-}
-
-void fpga_spi_fast_block_read_8(uint8_t *buf, uint32_t length)
-{
-	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
-	uint32_t rem = length % 16;
-	length /= 16;
-
-	// not optimized by compiler automatically
-	// so do manual optimization for speed.
-	while (length--)
-	{
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-	}
-
-	while (rem--)
-	{
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-	}
-}
-
-void fpga_spi_fast_block_write_be(const uint16_t *buf, uint32_t length)
-{
-	uint32_t gpoH = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
-	uint32_t gpo = gpoH;
-
-	// should be optimized for speed by compiler automatically
-	while (length--)
-	{
-		uint16_t tmp = *buf++;
-		tmp = (tmp << 8) | (tmp >> 8);
-		gpo = gpoH | tmp;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-	}
-	fpga_gpo_write(gpo);
-}
-
-void fpga_spi_fast_block_read_be(uint16_t *buf, uint32_t length)
-{
-	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
-
-	// should be optimized for speed by compiler automatically
-	while (length--)
-	{
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		uint16_t tmp = (uint16_t)fpga_gpi_read();
-		*buf++ = (tmp << 8) | (tmp >> 8);
-	}
-}
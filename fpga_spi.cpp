@@ -0,0 +1,373 @@
+#include <stdio.h>
+
+#include "fpga_io.h"
+#include "fpga_bus.h"
+
+// SPI bridge to the core over the GPO/GPI registers.
+
+#ifndef FPGA_SIM
+volatile uint32_t *fpga_bus_regs = 0;
+#endif
+
+uint32_t fpga_gpo_copy = 0;
+
+#define SSPI_STROBE  (1<<17)
+#define SSPI_ACK     SSPI_STROBE
+
+void fpga_spi_en(uint32_t mask, uint32_t en)
+{
+	uint32_t gpo = fpga_gpo_read() | 0x80000000;
+	fpga_gpo_write(en ? gpo | mask : gpo & ~mask);
+}
+
+// Number of transfers where the core hasn't acknowledged at the first poll.
+static uint32_t spi_stalls = 0;
+
+uint32_t fpga_spi_stalls()
+{
+	return spi_stalls;
+}
+
+uint16_t fpga_spi(uint16_t word)
+{
+	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE)) | word;
+
+	fpga_gpo_write(gpo);
+	fpga_gpo_write(gpo | SSPI_STROBE);
+
+	int gpi, polls = 0;
+	do
+	{
+		gpi = fpga_gpi_read();
+		if (gpi < 0)
+		{
+			printf("GPI[31]==1. FPGA is uninitialized?\n");
+			fpga_wait_to_reset();
+			return 0;
+		}
+		polls++;
+	} while (!(gpi & SSPI_ACK));
+	if (polls > 1) spi_stalls++;
+
+	fpga_gpo_write(gpo);
+
+	do
+	{
+		gpi = fpga_gpi_read();
+		if (gpi < 0)
+		{
+			printf("GPI[31]==1. FPGA is uninitialized?\n");
+			fpga_wait_to_reset();
+			return 0;
+		}
+	} while (gpi & SSPI_ACK);
+
+	return (uint16_t)gpi;
+}
+
+uint16_t fpga_spi_fast(uint16_t word)
+{
+	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE)) | word;
+	fpga_gpo_write(gpo);
+	fpga_gpo_write(gpo | SSPI_STROBE);
+	fpga_gpo_write(gpo);
+	return (uint16_t)fpga_gpi_read();
+}
+
+void fpga_spi_fast_block_write(const uint16_t *buf, uint32_t length)
+{
+	uint32_t gpoH = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
+	uint32_t gpo = gpoH;
+
+	// should be optimized for speed by compiler automatically
+	while (length--)
+	{
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+	}
+	fpga_gpo_write(gpo);
+}
+
+void fpga_spi_fast_block_read(uint16_t *buf, uint32_t length)
+{
+	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
+	uint32_t rem = length % 16;
+	length /= 16;
+
+	// not optimized by compiler automatically
+	// so do manual optimization for speed.
+	while (length--)
+	{
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint16_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint16_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint16_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint16_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint16_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint16_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint16_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint16_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint16_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint16_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint16_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint16_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint16_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint16_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint16_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint16_t)fpga_gpi_read();
+	}
+
+	while (rem--)
+	{
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint16_t)fpga_gpi_read();
+	}
+}
+
+void fpga_spi_fast_block_write_8(const uint8_t *buf, uint32_t length)
+{
+	uint32_t gpoH = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
+	uint32_t gpo = gpoH;
+	uint32_t rem = length % 16;
+	length /= 16;
+
+	// not optimized by compiler automatically
+	// so do manual optimization for speed.
+	while (length--)
+	{
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+	}
+
+	while (rem--)
+	{
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+	}
+
+	fpga_gpo_write(gpo);
+}
+
+void fpga_spi_fast_block_read_8(uint8_t *buf, uint32_t length)
+{
+	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
+	uint32_t rem = length % 16;
+	length /= 16;
+
+	// not optimized by compiler automatically
+	// so do manual optimization for speed.
+	while (length--)
+	{
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint8_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint8_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint8_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint8_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint8_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint8_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint8_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint8_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint8_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint8_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint8_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint8_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint8_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint8_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint8_t)fpga_gpi_read();
+
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint8_t)fpga_gpi_read();
+	}
+
+	while (rem--)
+	{
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		*buf++ = (uint8_t)fpga_gpi_read();
+	}
+}
+
+void fpga_spi_fast_block_write_be(const uint16_t *buf, uint32_t length)
+{
+	uint32_t gpoH = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
+	uint32_t gpo = gpoH;
+
+	// should be optimized for speed by compiler automatically
+	while (length--)
+	{
+		uint16_t tmp = *buf++;
+		tmp = (tmp << 8) | (tmp >> 8);
+		gpo = gpoH | tmp;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+	}
+	fpga_gpo_write(gpo);
+}
+
+void fpga_spi_fast_block_read_be(uint16_t *buf, uint32_t length)
+{
+	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
+
+	// should be optimized for speed by compiler automatically
+	while (length--)
+	{
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+		fpga_gpo_writeN(gpo);
+		uint16_t tmp = (uint16_t)fpga_gpi_read();
+		*buf++ = (tmp << 8) | (tmp >> 8);
+	}
+}
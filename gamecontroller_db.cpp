@@ -2,7 +2,14 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <unordered_map>
 #include "input.h"
 #include "file_io.h"
 #include "user_io.h"
@@ -472,38 +479,284 @@ static bool parse_mapping_string(char *map_str, char *guid, int dev_fd, uint32_t
 #define GCDB_DIR  "/media/fat/linux/gamecontrollerdb/"
 
 
-bool read_controller_map_from_file(char *fname, char *guid, int dev_fd, uint32_t *fill_map)
+// Both databases are parsed once into GUID hash tables, holding the Linux/MiSTer entries of
+// each GUID in file order. Tables are rebuilt when a file changes (mtime/size) and kept in a
+// binary cache in config, so the text files are only parsed after they were edited.
+
+#define GCDB_CACHE_MAGIC 0x42444347 // "GCDB"
+#define GCDB_CACHE_VER   1
+
+struct gcdb_file_t
+{
+	int64_t mtime;
+	int64_t size;
+	std::string text;
+	std::unordered_map<uint64_t, std::vector<uint32_t>> index;
+};
+
+struct gcdb_cache_hdr_t
+{
+	uint32_t magic;
+	uint32_t version;
+	int64_t mtime[2];
+	int64_t size[2];
+	uint32_t count[2];
+	uint32_t text_size[2];
+};
+
+struct gcdb_cache_ent_t
+{
+	uint64_t key;
+	uint32_t offset;
+	uint32_t reserved;
+};
+
+// user entries override the others
+static const char *gcdb_names[2] = { "gamecontrollerdb_user.txt", "gamecontrollerdb.txt" };
+static gcdb_file_t gcdb_files[2];
+static int gcdb_loaded = 0;
+
+static int hex4(const char *p, uint16_t *val)
+{
+	uint16_t v = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		char c = p[i];
+		if (c >= '0' && c <= '9') v = (v << 4) | (c - '0');
+		else if (c >= 'a' && c <= 'f') v = (v << 4) | (c - 'a' + 10);
+		else if (c >= 'A' && c <= 'F') v = (v << 4) | (c - 'A' + 10);
+		else return 0;
+	}
+	*val = v;
+	return 1;
+}
+
+// Only GUIDs in the bustype/vid/pid/version form MiSTer generates can match.
+static int guid_key(const char *guid, int len, uint64_t *key)
+{
+	if (len != GUID_LEN - 1) return 0;
+
+	uint64_t k = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		uint16_t v;
+		if (!hex4(guid + i * 8, &v) || strncmp(guid + i * 8 + 4, "0000", 4)) return 0;
+		k = (k << 16) | v;
+	}
+
+	*key = k;
+	return 1;
+}
+
+static void gcdb_stat(const char *name, int64_t *mtime, int64_t *size)
+{
+	char path[256] = { GCDB_DIR };
+	strcat(path, name);
+
+	struct stat64 st;
+	if (stat64(path, &st) < 0)
+	{
+		*mtime = 0;
+		*size = -1;
+	}
+	else
+	{
+		*mtime = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+		*size = st.st_size;
+	}
+}
+
+static void gcdb_parse(int n)
 {
+	gcdb_file_t *db = &gcdb_files[n];
+	char path[256] = { GCDB_DIR };
+	strcat(path, gcdb_names[n]);
+
+	db->text.clear();
+	db->index.clear();
+
 	fileTextReader reader;
-	char matched[1024] = {};
-	char *map_start = NULL;
+	if (!FileOpenTextReader(&reader, path)) return;
 
-	if (FileOpenTextReader(&reader, fname))
+	int lines = 0;
+	const char *line;
+	while ((line = FileReadLine(&reader)))
 	{
-		const char *line;
-		printf("Gamecontrollerdb: searching for GUID %s in file %s\n", guid, fname);
-		while ((line = FileReadLine(&reader)))
+		if (line[0] == '#') continue;
+		const char *gcom = strchr(line, ',');
+		if (!gcom) continue;
+
+		uint64_t key;
+		if (!guid_key(line, gcom - line, &key)) continue;
+
+		// entries for other platforms can never match
+		const char *pl = strcasestr(gcom, "platform:");
+		if (!pl) continue;
+		pl += 9;
+		if (strncasecmp(pl, "Linux", 5) && strncasecmp(pl, "MiSTer", 6)) continue;
+
+		db->index[key].push_back(db->text.size());
+		db->text.append(gcom);
+		db->text.push_back(0);
+		lines++;
+	}
+
+	printf("Gamecontrollerdb: %d entries for %d GUIDs in %s\n", lines, (int)db->index.size(), path);
+}
+
+static int gcdb_load_cache(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	std::vector<char> buf;
+	struct stat64 st;
+	if (fstat64(fd, &st) == 0 && st.st_size > (off64_t)sizeof(gcdb_cache_hdr_t))
+	{
+		buf.resize(st.st_size);
+		if (read(fd, buf.data(), buf.size()) != (ssize_t)buf.size()) buf.clear();
+	}
+	close(fd);
+	if (buf.empty()) return 0;
+
+	gcdb_cache_hdr_t *hdr = (gcdb_cache_hdr_t*)buf.data();
+	if (hdr->magic != GCDB_CACHE_MAGIC || hdr->version != GCDB_CACHE_VER) return 0;
+
+	size_t need = sizeof(gcdb_cache_hdr_t);
+	for (int i = 0; i < 2; i++)
+	{
+		if (hdr->mtime[i] != gcdb_files[i].mtime || hdr->size[i] != gcdb_files[i].size) return 0;
+		need += hdr->count[i] * sizeof(gcdb_cache_ent_t) + hdr->text_size[i];
+	}
+	if (need != buf.size()) return 0;
+
+	const char *p = buf.data() + sizeof(gcdb_cache_hdr_t);
+	for (int i = 0; i < 2; i++)
+	{
+		gcdb_file_t *db = &gcdb_files[i];
+		const gcdb_cache_ent_t *ent = (const gcdb_cache_ent_t*)p;
+		p += hdr->count[i] * sizeof(gcdb_cache_ent_t);
+
+		db->index.clear();
+		db->text.assign(p, hdr->text_size[i]);
+		p += hdr->text_size[i];
+
+		for (uint32_t n = 0; n < hdr->count[i]; n++)
 		{
-			if (line[0] == '#') continue;
-			const char *gcom = strchr(line, ',');
-			if (!strncasecmp(line, guid, gcom-line))
-			{
-				if (cdb_entry_matches((char *)gcom))
-				{
-					map_start = strchr((char *)gcom+1, ',');
-					if (map_start)
-					{
-						strncpy(matched, map_start+1, sizeof(matched));
-					}
-				}
-			}
+			if (ent[n].offset >= db->text.size()) return 0;
+			db->index[ent[n].key].push_back(ent[n].offset);
 		}
+		if (!db->text.empty() && db->text.back()) return 0;
+	}
 
+	return 1;
+}
+
+static void gcdb_save_cache(const char *path)
+{
+	gcdb_cache_hdr_t hdr = {};
+	hdr.magic = GCDB_CACHE_MAGIC;
+	hdr.version = GCDB_CACHE_VER;
+
+	std::vector<gcdb_cache_ent_t> ents[2];
+	for (int i = 0; i < 2; i++)
+	{
+		gcdb_file_t *db = &gcdb_files[i];
+		for (auto &it : db->index)
+		{
+			for (uint32_t off : it.second) ents[i].push_back({ it.first, off, 0 });
+		}
+
+		// offsets keep the file order of entries with the same GUID
+		std::sort(ents[i].begin(), ents[i].end(), [](const gcdb_cache_ent_t &a, const gcdb_cache_ent_t &b) { return a.offset < b.offset; });
+
+		hdr.mtime[i] = db->mtime;
+		hdr.size[i] = db->size;
+		hdr.count[i] = ents[i].size();
+		hdr.text_size[i] = db->text.size();
+	}
+
+	char tmp[1024];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+	if (fd < 0) return;
+
+	int ok = (write(fd, &hdr, sizeof(hdr)) == sizeof(hdr));
+	for (int i = 0; i < 2 && ok; i++)
+	{
+		ssize_t size = ents[i].size() * sizeof(gcdb_cache_ent_t);
+		if (size) ok = (write(fd, ents[i].data(), size) == size);
+		size = gcdb_files[i].text.size();
+		if (ok && size) ok = (write(fd, gcdb_files[i].text.data(), size) == size);
 	}
-	if (matched[0] != 0)
+	close(fd);
+
+	if (!ok || rename(tmp, path))
 	{
-		printf("Gamecontrollerdb: found match, using config %s\n", matched);
-		return parse_mapping_string(matched, guid, dev_fd, fill_map);
+		printf("Gamecontrollerdb: couldn't write %s\n", path);
+		unlink(tmp);
+	}
+}
+
+static void gcdb_refresh()
+{
+	int changed = 0;
+	for (int i = 0; i < 2; i++)
+	{
+		int64_t mtime, size;
+		gcdb_stat(gcdb_names[i], &mtime, &size);
+		if (mtime != gcdb_files[i].mtime || size != gcdb_files[i].size) changed = 1;
+		gcdb_files[i].mtime = mtime;
+		gcdb_files[i].size = size;
+	}
+
+	if (!changed && gcdb_loaded) return;
+
+	// maps built from the old tables are stale
+	memset(db_maps, 0, sizeof(db_maps));
+	last_db_idx = 0;
+
+	char cache[1024];
+	snprintf(cache, sizeof(cache), "%s/" CONFIG_DIR "/gamecontrollerdb.idx", getRootDir());
+
+	if (!gcdb_loaded && gcdb_load_cache(cache))
+	{
+		printf("Gamecontrollerdb: loaded %s\n", cache);
+	}
+	else
+	{
+		for (int i = 0; i < 2; i++) gcdb_parse(i);
+		gcdb_save_cache(cache);
+	}
+
+	gcdb_loaded = 1;
+}
+
+static bool read_controller_map(int n, char *guid, int dev_fd, uint32_t *fill_map)
+{
+	gcdb_file_t *db = &gcdb_files[n];
+	uint64_t key;
+	if (!guid_key(guid, strlen(guid), &key)) return false;
+
+	auto it = db->index.find(key);
+	if (it == db->index.end()) return false;
+
+	// the last matching entry wins
+	std::string matched;
+	for (uint32_t off : it->second)
+	{
+		std::string entry(db->text.c_str() + off);
+		if (cdb_entry_matches(&entry[0]))
+		{
+			const char *map_start = strchr(entry.c_str() + 1, ',');
+			if (map_start) matched.assign(map_start + 1, strnlen(map_start + 1, 1023));
+		}
+	}
+
+	if (!matched.empty())
+	{
+		printf("Gamecontrollerdb: found match in %s, using config %s\n", gcdb_names[n], matched.c_str());
+		return parse_mapping_string(&matched[0], guid, dev_fd, fill_map);
 	}
 
 	return false;
@@ -540,6 +793,7 @@ static void gcdb_cache_controller_map(uint16_t bustype, uint16_t vid, uint16_t p
 bool gcdb_map_for_controller(uint16_t bustype, uint16_t vid, uint16_t pid, uint16_t version, int dev_fd, uint32_t *fill_map)
 {
 		PROFILE_FUNCTION();
+
 		char guid_str[GUID_LEN] = {};
 		int cache_idx = gcdb_controller_idx(bustype, vid, pid, version);
 		if (cache_idx != -1)
@@ -548,16 +802,15 @@ bool gcdb_map_for_controller(uint16_t bustype, uint16_t vid, uint16_t pid, uint1
 
 			return true;
 		}
+
+		// only a controller without a cached map checks the db files, a change drops the cached maps
+		gcdb_refresh();
 		sprintf(guid_str, "%04x0000%04x0000%04x0000%04x0000", (uint16_t)(bustype << 8 | bustype >> 8), (uint16_t)( vid << 8 |  vid >> 8), (uint16_t)(pid << 8 | pid >> 8), (uint16_t)(version << 8 | version >> 8));
 
-		char path[256] = {GCDB_DIR};
-		strcat(path, "gamecontrollerdb_user.txt");
 		bool found_entry = false;
-		if (!(found_entry = read_controller_map_from_file(path, guid_str, dev_fd, fill_map)))
+		for (int i = 0; i < 2 && !found_entry; i++)
 		{
-			strcpy(path, GCDB_DIR);
-			strcat(path, "gamecontrollerdb.txt");
-			found_entry = read_controller_map_from_file(path, guid_str, dev_fd, fill_map);
+			found_entry = read_controller_map(i, guid_str, dev_fd, fill_map);
 		}
 
 
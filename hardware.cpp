@@ -65,6 +65,15 @@ unsigned long GetTimer(unsigned long offset)
 	return (unsigned long)(res + offset);
 }
 
+// monotonic microsecond counter for measurements
+uint64_t GetTimerUs(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return ((uint64_t)tp.tv_sec * 1000000) + (tp.tv_nsec / 1000);
+}
+
 unsigned long CheckTimer(unsigned long time)
 {
 	return (!time) || (GetTimer(0) >= time);
@@ -7,6 +7,7 @@
 unsigned long GetTimer(unsigned long offset);
 unsigned long CheckTimer(unsigned long t);
 void WaitTimer(unsigned long time);
+uint64_t GetTimerUs(void);
 
 void hexdump(void *data, uint16_t size, uint16_t offset = 0);
 
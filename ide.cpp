@@ -19,7 +19,9 @@
 #include "user_io.h"
 #include "file_io.h"
 #include "hardware.h"
+#include "offload.h"
 #include "ide.h"
+#include "scheduler.h"
 
 #if 0
 	#define dbg_printf     printf
@@ -79,6 +81,12 @@ uint8_t ide_buf[ide_io_max_size * 512];
 
 ide_config ide_inst[2] = {};
 
+// second buffer for HDD reads, so the next block is read while the current one is sent.
+static uint8_t ide_buf2[ide_io_max_size * 512];
+static uint8_t *ide_rd_buf[2] = { ide_buf, ide_buf2 };
+
+static ide_stats_t ide_stats[2] = {};
+
 uint16_t ide_check()
 {
 	uint16_t res;
@@ -758,21 +766,66 @@ inline int readhdd(drive_t *drive, uint32_t lba, int cnt)
 	}
 }
 
+// Background read of the next block. Only plain files are read on the offload thread (with pread,
+// so the FILE position stays untouched), everything else is read synchronously by ide_read_finish.
+static OffloadEvent ide_read_done;
+static int ide_read_res = 0;
+static int ide_read_async = 0;
+
+static void ide_read_start(drive_t *drive, uint8_t *buf, uint32_t lba, uint32_t cnt)
+{
+	ide_read_async = (drive->f->filp && lba >= drive->offset);
+	if (!ide_read_async) return;
+
+	int fd = fileno(drive->f->filp);
+	uint64_t pos = (uint64_t)(lba - drive->offset) * 512;
+
+	ide_read_done.reset();
+	offload_add_work([=]
+	{
+		ssize_t ret = pread64(fd, buf, cnt * 512, pos);
+		if (ret > 0 && (uint32_t)ret < cnt * 512) memset(buf + ret, 0, cnt * 512 - ret);
+		ide_read_res = (int)ret;
+		ide_read_done.signal();
+	});
+}
+
+static int ide_read_finish(drive_t *drive, uint8_t *buf, uint32_t lba, uint32_t cnt)
+{
+	if (ide_read_async)
+	{
+		ide_read_async = 0;
+		ide_read_done.wait();
+		return ide_read_res;
+	}
+
+	if (!FileSeekLBA(drive->f, (lba <= drive->offset) ? 0 : (lba - drive->offset))) return 0;
+
+	int ret = readhdd(drive, lba, cnt);
+	if (buf != ide_buf) memcpy(buf, ide_buf, cnt * 512);
+	return ret;
+}
+
 static void process_read(ide_config *ide, int multi)
 {
+	drive_t *drive = &ide->drive[ide->regs.drv];
 	uint32_t lba = get_lba(ide);
 	uint16_t ide_req = 0;
+	int cur = 0;
+	uint64_t start = GetTimerUs();
+	uint32_t total = 0;
 
 	dbg2_printf("  sector_count: %d\n", ide->regs.sector_count);
 
 	uint32_t cnt = multi ? get_cnt(ide) : 1;
-	ide->null = !FileSeekLBA(ide->drive[ide->regs.drv].f, (lba <= ide->drive[ide->regs.drv].offset) ? 0 : (lba - ide->drive[ide->regs.drv].offset));
-	if (!ide->null) ide->null = (readhdd(&ide->drive[ide->regs.drv], lba, cnt) <= 0);
+	ide->null = !FileSeekLBA(drive->f, (lba <= drive->offset) ? 0 : (lba - drive->offset));
+	if (!ide->null) ide->null = (readhdd(drive, lba, cnt) <= 0);
 	if (ide->null) memset(ide_buf, 0, cnt * 512);
 
 	while (1)
 	{
 		lba += cnt;
+		total += cnt;
 		ide->regs.sector_count -= cnt;
 		put_lba(ide, lba);
 
@@ -780,14 +833,22 @@ static void process_read(ide_config *ide, int multi)
 		ide->regs.status = ATA_STATUS_RDP | ATA_STATUS_RDY | ATA_STATUS_DRQ | ATA_STATUS_IRQ;
 		if (!ide->regs.sector_count) ide->regs.status |= ATA_STATUS_END;
 
+		// start reading the next block into the other buffer while this one is sent
+		uint32_t next_cnt = 0;
+		if (ide->regs.sector_count)
+		{
+			next_cnt = multi ? get_cnt(ide) : 1;
+			if (!ide->null) ide_read_start(drive, ide_rd_buf[cur ^ 1], lba, next_cnt);
+		}
+
 		if (ide->regs.io_fast)
 		{
 			ide_set_regs(ide);
-			ide_send_data(ide_buf, cnt * 256);
+			ide_send_data(ide_rd_buf[cur], cnt * 256);
 		}
 		else
 		{
-			ide_send_data(ide_buf, cnt * 256);
+			ide_send_data(ide_rd_buf[cur], cnt * 256);
 			ide->regs.status &= ~ATA_STATUS_RDP;
 			ide_set_regs(ide);
 		}
@@ -799,13 +860,16 @@ static void process_read(ide_config *ide, int multi)
 			break;
 		}
 
-		cnt = multi ? get_cnt(ide) : 1;
-		if (!ide->null) ide->null = (readhdd(&ide->drive[ide->regs.drv], lba, cnt) <= 0);
-		if (ide->null) memset(ide_buf, 0, cnt * 512);
+		cnt = next_cnt;
+		cur ^= 1;
+		if (!ide->null && !ide_read_async) ide->null = (ide_read_finish(drive, ide_rd_buf[cur], lba, cnt) <= 0);
 
 		ide_req = 0;
 		while (!ide_req) ide_req = (ide_check() >> ide->bitoff) & 7;
 
+		if (!ide->null && ide_read_async) ide->null = (ide_read_finish(drive, ide_rd_buf[cur], lba, cnt) <= 0);
+		if (ide->null) memset(ide_rd_buf[cur], 0, cnt * 512);
+
 		if (ide_req != 5)
 		{
 			ide->state = IDE_STATE_IDLE;
@@ -813,6 +877,13 @@ static void process_read(ide_config *ide, int multi)
 		}
 	}
 
+	ide_stats_t *st = &ide_stats[ide == &ide_inst[1]];
+	uint32_t us = GetTimerUs() - start;
+	st->reads++;
+	st->read_sectors += total;
+	st->read_us += us;
+	if (us > st->read_max_us) st->read_max_us = us;
+
 	dbg2_printf("  finish\n");
 }
 
@@ -821,6 +892,8 @@ static void process_write(ide_config *ide, int multi)
 	uint32_t lba = get_lba(ide);
 	uint32_t cnt = 1;
 	uint16_t ide_req;
+	uint64_t start = GetTimerUs();
+	uint32_t total = 0;
 
 	ide->null = (ide->regs.cmd != 0xFA) ? !FileSeekLBA(ide->drive[ide->regs.drv].f, (lba <= ide->drive[ide->regs.drv].offset) ? 0 : (lba - ide->drive[ide->regs.drv].offset)) : 1;
 	uint8_t irq = 0;
@@ -859,6 +932,7 @@ static void process_write(ide_config *ide, int multi)
 		{
 			if (!ide->null) ide->null = (lba < ide->drive[ide->regs.drv].offset) ? 0 : (FileWriteAdv(ide->drive[ide->regs.drv].f, ide_buf, cnt * 512, -1) <= 0);
 			lba += cnt;
+			total += cnt;
 			ide->regs.sector_count -= cnt;
 			put_lba(ide, lba);
 		}
@@ -871,6 +945,39 @@ static void process_write(ide_config *ide, int multi)
 			break;
 		}
 	}
+
+	if (total)
+	{
+		ide_stats_t *st = &ide_stats[ide == &ide_inst[1]];
+		uint32_t us = GetTimerUs() - start;
+		st->writes++;
+		st->write_sectors += total;
+		st->write_us += us;
+		if (us > st->write_max_us) st->write_max_us = us;
+	}
+}
+
+void ide_get_stats(int num, ide_stats_t *stats)
+{
+	*stats = ide_stats[num & 1];
+}
+
+static void ide_print_stats(int num)
+{
+	ide_stats_t *st = &ide_stats[num & 1];
+	if (st->reads)
+	{
+		printf("IDE%d read: %u cmds, %llu sectors, avg %llu us, max %u us, %llu KB/s\n", num, st->reads, st->read_sectors,
+			st->read_us / st->reads, st->read_max_us, st->read_us ? (st->read_sectors * 512 * 1000000 / st->read_us) >> 10 : 0);
+	}
+
+	if (st->writes)
+	{
+		printf("IDE%d write: %u cmds, %llu sectors, avg %llu us, max %u us, %llu KB/s\n", num, st->writes, st->write_sectors,
+			st->write_us / st->writes, st->write_max_us, st->write_us ? (st->write_sectors * 512 * 1000000 / st->write_us) >> 10 : 0);
+	}
+
+	memset(st, 0, sizeof(*st));
 }
 
 static int handle_hdd(ide_config *ide)
@@ -957,6 +1064,7 @@ static int handle_hdd(ide_config *ide)
 void ide_io(int num, int req)
 {
 	ide_config *ide = &ide_inst[num];
+	if (req) scheduler_busy();
 
 	//printf("req: %d, disk: %d\n", req, num);
 
@@ -1026,6 +1134,7 @@ void ide_io(int num, int req)
 		if (ide->state != IDE_STATE_RESET)
 		{
 			printf("IDE %04X reset start\n", ide->base);
+			ide_print_stats(num);
 		}
 
 		ide->drive[0].playing = 0;
@@ -106,8 +106,6 @@ struct drive_t
 	uint8_t  atapi_ascq_code;
 
 	chd_file *chd_f;
-	int      chd_hunknum;
-	uint8_t	 *chd_hunkbuf;
 	uint32_t  chd_total_size;
 	uint32_t  chd_last_partial_lba;
 
@@ -126,6 +124,18 @@ struct ide_config
 	drive_t drive[2];
 };
 
+struct ide_stats_t
+{
+	uint32_t reads;
+	uint32_t writes;
+	uint64_t read_sectors;
+	uint64_t write_sectors;
+	uint64_t read_us;
+	uint64_t write_us;
+	uint32_t read_max_us;
+	uint32_t write_max_us;
+};
+
 struct chs_t
 {
 	uint32_t sectors;
@@ -149,6 +159,7 @@ void ide_recvbuf(ide_config *ide, uint16_t reg, uint32_t length, uint16_t *data)
 void ide_reg_set(ide_config *ide, uint16_t reg, uint16_t value);
 
 uint16_t ide_check();
+void ide_get_stats(int num, ide_stats_t *stats);
 int ide_img_mount(fileTYPE *f, const char *name, int rw);
 void ide_img_set(uint32_t drvnum, fileTYPE *f, int cd, int sectors = 0, int heads = 0, int offset = 0, int type = 0);
 int ide_is_placeholder(int num);
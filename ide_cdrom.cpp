@@ -4,6 +4,7 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <time.h>
 #include <ios>
 #include <fstream>
@@ -20,6 +21,10 @@
 #include "hardware.h"
 #include "cd.h"
 #include "ide.h"
+#include "offload.h"
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 #if 0
 #define dbg_printf     printf
@@ -296,13 +301,6 @@ static const char* load_chd_file(drive_t *drv, const char *chdfile)
 		return 0;
 	}
 
-	if (drv->chd_hunkbuf)
-	{
-		free(drv->chd_hunkbuf);
-	}
-
-	drv->chd_hunkbuf = (uint8_t *)malloc(tmpTOC.chd_hunksize);
-	drv->chd_hunknum = -1;
 	drv->chd_f = tmpTOC.chd_f;
 
 	//don't use add_track, just do it ourselves...
@@ -1063,7 +1061,7 @@ void cdrom_read(ide_config *ide)
 		for (uint32_t i = 0; i < cnt; i++)
 		{
 
-			if (mister_chd_read_sector(drive->chd_f, drive->chd_last_partial_lba + drive->track[drive->data_num].chd_offset, d_offset, hdr, 2048, ide_buf, drive->chd_hunkbuf, &drive->chd_hunknum) != CHDERR_NONE)
+			if (mister_chd_read_sector(drive->chd_f, drive->chd_last_partial_lba + drive->track[drive->data_num].chd_offset, d_offset, hdr, 2048, ide_buf) != CHDERR_NONE)
 			{
 				//I don't think anything else uses this, but set it just in case.
 				ide->null = 1;
@@ -1506,21 +1504,223 @@ void cdrom_reply(ide_config *ide, uint8_t error, uint8_t asc_code, uint8_t ascq_
 }
 
 
-void cdrom_close_chd(drive_t *drv)
+/*
+ * CDDA streaming
+ *
+ * Audio frames are read ahead of the play pointer into a ring. Plain image files are read on the
+ * offload thread (pread on the track's descriptor, so the FILE position used by data reads stays
+ * untouched). CHD and zipped images are read in batches on the main thread, as their decoders
+ * can't be shared. Volume and byte order are applied when a frame is sent, so a volume change
+ * takes effect immediately.
+ */
+#define CDDA_RING  64 // frames (~0.85s)
+#define CDDA_BATCH 16
+
+struct cdda_src_t
 {
+	int fd; // <0: silence
+	uint32_t pos;
+};
 
-	if (drv->chd_f)
+static uint8_t cdda_ring[CDDA_RING][BYTES_PER_RAW_REDBOOK_FRAME];
+static drive_t *cdda_drv = NULL;
+static uint32_t cdda_first = 0; // lba of the first frame in the ring
+static uint32_t cdda_count = 0; // valid frames from cdda_first
+
+static OffloadEvent cdda_fill_done;
+static int cdda_filling = 0;
+static uint32_t cdda_fill_cnt = 0; // frames being read, following the valid ones
+
+static struct
+{
+	uint32_t frames;
+	uint32_t hits;
+	uint32_t underruns;
+	uint32_t seeks;
+} cdda_stats = {};
+
+static uint8_t *cdda_frame(uint32_t lba)
+{
+	return cdda_ring[lba % CDDA_RING];
+}
+
+static int cdda_has(uint32_t lba)
+{
+	return lba >= cdda_first && lba < cdda_first + cdda_count;
+}
+
+static void cdda_print_stats()
+{
+	if (!cdda_stats.frames) return;
+
+	printf("CDDA: %u frames, %u from ring, %u underruns, %u seeks\n", cdda_stats.frames, cdda_stats.hits, cdda_stats.underruns, cdda_stats.seeks);
+	memset(&cdda_stats, 0, sizeof(cdda_stats));
+}
+
+static void cdda_fill_commit(int wait)
+{
+	if (!cdda_filling) return;
+	if (!wait && !cdda_fill_done.is_set()) return;
+
+	cdda_fill_done.wait();
+	cdda_count += cdda_fill_cnt;
+	cdda_filling = 0;
+}
+
+static void cdda_reset()
+{
+	cdda_fill_commit(1);
+	cdda_print_stats();
+	cdda_drv = NULL;
+	cdda_count = 0;
+}
+
+// Where the frame is stored. Returns 0 if it can only be read on the main thread (CHD, zip).
+static int cdda_locate(drive_t *drv, uint32_t lba, cdda_src_t *src)
+{
+	bool is_index0 = false;
+	track_t *track = get_track_from_lba(drv, lba, is_index0);
+
+	src->fd = -1;
+	src->pos = 0;
+	if (!track || track->attr) return 1;
+	if (drv->chd_f) return 0;
+
+	//If we're in the index0 area "audio pregap", that data is actually in the
+	//previous track.
+	track_t *read_track = track;
+	if (is_index0 && track->number > 1)
 	{
-		chd_close(drv->chd_f);
-		drv->chd_f = NULL;
+		//track number is 1-based, track array is zero.
+		read_track = &drv->track[track->number - 2];
+	}
+
+	if (!read_track->f.filp) return 0;
+
+	src->fd = fileno(read_track->f.filp);
+	src->pos = read_track->skip + (lba - read_track->start) * read_track->sectorSize;
+	return 1;
+}
+
+static void cdda_read_sync(drive_t *drv, uint32_t lba, uint8_t *buf)
+{
+	bool is_index0 = false;
+	track_t *track = get_track_from_lba(drv, lba, is_index0);
+
+	if (track && !track->attr)
+	{
+		if (drv->chd_f)
+		{
+			mister_chd_read_sector(drv->chd_f, lba + drv->track[drv->data_num].chd_offset, 0, 0, BYTES_PER_RAW_REDBOOK_FRAME, buf);
+		}
+		else
+		{
+			//It may be a 'PREGAP' which indicates no stored data
+			//If the seek fails just return zero data.
+			track_t *read_track = track;
+			if (is_index0 && track->number > 1) read_track = &drv->track[track->number - 2];
+
+			uint32_t pos = read_track->skip + (lba - read_track->start) * read_track->sectorSize;
+			if (!FileSeek(&read_track->f, pos, SEEK_SET) || FileReadAdv(&read_track->f, buf, BYTES_PER_RAW_REDBOOK_FRAME, -1) != BYTES_PER_RAW_REDBOOK_FRAME)
+			{
+				memset(buf, 0, BYTES_PER_RAW_REDBOOK_FRAME);
+			}
+		}
+	}
+	else
+	{
+		memset(buf, 0, BYTES_PER_RAW_REDBOOK_FRAME);
+	}
+}
+
+// Reads the next batch after the valid frames
+static void cdda_fill(drive_t *drv)
+{
+	if (cdda_filling) return;
+
+	uint32_t from = cdda_first + cdda_count;
+	if (from >= drv->play_end_lba) return;
+
+	uint32_t cnt = CDDA_RING - cdda_count;
+	if (cnt < CDDA_BATCH) return;
+	cnt = CDDA_BATCH;
+	if (cnt > drv->play_end_lba - from) cnt = drv->play_end_lba - from;
+
+	cdda_src_t src[CDDA_BATCH];
+	int async = 1;
+	for (uint32_t i = 0; i < cnt; i++) async &= cdda_locate(drv, from + i, &src[i]);
+
+	if (!async)
+	{
+		for (uint32_t i = 0; i < cnt; i++) cdda_read_sync(drv, from + i, cdda_frame(from + i));
+		cdda_count += cnt;
+		return;
 	}
 
-	if (drv->chd_hunkbuf)
+	cdda_filling = 1;
+	cdda_fill_cnt = cnt;
+	cdda_fill_done.reset();
+	offload_add_work([=]
+	{
+		for (uint32_t i = 0; i < cnt; i++)
+		{
+			uint8_t *buf = cdda_frame(from + i);
+			if (src[i].fd < 0 || pread(src[i].fd, buf, BYTES_PER_RAW_REDBOOK_FRAME, src[i].pos) != BYTES_PER_RAW_REDBOOK_FRAME)
+			{
+				memset(buf, 0, BYTES_PER_RAW_REDBOOK_FRAME);
+			}
+		}
+		cdda_fill_done.signal();
+	});
+}
+
+// Byte order and fixed-point volume (gain 0..256 = 0..1.0), samples alternate right/left.
+// Result is the same as the float multiplication with truncation it replaces.
+static void cdda_mix(int16_t *out, const int16_t *in, int cnt, int swap, int16_t gain_r, int16_t gain_l)
+{
+	int i = 0;
+
+#ifdef __ARM_NEON
+	const int16_t g[8] = { gain_r, gain_l, gain_r, gain_l, gain_r, gain_l, gain_r, gain_l };
+	int16x8_t gain = vld1q_s16(g);
+
+	for (; i + 8 <= cnt; i += 8)
+	{
+		int16x8_t smp = vld1q_s16(in + i);
+		if (swap) smp = vreinterpretq_s16_u8(vrev16q_u8(vreinterpretq_u8_s16(smp)));
+
+		int32x4_t lo = vmull_s16(vget_low_s16(smp), vget_low_s16(gain));
+		int32x4_t hi = vmull_s16(vget_high_s16(smp), vget_high_s16(gain));
+
+		// +255 for negative products, so the shift rounds towards zero
+		lo = vaddq_s32(lo, vreinterpretq_s32_u32(vshrq_n_u32(vreinterpretq_u32_s32(vshrq_n_s32(lo, 31)), 24)));
+		hi = vaddq_s32(hi, vreinterpretq_s32_u32(vshrq_n_u32(vreinterpretq_u32_s32(vshrq_n_s32(hi, 31)), 24)));
+
+		vst1q_s16(out + i, vcombine_s16(vshrn_n_s32(lo, 8), vshrn_n_s32(hi, 8)));
+	}
+#endif
+
+	for (; i < cnt; i++)
+	{
+		int32_t smp = swap ? (int16_t)bswap_16(in[i]) : in[i];
+		out[i] = (int16_t)((smp * ((i & 1) ? gain_l : gain_r)) / 256);
+	}
+}
+
+static int16_t cdda_gain(float volume)
+{
+	int gain = (int)(volume * 256 + 0.5f);
+	return (gain < 0) ? 0 : (gain > 256) ? 256 : gain;
+}
+
+void cdrom_close_chd(drive_t *drv)
+{
+
+	if (drv->chd_f)
 	{
-		free(drv->chd_hunkbuf);
-		drv->chd_hunkbuf = NULL;
+		mister_chd_close(drv->chd_f);
+		drv->chd_f = NULL;
 	}
-	drv->chd_hunknum = -1;
 }
 
 const char* cdrom_parse(uint32_t num, const char *filename)
@@ -1531,6 +1731,7 @@ const char* cdrom_parse(uint32_t num, const char *filename)
 	num >>= 1;
 
 	//always close files and reset state. empty filename == unmounted cd from OSD
+	cdda_reset();
 	cdrom_close_chd(&ide_inst[num].drive[drv]);
 	for (uint8_t i = 0; i < sizeof(ide_inst[num].drive[drv].track) / sizeof(track_t); i++)
 	{
@@ -1556,8 +1757,7 @@ const char* cdrom_parse(uint32_t num, const char *filename)
 
 void ide_cdda_send_sector()
 {
-	bool is_index0 = false;
-	static uint8_t cdda_buf[BYTES_PER_RAW_REDBOOK_FRAME];
+	static int16_t cdda_buf[BYTES_PER_RAW_REDBOOK_FRAME / 2];
 	drive_t *drv = NULL;
 	ide_config *ide = NULL;
 	int ide_idx = -1;
@@ -1577,53 +1777,45 @@ void ide_cdda_send_sector()
 
 	if (!drv || !ide) return;
 
-	bool needs_swap = false;
-	track_t *track = get_track_from_lba(drv, drv->play_start_lba, is_index0);
+	uint32_t lba = drv->play_start_lba;
 
-	if (!track->attr)
+	if (cdda_drv != drv)
 	{
-		if (drv->chd_f)
-		{
-			mister_chd_read_sector(drv->chd_f, drv->play_start_lba + drv->track[drv->data_num].chd_offset, 0, 0, BYTES_PER_RAW_REDBOOK_FRAME, cdda_buf, drv->chd_hunkbuf, &drv->chd_hunknum);
-			needs_swap = true;
-		}
-		else
-		{
-			//If we're in the index0 area "audio pregap", that data is actually in the
-			//previous track. Use that file object, seek and return the data from there.
-			//If the seek fails just return zero data.
-			//It may be a 'PREGAP' which indicates no stored data
+		cdda_reset();
+		cdda_drv = drv;
+		cdda_first = lba;
+	}
 
-			track_t *read_track = track;
-			if (is_index0 && track->number > 1)
-			{
-				//track number is 1-based, track array is zero. 
-				read_track = &drv->track[track->number-2];
+	cdda_fill_commit(0);
+	if (cdda_filling && !cdda_has(lba))
+	{
+		// the read ahead didn't keep up (or playback moved elsewhere)
+		cdda_fill_commit(1);
+		if (cdda_has(lba)) cdda_stats.underruns++;
+	}
 
-			}
-			uint32_t pos = read_track->skip + (drv->play_start_lba - read_track->start) * read_track->sectorSize;
-			if (FileSeek(&read_track->f, pos, SEEK_SET))
-			{
-				FileReadAdv(&read_track->f, cdda_buf, sizeof(cdda_buf), -1);
-			} else {
-				memset(cdda_buf, 0, sizeof(cdda_buf));
-			}
-		}
+	if (cdda_has(lba))
+	{
+		cdda_stats.hits++;
 	}
 	else
 	{
-		memset(cdda_buf, 0, sizeof(cdda_buf));
+		// play/resume somewhere else, or the ring ran dry
+		if (lba == cdda_first + cdda_count) cdda_stats.underruns++;
+		else cdda_stats.seeks++;
+
+		cdda_first = lba;
+		cdda_count = 1;
+		cdda_read_sync(drv, lba, cdda_frame(lba));
 	}
 
-	int16_t *cdda_buf16 = (int16_t *)cdda_buf;
-	const int buf_wsize = sizeof(cdda_buf) / 2;
+	// keep the current frame, so resuming after a pause is served from the ring as well
+	cdda_count -= lba - cdda_first;
+	cdda_first = lba;
+	cdda_stats.frames++;
 
-	for (int sidx = 0; sidx < buf_wsize; sidx++)
-	{
-		if (needs_swap) cdda_buf16[sidx] = bswap_16(cdda_buf16[sidx]);
-		double tmps = (double)cdda_buf16[sidx];
-		cdda_buf16[sidx] = (int16_t)(tmps*((sidx & 1) ? drv->volume_l : drv->volume_r));
-	}
+	const int buf_wsize = sizeof(cdda_buf) / 2;
+	cdda_mix(cdda_buf, (int16_t *)cdda_frame(lba), buf_wsize, drv->chd_f != NULL, cdda_gain(drv->volume_r), cdda_gain(drv->volume_l));
 
 	ide_sendbuf(ide, 0x200, buf_wsize, (uint16_t *)cdda_buf);
 
@@ -1632,5 +1824,10 @@ void ide_cdda_send_sector()
 	{
 		drv->playing = 0;
 		drv->paused = 0;
+		cdda_print_stats();
+	}
+	else
+	{
+		cdda_fill(drv);
 	}
 }
@@ -6,6 +6,9 @@
 #include <string.h>
 #include <sys/inotify.h>
 #include <sys/poll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/sysinfo.h>
 #include <dirent.h>
 #include <errno.h>
@@ -32,6 +35,8 @@
 #include "profiling.h"
 #include "gamecontroller_db.h"
 #include "str_util.h"
+#include "ide.h"
+#include "support/chd/mister_chd.h"
 
 #define NUMDEV 30
 #define NUMPLAYERS 6
@@ -39,7 +44,8 @@
 
 char joy_bnames[NUMBUTTONS][32] = {};
 int  joy_bcount = 0;
-static struct pollfd pool[NUMDEV + 3];
+static struct pollfd pool[NUMDEV + 4];
+static void input_reader_stop();
 
 static int ev2amiga[] =
 {
@@ -4322,6 +4328,7 @@ int process_joycon(int dev, input_event *ev, input_absinfo *absinfo)
 			led_path = get_led_path(r); if (led_path) set_led(led_path, ":combo", id);
 
 			printf("Close all devices.\n");
+			input_reader_stop();
 			for (int i = 0; i < NUMDEV; i++) if (pool[i].fd >= 0)
 			{
 				ioctl(pool[i].fd, EVIOCGRAB, 0);
@@ -4610,6 +4617,340 @@ static void setup_wheels()
 	}
 }
 
+// Input reader thread (input_thread=1). While the device set is stable (state 2 of input_test) the thread
+// reads the evdev and mouse fds and passes the events with their timestamps through a single-producer
+// ring, then maps and sends them to the core itself with input_poll(). Mapping talks to the FPGA and
+// the menu, so it runs under input_lock: the main loop holds it while it runs and hands it over between
+// coroutine steps and while it sleeps (input_handoff/input_unlock), never in the middle of an SPI
+// transfer. Until the scheduler takes the lock (getchar callers at startup) the ring is drained by
+// input_test() on the main loop, woken by the eventfd.
+#define INPUT_RING_SIZE 1024
+
+struct input_ring_t
+{
+	int dev;
+	int len;
+	uint8_t data[4];
+	struct input_event ev;
+};
+
+static input_ring_t input_ring[INPUT_RING_SIZE];
+static uint32_t input_ring_head = 0;
+static uint32_t input_ring_tail = 0;
+static pthread_t input_reader_thread;
+static int input_reader_active = 0;
+static volatile int input_reader_quit = 0;
+static int input_reader_stop_fd = -1;
+static pthread_mutex_t input_lock_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int input_reader_map = 0;
+static int input_reader_wants = 0;
+
+// input event to SPI latency in buckets of <0.25,<0.5,<1,<2,<4,<8,<16,<32,<64,>=64 ms
+#define INPUT_LAT_BUCKETS 10
+static uint32_t input_lat_hist[INPUT_LAT_BUCKETS] = {};
+static uint32_t input_lat_max = 0;
+static struct timeval input_lat_ts = {};
+
+static uint64_t input_now_us()
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+static void *input_reader(void *)
+{
+	profiling_thread_name("input");
+
+	struct pollfd fds[NUMDEV + 1];
+	for (int i = 0; i < NUMDEV; i++)
+	{
+		fds[i].fd = pool[i].fd;
+		fds[i].events = POLLIN;
+	}
+
+	fds[NUMDEV].fd = input_reader_stop_fd;
+	fds[NUMDEV].events = POLLIN;
+
+	while (!input_reader_quit)
+	{
+		if (poll(fds, NUMDEV + 1, -1) < 0)
+		{
+			if (errno == EINTR) continue;
+			break;
+		}
+
+		if (fds[NUMDEV].revents) break;
+
+		int pushed = 0;
+		for (int i = 0; i < NUMDEV; i++)
+		{
+			if (fds[i].fd < 0 || !fds[i].revents) continue;
+
+			uint32_t head = input_ring_head;
+			while (head - __atomic_load_n(&input_ring_tail, __ATOMIC_ACQUIRE) >= INPUT_RING_SIZE)
+			{
+				if (input_reader_quit) return 0;
+				usleep(1000);
+			}
+
+			input_ring_t *e = &input_ring[head & (INPUT_RING_SIZE - 1)];
+			e->dev = i;
+
+			int ret;
+			if (input[i].mouse)
+			{
+				memset(e->data, 0, sizeof(e->data));
+				ret = read(fds[i].fd, e->data, sizeof(e->data));
+				uint64_t now = input_now_us();
+				e->ev.time.tv_sec = now / 1000000;
+				e->ev.time.tv_usec = now % 1000000;
+			}
+			else
+			{
+				memset(&e->ev, 0, sizeof(e->ev));
+				ret = read(fds[i].fd, &e->ev, sizeof(e->ev));
+				if (ret != sizeof(e->ev)) ret = 0;
+			}
+
+			if (ret <= 0)
+			{
+				// device is gone, inotify will make input_test reopen the devices
+				if (ret < 0 && errno != EAGAIN && errno != EINTR) fds[i].fd = -1;
+				continue;
+			}
+
+			e->len = ret;
+			__atomic_store_n(&input_ring_head, head + 1, __ATOMIC_RELEASE);
+			pushed = 1;
+		}
+
+		if (!pushed) continue;
+
+		if (!__atomic_load_n(&input_reader_map, __ATOMIC_ACQUIRE))
+		{
+			uint64_t one = 1;
+			write(pool[NUMDEV + 3].fd, &one, sizeof(one));
+			continue;
+		}
+
+		__atomic_store_n(&input_reader_wants, 1, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&input_lock_mtx);
+		__atomic_store_n(&input_reader_wants, 0, __ATOMIC_RELEASE);
+
+		if (!input_reader_quit) input_poll(0);
+
+		// read under the lock, the main loop clears it only when it restarts the reader
+		int quit = input_reader_quit;
+		pthread_mutex_unlock(&input_lock_mtx);
+		if (quit) break;
+	}
+
+	return 0;
+}
+
+static void input_reader_start()
+{
+	if (!cfg.input_thread || input_reader_active) return;
+
+	if (pool[NUMDEV + 3].fd < 0) pool[NUMDEV + 3].fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pool[NUMDEV + 3].events = POLLIN;
+	input_reader_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (pool[NUMDEV + 3].fd < 0 || input_reader_stop_fd < 0)
+	{
+		printf("ERR: input reader eventfd\n");
+		return;
+	}
+
+	input_ring_head = input_ring_tail = 0;
+	input_reader_quit = 0;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	// core #1 is busy with the main loop
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	input_reader_active = !pthread_create(&input_reader_thread, &attr, input_reader, nullptr);
+	pthread_attr_destroy(&attr);
+}
+
+static int input_is_reader()
+{
+	return input_reader_active && pthread_equal(pthread_self(), input_reader_thread);
+}
+
+// must be called before the device fds are closed
+static void input_reader_stop()
+{
+	if (!input_reader_active) return;
+
+	input_reader_quit = 1;
+	if (input_is_reader())
+	{
+		// a joycon combo mapped on the reader itself, it exits when it releases input_lock
+		pthread_detach(input_reader_thread);
+	}
+	else
+	{
+		uint64_t one = 1;
+		write(input_reader_stop_fd, &one, sizeof(one));
+
+		// the reader may be waiting for input_lock held by the main loop
+		if (input_reader_map) pthread_mutex_unlock(&input_lock_mtx);
+		pthread_join(input_reader_thread, nullptr);
+		if (input_reader_map) pthread_mutex_lock(&input_lock_mtx);
+	}
+
+	close(input_reader_stop_fd);
+	input_reader_stop_fd = -1;
+	input_reader_active = 0;
+	input_ring_tail = input_ring_head;
+}
+
+static int input_ring_pop(input_ring_t *e)
+{
+	uint32_t tail = input_ring_tail;
+	if (tail == __atomic_load_n(&input_ring_head, __ATOMIC_ACQUIRE)) return 0;
+
+	*e = input_ring[tail & (INPUT_RING_SIZE - 1)];
+	__atomic_store_n(&input_ring_tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+// event from the ring or directly from the device
+static int input_read(int i, input_ring_t *re, void *buf, int size)
+{
+	if (!re) return read(pool[i].fd, buf, size);
+
+	if (re->len < size) size = re->len;
+	if (input[i].mouse) memcpy(buf, re->data, size);
+	else memcpy(buf, &re->ev, size);
+	return size;
+}
+
+// account the previous ring event once it has been processed (and sent to the core)
+static void input_latency_commit()
+{
+	if (!input_lat_ts.tv_sec) return;
+
+	uint64_t ts = (uint64_t)input_lat_ts.tv_sec * 1000000 + input_lat_ts.tv_usec;
+	uint64_t now = input_now_us();
+	uint32_t lat = (now > ts) ? (uint32_t)(now - ts) : 0;
+	input_lat_ts.tv_sec = 0;
+
+	int b = 0;
+	while (b < INPUT_LAT_BUCKETS - 1 && lat >= (250u << b)) b++;
+	input_lat_hist[b]++;
+	if (lat > input_lat_max) input_lat_max = lat;
+}
+
+static void input_latency_print()
+{
+	static const char *names[INPUT_LAT_BUCKETS] = { "<0.25", "<0.5", "<1", "<2", "<4", "<8", "<16", "<32", "<64", ">=64" };
+
+	if (!input_reader_active)
+	{
+		printf("Input latency: input_thread is not active.\n");
+		return;
+	}
+
+	printf("Input latency (ms), max %u us:\n", input_lat_max);
+	for (int i = 0; i < INPUT_LAT_BUCKETS; i++) printf("  %5s: %u\n", names[i], input_lat_hist[i]);
+
+	memset(input_lat_hist, 0, sizeof(input_lat_hist));
+	input_lat_max = 0;
+}
+
+// Taken by the main loop when the scheduler starts, from then on the reader maps the events itself.
+void input_lock()
+{
+	pthread_mutex_lock(&input_lock_mtx);
+	__atomic_store_n(&input_reader_map, 1, __ATOMIC_RELEASE);
+}
+
+void input_unlock()
+{
+	pthread_mutex_unlock(&input_lock_mtx);
+}
+
+// let a waiting reader map its events, called by the main loop between coroutine steps
+void input_handoff()
+{
+	if (!__atomic_load_n(&input_reader_wants, __ATOMIC_ACQUIRE)) return;
+
+	pthread_mutex_unlock(&input_lock_mtx);
+	while (__atomic_load_n(&input_reader_wants, __ATOMIC_ACQUIRE)) sched_yield();
+	pthread_mutex_lock(&input_lock_mtx);
+}
+
+static void chd_stats_print()
+{
+	chd_cache_stats_t st;
+	mister_chd_cache_stats(&st);
+
+	uint32_t total = st.hits + st.misses;
+	printf("CHD cache: %u hits, %u misses (%u%% hit), %u hunks read ahead, %u evicted\n",
+		st.hits, st.misses, total ? (uint32_t)((uint64_t)st.hits * 100 / total) : 0, st.prefetched, st.evicted);
+}
+
+static void sd_stats_print()
+{
+	int cnt = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		sd_cache_stats_t st;
+		user_io_sd_cache_stats(i, &st);
+		if (!st.hits && !st.misses) continue;
+
+		printf("SD%d read-ahead: %u hits, %u misses (%u%% hit), %u windows read ahead, %u dropped\n", i,
+			st.hits, st.misses, (uint32_t)((uint64_t)st.hits * 100 / (st.hits + st.misses)), st.prefetched, st.dropped);
+		cnt++;
+	}
+
+	if (!cnt) printf("SD read-ahead: no reads.\n");
+}
+
+static void ide_stats_print()
+{
+	int cnt = 0;
+	for (int i = 0; i < 2; i++)
+	{
+		ide_stats_t st;
+		ide_get_stats(i, &st);
+
+		if (st.reads)
+		{
+			printf("IDE%d read: %u cmds, %llu sectors, avg %llu us, max %u us\n", i, st.reads, st.read_sectors, st.read_us / st.reads, st.read_max_us);
+			cnt++;
+		}
+
+		if (st.writes)
+		{
+			printf("IDE%d write: %u cmds, %llu sectors, avg %llu us, max %u us\n", i, st.writes, st.write_sectors, st.write_us / st.writes, st.write_max_us);
+			cnt++;
+		}
+	}
+
+	if (!cnt) printf("IDE: no transfers since the last reset.\n");
+}
+
+// fds watched by input_test (devices, inotify, command fifo, led monitor)
+int input_pollfds(struct pollfd **fds)
+{
+	if (input_reader_active)
+	{
+		*fds = pool + NUMDEV;
+		return 4;
+	}
+
+	*fds = pool;
+	return NUMDEV + 3;
+}
+
 int input_test(int getchar)
 {
 	static char cur_leds = 0;
@@ -4617,6 +4958,7 @@ int input_test(int getchar)
 	struct input_absinfo absinfo;
 	struct input_event ev;
 	static uint32_t timeout = 0;
+	int reader = input_is_reader();
 
 	if (touch_rel && CheckTimer(touch_rel))
 	{
@@ -4691,6 +5033,10 @@ int input_test(int getchar)
 
 							ioctl(pool[n].fd, EVIOCGUNIQ(sizeof(uniq)), uniq);
 							ioctl(pool[n].fd, EVIOCGNAME(sizeof(input[n].name)), input[n].name);
+
+							// timestamps comparable with CLOCK_MONOTONIC for the latency histogram
+							int clk = CLOCK_MONOTONIC;
+							if (cfg.input_thread) ioctl(pool[n].fd, EVIOCSCLOCKID, &clk);
 							input[n].led = has_led(pool[n].fd);
 						}
 
@@ -4984,6 +5330,7 @@ int input_test(int getchar)
 		}
 		cur_leds |= 0x80;
 		state++;
+		input_reader_start();
 	}
 
 	if (cfg.bt_auto_disconnect)
@@ -5021,7 +5368,7 @@ int input_test(int getchar)
 
 		while (1)
 		{
-			if (cfg.rumble && !is_menu())
+			if (!reader && cfg.rumble && !is_menu())
 			{
 				for (int i = 0; i < NUMDEV; i++)
 				{
@@ -5035,7 +5382,8 @@ int input_test(int getchar)
 				}
 			}
 
-			int return_value = poll(pool, NUMDEV + 3, timeout);
+			// the reader only maps the events it has put in the ring, the fds are polled by the main loop
+			int return_value = reader ? 1 : input_reader_active ? poll(pool + NUMDEV, 4, timeout) : poll(pool, NUMDEV + 3, timeout);
 			if (!return_value) break;
 
 			if (return_value < 0)
@@ -5044,9 +5392,18 @@ int input_test(int getchar)
 				break;
 			}
 
-			if ((pool[NUMDEV].revents & POLLIN) && check_devs())
+			int ring_cnt = 0;
+			if (input_reader_active && (reader || (pool[NUMDEV + 3].revents & POLLIN)))
+			{
+				uint64_t cnt;
+				if (!reader) read(pool[NUMDEV + 3].fd, &cnt, sizeof(cnt));
+				ring_cnt = __atomic_load_n(&input_ring_head, __ATOMIC_ACQUIRE) - input_ring_tail;
+			}
+
+			if (!reader && (pool[NUMDEV].revents & POLLIN) && check_devs())
 			{
 				printf("Close all devices.\n");
+				input_reader_stop();
 				for (int i = 0; i < NUMDEV; i++) if (pool[i].fd >= 0)
 				{
 					ioctl(pool[i].fd, EVIOCGRAB, 0);
@@ -5056,23 +5413,39 @@ int input_test(int getchar)
 				return 0;
 			}
 
-			for (int pos = 0; pos < NUMDEV; pos++)
+			for (int pos = 0; pos < (input_reader_active ? ring_cnt : NUMDEV); pos++)
 			{
 				int i = pos;
+				input_ring_t re;
+				input_ring_t *from_ring = 0;
 
+				if (input_reader_active)
+				{
+					input_latency_commit();
+					if (!input_ring_pop(&re)) break;
+					from_ring = &re;
+					i = re.dev;
+					input_lat_ts = re.ev.time;
+				}
 
-				if ((pool[i].fd >= 0) && (pool[i].revents & POLLIN))
+				if ((pool[i].fd >= 0) && (from_ring || (pool[i].revents & POLLIN)))
 				{
 					if (!input[i].mouse)
 					{
 
 						memset(&ev, 0, sizeof(ev));
-						if (read(pool[i].fd, &ev, sizeof(ev)) == sizeof(ev))
+						if (input_read(i, from_ring, &ev, sizeof(ev)) == sizeof(ev))
 						{
 							if (getchar)
 							{
 								if (ev.type == EV_KEY && ev.value >= 1)
 								{
+									// wake the next call for the events left in the ring
+									if (from_ring && input_ring_tail != __atomic_load_n(&input_ring_head, __ATOMIC_ACQUIRE))
+									{
+										uint64_t one = 1;
+										write(pool[NUMDEV + 3].fd, &one, sizeof(one));
+									}
 									return ev.code;
 								}
 							}
@@ -5544,7 +5917,7 @@ int input_test(int getchar)
 					else
 					{
 						uint8_t data[4] = {};
-						if (read(pool[i].fd, data, sizeof(data)))
+						if (input_read(i, from_ring, data, sizeof(data)))
 						{
 							int edev = i;
 							int dev = i;
@@ -5627,6 +6000,10 @@ int input_test(int getchar)
 				}
 			}
 
+			input_latency_commit();
+
+			if (reader) break;
+
 			if ((pool[NUMDEV + 1].fd >= 0) && (pool[NUMDEV + 1].revents & POLLIN))
 			{
 				static char cmd[1024];
@@ -5642,6 +6019,30 @@ int input_test(int getchar)
 						if(isXmlName(cmd)) xml_load(cmd + 10);
 						else fpga_load_rbf(cmd + 10);
 					}
+					else if (!strncmp(cmd, "trace", 5))
+					{
+						profiling_cmd(cmd);
+					}
+					else if (!strcmp(cmd, "input_latency"))
+					{
+						input_latency_print();
+					}
+					else if (!strcmp(cmd, "chd_stats"))
+					{
+						chd_stats_print();
+					}
+					else if (!strcmp(cmd, "sd_stats"))
+					{
+						sd_stats_print();
+					}
+					else if (!strcmp(cmd, "ide_stats"))
+					{
+						ide_stats_print();
+					}
+					else if (!strcmp(cmd, "neogeo_bench"))
+					{
+						neogeo_bench();
+					}
 					else if (!strncmp(cmd, "screenshot", 10))
 					{
 						user_io_screenshot_cmd(cmd);
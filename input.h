@@ -78,6 +78,10 @@ void sysled_enable(int en);
 
 void input_notify_mode();
 int input_poll(int getchar);
+int input_pollfds(struct pollfd **fds);
+void input_lock();
+void input_unlock();
+void input_handoff();
 int is_key_pressed(int key);
 
 void start_map_setting(int cnt, int set = 0);
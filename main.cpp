@@ -33,6 +33,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "scheduler.h"
 #include "osd.h"
 #include "offload.h"
+#include "profiling.h"
 
 const char *version = "$VER:" VDATE;
 
@@ -45,6 +46,7 @@ int main(int argc, char *argv[])
 	CPU_ZERO(&set);
 	CPU_SET(1, &set);
 	sched_setaffinity(0, sizeof(set), &set);
+	profiling_thread_name("main");
 
 	offload_start();
 
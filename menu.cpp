@@ -362,7 +362,7 @@ static int changeDir(char *dir)
 		strcat(selPath, dir);
 	}
 
-	ScanDirectory(selPath, SCANF_INIT, fs_pFileExt, fs_Options);
+	ScanDirectory(selPath, SCANF_INIT, fs_pFileExt, fs_Options | SCANO_BROWSE);
 	if(curdir[0])
 	{
 		ScanDirectory(selPath, SCANF_SET_ITEM, curdir, fs_Options);
@@ -424,7 +424,7 @@ void SelectFile(const char* path, const char* pFileExt, int Options, unsigned ch
 		}
 	}
 
-	ScanDirectory(selPath, SCANF_INIT, pFileExt, Options);
+	ScanDirectory(selPath, SCANF_INIT, pFileExt, Options | SCANO_BROWSE);
 	AdjustDirectory(selPath);
 
 	strcpy(fs_pFileExt, pFileExt);
@@ -2040,6 +2040,8 @@ void HandleUI(void)
 		parentstate = menustate;
 		if (menu_save_timer && CheckTimer(menu_save_timer))
 		{
+			// make sure saved data reached the storage before dismissing the message
+			user_io_sd_flush(1);
 			menu_save_timer = 0;
 			menustate = MENU_GENERIC_MAIN1;
 		}
@@ -4995,6 +4997,12 @@ void HandleUI(void)
 	case MENU_FILE_SELECT2:
 		menumask = 0;
 
+		if (flist_Refresh())
+		{
+			menustate = MENU_FILE_SELECT1;
+			break;
+		}
+
 		if (c == KEY_BACKSPACE && (fs_Options & (SCANO_UMOUNT | SCANO_CLEAR)) && !strlen(filter))
 		{
 			for (int i = 0; i < OsdGetSize(); i++) OsdWrite(i, "", 0, 0);
@@ -5049,7 +5057,7 @@ void HandleUI(void)
 		{
 			filter[0] = 0;
 			filter_typing_timer = 0;
-			ScanDirectory(selPath, SCANF_INIT, fs_pFileExt, fs_Options);
+			ScanDirectory(selPath, SCANF_INIT, fs_pFileExt, fs_Options | SCANO_BROWSE);
 			menustate = MENU_FILE_SELECT1;
 		}
 
@@ -5060,7 +5068,7 @@ void HandleUI(void)
 			if (c == KEY_HOME || c == KEY_TAB)
 			{
 				filter_typing_timer = 0;
-				ScanDirectory(selPath, SCANF_INIT, fs_pFileExt, fs_Options);
+				ScanDirectory(selPath, SCANF_INIT, fs_pFileExt, fs_Options | SCANO_BROWSE);
 				menustate = MENU_FILE_SELECT1;
 				select = (c == KEY_TAB && flist_SelectedItem()->de.d_type == DT_DIR && !strcmp(flist_SelectedItem()->de.d_name, ".."));
 			}
@@ -5113,7 +5121,7 @@ void HandleUI(void)
 						// You need both ScanDirectory calls here: the first
 						// call "clears" the filter, the second one scrolls to
 						// the right place in the list
-						ScanDirectory(selPath, SCANF_INIT, fs_pFileExt, fs_Options);
+						ScanDirectory(selPath, SCANF_INIT, fs_pFileExt, fs_Options | SCANO_BROWSE);
 						ScanDirectory(selPath, i, fs_pFileExt, fs_Options);
 					}
 					else if (filter_len < 255)
@@ -22,6 +22,8 @@ static bool s_quit;
 
 static void *worker_thread(void *)
 {
+	profiling_thread_name("offload");
+
 	while (true)
 	{
 		Work *current_work = nullptr;
@@ -52,7 +54,10 @@ static void *worker_thread(void *)
 		pthread_mutex_unlock(&s_queue_lock);
 
 		// execute
-		current_work->handler();
+		{
+			PROFILE_SCOPE("offload_work");
+			current_work->handler();
+		}
 		current_work->handler = nullptr;
 
 		// lock and move tail forward
@@ -119,4 +124,70 @@ void offload_add_work(std::function<void()> handler)
 	pthread_cond_signal(&s_cond_work);
 
 	pthread_mutex_unlock(&s_queue_lock);
-}
\ No newline at end of file
+}
+
+// Same as offload_add_work but doesn't wait if the queue is full.
+// Used for speculative work like read-ahead which can be skipped.
+bool offload_try_add_work(std::function<void()> handler)
+{
+	pthread_mutex_lock(&s_queue_lock);
+
+	if ((s_queue_head - s_queue_tail) == QUEUE_SIZE)
+	{
+		pthread_mutex_unlock(&s_queue_lock);
+		return false;
+	}
+
+	Work *work = &s_queue[s_queue_head % QUEUE_SIZE];
+	work->handler = handler;
+
+	s_queue_head++;
+
+	pthread_cond_signal(&s_cond_work);
+
+	pthread_mutex_unlock(&s_queue_lock);
+	return true;
+}
+
+OffloadEvent::OffloadEvent()
+{
+	pthread_mutex_init(&lock, nullptr);
+	pthread_cond_init(&cond, nullptr);
+	state = false;
+}
+
+OffloadEvent::~OffloadEvent()
+{
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void OffloadEvent::reset()
+{
+	pthread_mutex_lock(&lock);
+	state = false;
+	pthread_mutex_unlock(&lock);
+}
+
+void OffloadEvent::signal()
+{
+	pthread_mutex_lock(&lock);
+	state = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void OffloadEvent::wait()
+{
+	pthread_mutex_lock(&lock);
+	while (!state) pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+bool OffloadEvent::is_set()
+{
+	pthread_mutex_lock(&lock);
+	bool res = state;
+	pthread_mutex_unlock(&lock);
+	return res;
+}
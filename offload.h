@@ -2,11 +2,29 @@
 #define OFFLOAD_H
 
 #include <stddef.h>
+#include <pthread.h>
 #include <functional>
 
 void offload_start();
 void offload_stop();
 
 void offload_add_work(std::function<void()> work);
+bool offload_try_add_work(std::function<void()> work);
+
+// One-shot completion flag for offloaded work the main thread has to wait on.
+struct OffloadEvent
+{
+	OffloadEvent();
+	~OffloadEvent();
+
+	void reset();
+	void signal();
+	void wait();
+	bool is_set();
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool state;
+};
 
 #endif
\ No newline at end of file
@@ -77,6 +77,10 @@ static uint8_t osdbuf[256 * 32];
 static int  osdbufpos = 0;
 static int  osdset = 0;
 
+// copy of the lines as the FPGA has them, unchanged lines aren't sent again
+static uint8_t osdsent[256 * 32];
+static uint32_t osdsent_valid = 0;
+
 char framebuffer[16][256];
 static void framebuffer_clear()
 {
@@ -538,6 +542,7 @@ void OsdMenuCtl(int en)
 {
 	if (en)
 	{
+		osdsent_valid = 0;
 		spi_osd_cmd(OSD_CMD_WRITE | 8);
 		spi_osd_cmd(OSD_CMD_ENABLE);
 	}
@@ -663,14 +668,29 @@ char* OsdCoreNameGet()
 void OsdUpdate()
 {
 	PROFILE_FUNCTION();
+	static uint32_t sent = 0, skipped = 0;
+	static unsigned long stats_timer = GetTimer(60000);
+
 	int n = is_menu() ? 19 : osd_size;
 	for (int i = 0; i < n; i++)
 	{
 		if (osdset & (1 << i))
 		{
+			// The write command always carries the whole line, so the diff is per line
+			uint8_t *line = osdbuf + i * 256;
+			if ((osdsent_valid & (1 << i)) && !memcmp(osdsent + i * 256, line, 256))
+			{
+				skipped++;
+				continue;
+			}
+
 			spi_osd_cmd_cont(OSD_CMD_WRITE | i);
-			spi_write(osdbuf + i * 256, 256, 0);
+			spi_write(line, 256, 0);
 			DisableOsd();
+			memcpy(osdsent + i * 256, line, 256);
+			osdsent_valid |= 1 << i;
+			sent++;
+
 			if (is_megacd()) mcd_poll();
 			if (is_pce()) pcecd_poll();
 			if (is_saturn()) saturn_poll();
@@ -679,4 +699,11 @@ void OsdUpdate()
 	}
 
 	osdset = 0;
+
+	if (CheckTimer(stats_timer))
+	{
+		stats_timer = GetTimer(60000);
+		if (skipped) printf("OSD: %u lines sent, %u unchanged skipped (%u bytes/s saved)\n", sent, skipped, skipped * 256 / 60);
+		sent = skipped = 0;
+	}
 }
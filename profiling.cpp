@@ -1,102 +1,226 @@
-#ifdef PROFILING
-
 #include "profiling.h"
 
 #include "str_util.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
 
 struct Event
 {
 	const char *name;
 	uint32_t begin_idx;
-	struct timespec ts;
+	uint64_t ts; // ns, CLOCK_MONOTONIC_RAW
+};
+
+static constexpr uint32_t MAX_EVENTS = 16384; // per thread, must be pow2
+static constexpr int MAX_THREADS = 8;
+
+// Every thread writes into its own circular buffer, only the tail is shared with the dump.
+// The buffer of an exited thread is kept for the dump until another thread needs a slot.
+// While a dump or clear runs, writers skip their events (s_paused), the one in the middle
+// of an event is waited for (writing). Clear only moves the start, so the tail never goes back.
+struct ThreadBuffer
+{
+	Event events[MAX_EVENTS];
+	uint32_t tail;
+	uint32_t start;
+	int writing;
+	int released;
+	int tid;
+	char name[32];
 };
 
-static constexpr int MAX_EVENTS = 512; // must be pow2
-static Event s_events[MAX_EVENTS]; // circular buffer
-static uint32_t s_event_tail = 0;
+static ThreadBuffer *s_buffers[MAX_THREADS] = {};
+static int s_buffer_cnt = 0;
+static pthread_mutex_t s_buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t s_buffer_key;
+static pthread_once_t s_buffer_once = PTHREAD_ONCE_INIT;
+static int s_paused = 0;
+
+static __thread ThreadBuffer *t_buffer = nullptr;
+static __thread const char *t_name = nullptr;
+
+#ifdef PROFILING
+volatile int profiling_enabled = 1;
+static int s_spikes = 1;
+#else
+volatile int profiling_enabled = 0;
+static int s_spikes = 0;
+#endif
 
-static constexpr Event *get_event(uint32_t idx)
+static inline uint64_t get_ts()
 {
-	return &s_events[idx % MAX_EVENTS];
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-uint32_t profiling_event_begin(const char *name)
+static inline Event *get_event(ThreadBuffer *buf, uint32_t idx)
 {
-	Event *newEvent = get_event(s_event_tail);
-	newEvent->begin_idx = s_event_tail;
-	newEvent->name = name;
-	clock_gettime(CLOCK_MONOTONIC, &newEvent->ts);
+	return &buf->events[idx % MAX_EVENTS];
+}
 
-	uint32_t r = s_event_tail;
-	s_event_tail++;
-	return r;
+static void release_buffer(void *ptr)
+{
+	pthread_mutex_lock(&s_buffers_lock);
+	((ThreadBuffer*)ptr)->released = 1;
+	pthread_mutex_unlock(&s_buffers_lock);
 }
 
-void profiling_event_end(uint32_t begin_idx, const char *name)
+static void create_buffer_key()
 {
-	Event *newEvent = get_event(s_event_tail);
-	newEvent->begin_idx = begin_idx;
-	newEvent->name = name;
-	clock_gettime(CLOCK_MONOTONIC, &newEvent->ts);
-	s_event_tail++;
+	pthread_key_create(&s_buffer_key, release_buffer);
 }
 
-// result_ns = a - b
-static uint64_t delta_ns(const struct timespec *a, const struct timespec *b)
+static ThreadBuffer *get_buffer()
 {
-	struct timespec ts;
+	if (t_buffer) return t_buffer;
+
+	pthread_once(&s_buffer_once, create_buffer_key);
+
+	pthread_mutex_lock(&s_buffers_lock);
+	ThreadBuffer *buf = nullptr;
+	if (s_buffer_cnt < MAX_THREADS)
+	{
+		buf = (ThreadBuffer*)calloc(1, sizeof(ThreadBuffer));
+		if (buf) s_buffers[s_buffer_cnt++] = buf;
+	}
+	else
+	{
+		for (int i = 0; i < s_buffer_cnt && !buf; i++) if (s_buffers[i]->released) buf = s_buffers[i];
+		if (buf)
+		{
+			buf->start = buf->tail;
+			buf->released = 0;
+		}
+	}
 
-	ts.tv_sec = a->tv_sec - b->tv_sec;
-	ts.tv_nsec = a->tv_nsec - b->tv_nsec;
-	if (ts.tv_nsec < 0)
+	if (buf)
 	{
-		ts.tv_nsec += 1000000000;
-		ts.tv_sec -= 1;
+		buf->tid = syscall(SYS_gettid);
+		if (t_name) strcpyz(buf->name, sizeof(buf->name), t_name);
+		else snprintf(buf->name, sizeof(buf->name), "thread %d", buf->tid);
+
+		pthread_setspecific(s_buffer_key, buf);
+		t_buffer = buf;
 	}
+	pthread_mutex_unlock(&s_buffers_lock);
+
+	return t_buffer;
+}
+
+// returns 0 while the dump reads the buffers, otherwise the event has to be finished with write_end()
+static inline int write_begin(ThreadBuffer *buf)
+{
+	__atomic_store_n(&buf->writing, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&s_paused, __ATOMIC_SEQ_CST)) return 1;
 
-	uint64_t delta = ts.tv_sec * 1000000000ULL;
-	delta += ts.tv_nsec;
-	return delta;
+	__atomic_store_n(&buf->writing, 0, __ATOMIC_RELEASE);
+	return 0;
 }
 
+static inline void write_end(ThreadBuffer *buf)
+{
+	__atomic_store_n(&buf->writing, 0, __ATOMIC_RELEASE);
+}
+
+static void pause_writers()
+{
+	__atomic_store_n(&s_paused, 1, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < s_buffer_cnt; i++)
+	{
+		while (__atomic_load_n(&s_buffers[i]->writing, __ATOMIC_SEQ_CST)) sched_yield();
+	}
+}
+
+static void resume_writers()
+{
+	__atomic_store_n(&s_paused, 0, __ATOMIC_RELEASE);
+}
+
+void profiling_thread_name(const char *name)
+{
+	t_name = name;
+	if (t_buffer) strcpyz(t_buffer->name, sizeof(t_buffer->name), name);
+}
+
+uint32_t profiling_event_begin(const char *name)
+{
+	ThreadBuffer *buf = get_buffer();
+	if (!buf || !write_begin(buf)) return PROFILING_NO_EVENT;
+
+	uint32_t idx = buf->tail;
+	Event *newEvent = get_event(buf, idx);
+	newEvent->begin_idx = idx;
+	newEvent->name = name;
+	newEvent->ts = get_ts();
+
+	__atomic_store_n(&buf->tail, idx + 1, __ATOMIC_RELEASE);
+	write_end(buf);
+	return idx;
+}
+
+void profiling_event_end(uint32_t begin_idx, const char *name)
+{
+	ThreadBuffer *buf = t_buffer;
+	if (!buf || !write_begin(buf)) return;
+
+	uint32_t idx = buf->tail;
+	Event *newEvent = get_event(buf, idx);
+	newEvent->begin_idx = begin_idx;
+	newEvent->name = name;
+	newEvent->ts = get_ts();
+
+	__atomic_store_n(&buf->tail, idx + 1, __ATOMIC_RELEASE);
+	write_end(buf);
+}
 
 // Bookkeeping data for spike report
-static uint64_t inclusive_times[MAX_EVENTS];
-static uint64_t other_times[MAX_EVENTS];
-static uint32_t pair_stack[MAX_EVENTS / 2];
+static constexpr uint32_t SPIKE_EVENTS = 512;
+static uint64_t inclusive_times[SPIKE_EVENTS];
+static uint64_t other_times[SPIKE_EVENTS];
+static uint32_t pair_stack[SPIKE_EVENTS / 2];
+static pthread_mutex_t s_spike_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void profiling_spike_report(uint32_t begin_idx, uint32_t spike_us)
 {
+	ThreadBuffer *buf = t_buffer;
 	int stack_pos = 0;
 
-	if ((s_event_tail - begin_idx) < 2) return; // not enough events
-	if ((s_event_tail - begin_idx) > MAX_EVENTS) return; // too many events
+	if (!s_spikes || !buf) return;
+
+	const uint32_t tail = buf->tail;
+	if ((tail - begin_idx) < 2) return; // not enough events
+	if ((tail - begin_idx) > SPIKE_EVENTS) return; // too many events
 
-	const uint64_t total_ns = delta_ns(&get_event(s_event_tail - 1)->ts, &get_event(begin_idx)->ts);
+	const uint64_t total_ns = get_event(buf, tail - 1)->ts - get_event(buf, begin_idx)->ts;
 
 	if (total_ns < (spike_us * 1000ULL)) return; // below threshold
+	if (pthread_mutex_trylock(&s_spike_lock)) return;
 
-	for (uint32_t idx = begin_idx; idx != s_event_tail; idx++)
+	for (uint32_t idx = begin_idx; idx != tail; idx++)
 	{
-		const uint32_t cyc_idx = idx % MAX_EVENTS;
-		Event *event = get_event(idx);
+		const uint32_t rel_idx = idx - begin_idx;
+		Event *event = get_event(buf, idx);
 
 		if (event->begin_idx == idx)
 		{
-			pair_stack[stack_pos] = cyc_idx;
-			inclusive_times[cyc_idx] = 0;
-			other_times[cyc_idx] = 0;
+			pair_stack[stack_pos] = rel_idx;
+			inclusive_times[rel_idx] = 0;
+			other_times[rel_idx] = 0;
 			stack_pos++;
 		}
-		else
+		else if (stack_pos > 0)
 		{
 			stack_pos--;
 			uint32_t span_idx = pair_stack[stack_pos];
-			const uint64_t inclusive_ns = delta_ns(&event->ts, &get_event(span_idx)->ts);
+			const uint64_t inclusive_ns = event->ts - get_event(buf, begin_idx + span_idx)->ts;
 			inclusive_times[span_idx] = inclusive_ns;
 			if (stack_pos > 0) other_times[pair_stack[stack_pos-1]] += inclusive_ns;
 		}
@@ -104,27 +228,118 @@ void profiling_spike_report(uint32_t begin_idx, uint32_t spike_us)
 
 	char label[256];
 	int indent = 0;
-	printf("\n%lluus spike over %uus limit.\n", total_ns / 1000ULL, spike_us);
+	printf("\n%lluus spike over %uus limit (%s).\n", total_ns / 1000ULL, spike_us, buf->name);
 	printf("+----- Name -----------------------------------------+ Inc(us) + Exc(us) +\n");
-	for (uint32_t idx = begin_idx; idx != s_event_tail; idx++)
+	for (uint32_t idx = begin_idx; idx != tail; idx++)
 	{
-		const uint32_t cyc_idx = idx % MAX_EVENTS;
-		Event *event = get_event(idx);
+		const uint32_t rel_idx = idx - begin_idx;
+		Event *event = get_event(buf, idx);
 
 		if (event->begin_idx == idx)
 		{
 			memset(label, ' ', indent);
 			strcpyz(label + indent, sizeof(label) - indent, event->name);
-			printf("| %-50s | %7llu | %7llu |\n", label, inclusive_times[cyc_idx] / 1000ULL, (inclusive_times[cyc_idx] - other_times[cyc_idx]) / 1000ULL);
+			printf("| %-50s | %7llu | %7llu |\n", label, inclusive_times[rel_idx] / 1000ULL, (inclusive_times[rel_idx] - other_times[rel_idx]) / 1000ULL);
 			indent += 2;
 		}
-		else
+		else if (indent >= 2)
 		{
 			indent -= 2;
 		}
 	}
 	printf("+----------------------------------------------------+---------+---------+\n\n");
 	fflush(stdout);
+
+	pthread_mutex_unlock(&s_spike_lock);
 }
 
-#endif // PROFILING
\ No newline at end of file
+void profiling_enable(int enable)
+{
+	profiling_enabled = enable;
+	printf("Tracing %s.\n", enable ? "enabled" : "disabled");
+}
+
+static void json_name(FILE *fp, const char *name)
+{
+	fputc('"', fp);
+	for (const char *p = name; *p; p++)
+	{
+		if (*p == '"' || *p == '\\') fputc('\\', fp);
+		if ((uint8_t)*p >= 0x20) fputc(*p, fp);
+	}
+	fputc('"', fp);
+}
+
+// Write all buffered events as Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+int profiling_dump(const char *path)
+{
+	FILE *fp = fopen(path, "w");
+	if (!fp)
+	{
+		printf("Tracing: cannot create %s\n", path);
+		return 0;
+	}
+
+	int cnt = 0;
+	int pid = getpid();
+	fprintf(fp, "{\"traceEvents\":[\n");
+
+	// stop recording, so the buffers aren't overwritten while they are read
+	pthread_mutex_lock(&s_buffers_lock);
+	pause_writers();
+	for (int i = 0; i < s_buffer_cnt; i++)
+	{
+		ThreadBuffer *buf = s_buffers[i];
+		fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", cnt ? ",\n" : "", pid, buf->tid);
+		json_name(fp, buf->name);
+		fprintf(fp, "}}");
+		cnt++;
+
+		uint32_t tail = __atomic_load_n(&buf->tail, __ATOMIC_ACQUIRE);
+		uint32_t idx = ((tail - buf->start) > MAX_EVENTS) ? (tail - MAX_EVENTS) : buf->start;
+		for (; idx != tail; idx++)
+		{
+			Event *event = get_event(buf, idx);
+			fprintf(fp, ",\n{\"name\":");
+			json_name(fp, event->name);
+			fprintf(fp, ",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%d}", (event->begin_idx == idx) ? 'B' : 'E',
+				event->ts / 1000ULL, event->ts % 1000ULL, pid, buf->tid);
+			cnt++;
+		}
+	}
+	resume_writers();
+	pthread_mutex_unlock(&s_buffers_lock);
+
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+
+	printf("Tracing: %d events written to %s\n", cnt, path);
+	return cnt;
+}
+
+// MiSTer_cmd: trace on|off|clear|dump [path]|spikes on|off
+void profiling_cmd(const char *cmd)
+{
+	const char *arg = cmd + 5;
+	while (*arg == ' ') arg++;
+
+	if (!strcmp(arg, "on")) profiling_enable(1);
+	else if (!strcmp(arg, "off")) profiling_enable(0);
+	else if (!strcmp(arg, "spikes on")) s_spikes = 1;
+	else if (!strcmp(arg, "spikes off")) s_spikes = 0;
+	else if (!strcmp(arg, "clear"))
+	{
+		pthread_mutex_lock(&s_buffers_lock);
+		pause_writers();
+		for (int i = 0; i < s_buffer_cnt; i++) s_buffers[i]->start = __atomic_load_n(&s_buffers[i]->tail, __ATOMIC_ACQUIRE);
+		resume_writers();
+		pthread_mutex_unlock(&s_buffers_lock);
+	}
+	else if (!strncmp(arg, "dump", 4))
+	{
+		arg += 4;
+		while (*arg == ' ') arg++;
+		profiling_dump(*arg ? arg : "/tmp/MiSTer_trace.json");
+	}
+	else printf("Tracing: unknown command: %s\n", cmd);
+}
@@ -3,12 +3,22 @@
 
 #include <inttypes.h>
 
-#ifdef PROFILING
+// Tracing is always compiled in and costs a single branch while disabled.
+// Enable it at runtime with "trace on" in /dev/MiSTer_cmd, building with PROFILING=1 enables it at startup.
+
+#define PROFILING_NO_EVENT 0xFFFFFFFF
+
+extern volatile int profiling_enabled;
 
 uint32_t profiling_event_begin(const char *name);
 void profiling_event_end(uint32_t begin_idx, const char *name);
 void profiling_spike_report(uint32_t begin_idx, uint32_t spike_us);
 
+void profiling_thread_name(const char *name);
+void profiling_enable(int enable);
+int profiling_dump(const char *path);
+void profiling_cmd(const char *cmd);
+
 struct ProfilingScopedEvent
 {
 	const char *name;
@@ -19,18 +29,19 @@ struct ProfilingScopedEvent
 		: name(name)
 		, spike_us(0)
 	{
-		begin_idx = profiling_event_begin(name);
+		begin_idx = profiling_enabled ? profiling_event_begin(name) : PROFILING_NO_EVENT;
 	}
 
 	ProfilingScopedEvent(const char *name, uint32_t spike_us)
 		: name(name)
 		, spike_us(spike_us)
 	{
-		begin_idx = profiling_event_begin(name);
+		begin_idx = profiling_enabled ? profiling_event_begin(name) : PROFILING_NO_EVENT;
 	}
 
 	~ProfilingScopedEvent()
 	{
+		if (begin_idx == PROFILING_NO_EVENT) return;
 		profiling_event_end(begin_idx, name);
 		if (spike_us > 0) profiling_spike_report(begin_idx, spike_us);
 	}
@@ -41,13 +52,4 @@ struct ProfilingScopedEvent
 #define SPIKE_SCOPE(name, us) ProfilingScopedEvent __scope_timer(name, us)
 #define SPIKE_FUNCTION(us) ProfilingScopedEvent __scope_timer(__FUNCTION__, us)
 
-#else // PROFILING
-
-#define PROFILE_SCOPE(name) 
-#define PROFILE_FUNCTION()
-#define SPIKE_SCOPE(name, us)
-#define SPIKE_FUNCTION(us)
-
-#endif // PROFILING
-
 #endif // PROFILING_H
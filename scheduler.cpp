@@ -1,5 +1,7 @@
 #include "scheduler.h"
 #include <stdio.h>
+#include <string.h>
+#include <poll.h>
 #include "libco.h"
 #include "menu.h"
 #include "user_io.h"
@@ -7,12 +9,38 @@
 #include "fpga_io.h"
 #include "osd.h"
 #include "profiling.h"
+#include "hardware.h"
+#include "cfg.h"
 
 static cothread_t co_scheduler = nullptr;
 static cothread_t co_poll = nullptr;
 static cothread_t co_ui = nullptr;
 static cothread_t co_last = nullptr;
 
+// Event-driven mode (event_scheduler=N). Each coroutine declares how long it may sleep before it has to
+// run again. When both have finished a round and no disk request was seen recently, the scheduler sleeps
+// in poll() on the input fds (devices, inotify, command fifo). The FPGA has no interrupt to wait on,
+// so its requests are picked up by the bounded timeout declared by co_poll.
+#define SCHED_BUSY_HOLD_US 100000
+#define SCHED_STATS_MS     60000
+
+static int wait_poll = 0;
+static int wait_ui = 0;
+static uint64_t busy_until = 0;
+static uint64_t sleep_start = 0;
+static int slept = 0;
+
+static struct
+{
+	uint64_t start;
+	uint64_t sleep_us;
+	uint32_t sleeps;
+	uint32_t wakeups;
+	uint32_t requests;
+	uint64_t req_us;
+	uint32_t req_max_us;
+} sched_stats = {};
+
 static void scheduler_wait_fpga_ready(void)
 {
 	while (!is_fpga_ready(1))
@@ -33,6 +61,7 @@ static void scheduler_co_poll(void)
 			input_poll(0);
 		}
 
+		scheduler_wait(cfg.event_scheduler);
 		scheduler_yield();
 	}
 }
@@ -47,21 +76,74 @@ static void scheduler_co_ui(void)
 			OsdUpdate();
 		}
 
+		scheduler_wait(user_io_osd_is_visible() ? 10 : 100);
 		scheduler_yield();
 	}
 }
 
+static void scheduler_print_stats(void)
+{
+	uint64_t now = GetTimerUs();
+	uint64_t total = now - sched_stats.start;
+
+	if (sched_stats.start && total)
+	{
+		printf("Scheduler: idle %llu.%llu%%, %u sleeps, %u event wakeups, %u requests after sleep (avg %llu us, max %u us)\n",
+			sched_stats.sleep_us * 100 / total, (sched_stats.sleep_us * 1000 / total) % 10, sched_stats.sleeps, sched_stats.wakeups,
+			sched_stats.requests, sched_stats.requests ? sched_stats.req_us / sched_stats.requests : 0, sched_stats.req_max_us);
+	}
+
+	memset(&sched_stats, 0, sizeof(sched_stats));
+	sched_stats.start = now;
+}
+
+static void scheduler_sleep(void)
+{
+	static unsigned long stats_timer = 0;
+	if (!stats_timer || CheckTimer(stats_timer))
+	{
+		if (stats_timer) scheduler_print_stats();
+		else sched_stats.start = GetTimerUs();
+		stats_timer = GetTimer(SCHED_STATS_MS);
+	}
+
+	int ms = (wait_poll < wait_ui) ? wait_poll : wait_ui;
+	if (ms <= 0) return;
+
+	uint64_t now = GetTimerUs();
+	if (now < busy_until) return;
+
+	struct pollfd *fds;
+	int cnt = input_pollfds(&fds);
+	input_unlock();
+	int ret = poll(fds, cnt, ms);
+	input_lock();
+	if (ret > 0) sched_stats.wakeups++;
+
+	sleep_start = now;
+	slept = 1;
+	sched_stats.sleeps++;
+	sched_stats.sleep_us += GetTimerUs() - now;
+}
+
 static void scheduler_schedule(void)
 {
+	input_handoff();
+
 	if (co_last == co_poll)
 	{
 		co_last = co_ui;
+		wait_ui = 0;
 		co_switch(co_ui);
+
+		if (cfg.event_scheduler) scheduler_sleep();
 	}
 	else
 	{
 		co_last = co_poll;
+		wait_poll = 0;
 		co_switch(co_poll);
+		slept = 0;
 	}
 }
 
@@ -77,6 +159,9 @@ void scheduler_run(void)
 {
 	co_scheduler = co_active();
 
+	// the input reader maps its events only while the coroutines are switched or sleep
+	input_lock();
+
 	for (;;)
 	{
 		scheduler_schedule();
@@ -91,3 +176,27 @@ void scheduler_yield(void)
 {
 	co_switch(co_scheduler);
 }
+
+// Called by a coroutine before yielding: it doesn't need to run again for up to ms milliseconds.
+void scheduler_wait(int ms)
+{
+	if (co_active() == co_poll) wait_poll = ms;
+	else if (co_active() == co_ui) wait_ui = ms;
+}
+
+// A request from the core was handled. Keep polling continuously for a while.
+void scheduler_busy(void)
+{
+	uint64_t now = GetTimerUs();
+	if (slept)
+	{
+		uint32_t us = now - sleep_start;
+		sched_stats.requests++;
+		sched_stats.req_us += us;
+		if (us > sched_stats.req_max_us) sched_stats.req_max_us = us;
+		slept = 0;
+	}
+
+	busy_until = now + SCHED_BUSY_HOLD_US;
+}
+
@@ -7,4 +7,7 @@ void scheduler_init(void);
 void scheduler_run(void);
 void scheduler_yield(void);
 
+void scheduler_wait(int ms);
+void scheduler_busy(void);
+
 #endif
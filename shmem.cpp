@@ -10,16 +10,52 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "shmem.h"
 
 static int memfd = -1;
 
+// Persistent mapping windows. shmem_acquire() returns a view into a cached mapping and shmem_release()
+// only drops the reference, so hot paths don't pay a mmap/munmap pair per call. Windows in FPGA DDR
+// are widened to aligned blocks, so neighbouring requests (chunked loads) share one mapping.
+// Idle windows are unmapped in LRU order when the slots or the idle size limit run out.
+#define SHMEM_WINDOWS   16
+#define SHMEM_BLOCK     (2 * 1024 * 1024)
+#define SHMEM_IDLE_MAX  (64 * 1024 * 1024)
+#define SHMEM_DDR_START 0x20000000
+#define SHMEM_DDR_END   0x40000000ULL
+
+struct shmem_window_t
+{
+	uint32_t addr;
+	uint32_t size;
+	uint8_t *base;
+	uint32_t refs;
+	uint32_t used;
+};
+
+static shmem_window_t windows[SHMEM_WINDOWS] = {};
+static uint32_t win_stamp = 0;
+static uint32_t win_maps = 0;
+static uint32_t win_hits = 0;
+static pthread_mutex_t win_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void *shmem_map(uint32_t address, uint32_t size)
 {
 	if (memfd < 0)
 	{
+#ifdef FPGA_SIM
+		// sparse stand-in for the physical address space, so mappings behave like on the board
+		memfd = memfd_create("fpga_sim", MFD_CLOEXEC);
+		if (memfd != -1 && ftruncate(memfd, 0x100000000LL) < 0)
+		{
+			close(memfd);
+			memfd = -1;
+		}
+#else
 		memfd = open("/dev/mem", O_RDWR | O_SYNC | O_CLOEXEC);
+#endif
 		if (memfd == -1)
 		{
 			printf("Error: Unable to open /dev/mem!\n");
@@ -41,20 +77,139 @@ int shmem_unmap(void* map, uint32_t size)
 {
 	if (munmap(map, size) < 0)
 	{
-		printf("Error: Unable to unmap(0x%X, %d)!\n", (uint32_t)map, size);
+		printf("Error: Unable to unmap(0x%X, %d)!\n", (uint32_t)(uintptr_t)map, size);
 		return 0;
 	}
 
 	return 1;
 }
 
+static void shmem_win_close(shmem_window_t *win)
+{
+	shmem_unmap(win->base, win->size);
+	memset(win, 0, sizeof(*win));
+}
+
+// unmap idle windows (oldest first) until the idle size is within the limit and a slot is free
+static shmem_window_t *shmem_win_trim(uint32_t need)
+{
+	while (1)
+	{
+		uint64_t idle = need;
+		shmem_window_t *free_win = 0, *lru = 0;
+
+		for (int i = 0; i < SHMEM_WINDOWS; i++)
+		{
+			shmem_window_t *win = &windows[i];
+			if (!win->base)
+			{
+				if (!free_win) free_win = win;
+				continue;
+			}
+
+			if (win->refs) continue;
+			idle += win->size;
+			if (!lru || (int32_t)(win->used - lru->used) < 0) lru = win;
+		}
+
+		if ((free_win || !need) && idle <= SHMEM_IDLE_MAX) return free_win;
+		if (!lru) return free_win;
+		shmem_win_close(lru);
+	}
+}
+
+void *shmem_acquire(uint32_t address, uint32_t size)
+{
+	pthread_mutex_lock(&win_lock);
+
+	for (int i = 0; i < SHMEM_WINDOWS; i++)
+	{
+		shmem_window_t *win = &windows[i];
+		if (win->base && address >= win->addr && ((uint64_t)address + size) <= ((uint64_t)win->addr + win->size))
+		{
+			win->refs++;
+			win->used = ++win_stamp;
+			win_hits++;
+			pthread_mutex_unlock(&win_lock);
+			return win->base + (address - win->addr);
+		}
+	}
+
+	uint32_t start = address & ~0xFFF;
+	uint64_t end = ((uint64_t)address + size + 0xFFF) & ~0xFFFULL;
+	if (address >= SHMEM_DDR_START && end <= SHMEM_DDR_END)
+	{
+		start &= ~(SHMEM_BLOCK - 1);
+		end = (end + SHMEM_BLOCK - 1) & ~(uint64_t)(SHMEM_BLOCK - 1);
+	}
+
+	void *res = 0;
+	shmem_window_t *win = shmem_win_trim(end - start);
+	if (win)
+	{
+		uint8_t *base = (uint8_t*)shmem_map(start, end - start);
+		if (base)
+		{
+			win->addr = start;
+			win->size = end - start;
+			win->base = base;
+			win->refs = 1;
+			win->used = ++win_stamp;
+			win_maps++;
+			res = base + (address - start);
+		}
+	}
+	else
+	{
+		printf("Error: no free shmem window for (0x%X, %d)!\n", address, size);
+	}
+
+	pthread_mutex_unlock(&win_lock);
+	return res;
+}
+
+void shmem_release(void *ptr)
+{
+	if (!ptr) return;
+
+	pthread_mutex_lock(&win_lock);
+	for (int i = 0; i < SHMEM_WINDOWS; i++)
+	{
+		shmem_window_t *win = &windows[i];
+		if (win->base && (uint8_t*)ptr >= win->base && (uint8_t*)ptr < win->base + win->size)
+		{
+			if (win->refs) win->refs--;
+			if (!win->refs) shmem_win_trim(0);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&win_lock);
+}
+
+void shmem_print_stats()
+{
+	uint32_t mapped = 0;
+	int cnt = 0;
+
+	pthread_mutex_lock(&win_lock);
+	for (int i = 0; i < SHMEM_WINDOWS; i++)
+	{
+		if (!windows[i].base) continue;
+		mapped += windows[i].size;
+		cnt++;
+	}
+
+	if (win_maps) printf("shmem: %u maps, %u map calls avoided, %d windows (%u KB) mapped.\n", win_maps, win_hits, cnt, mapped >> 10);
+	pthread_mutex_unlock(&win_lock);
+}
+
 int shmem_put(uint32_t address, uint32_t size, void *buf)
 {
-	void *shmem = shmem_map(address, size);
+	void *shmem = shmem_acquire(address, size);
 	if (shmem)
 	{
 		memcpy(shmem, buf, size);
-		shmem_unmap(shmem, size);
+		shmem_release(shmem);
 	}
 
 	return shmem != 0;
@@ -62,11 +217,11 @@ int shmem_put(uint32_t address, uint32_t size, void *buf)
 
 int shmem_get(uint32_t address, uint32_t size, void *buf)
 {
-	void *shmem = shmem_map(address, size);
+	void *shmem = shmem_acquire(address, size);
 	if (shmem)
 	{
 		memcpy(buf, shmem, size);
-		shmem_unmap(shmem, size);
+		shmem_release(shmem);
 	}
 
 	return shmem != 0;
@@ -9,5 +9,9 @@ int shmem_unmap(void* map, uint32_t size);
 int shmem_put(uint32_t address, uint32_t size, void *buf);
 int shmem_get(uint32_t address, uint32_t size, void *buf);
 
+void *shmem_acquire(uint32_t address, uint32_t size);
+void shmem_release(void *ptr);
+void shmem_print_stats();
+
 #define fpga_mem(x) (0x20000000 | ((x) & 0x1FFFFFFF))
 #endif
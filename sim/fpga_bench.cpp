@@ -0,0 +1,297 @@
+// Host benchmark of the SPI bridge paths against the simulated FPGA (make sim-bench).
+// Each path issues the same wire sequence as the MiSTer binary does on the board, the model
+// checks the commands and data, so a change to fpga_spi.cpp or spi.cpp can be measured and
+// verified without a DE10-Nano. Timings are the software cost of the loops on the host,
+// not the bus speed of the board.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../spi.h"
+#include "../shmem.h"
+#include "../user_io.h"
+#include "fpga_sim.h"
+
+#define OSD_CMD_WRITE 0x20
+
+#define SD_STAT_REQ   0x8000
+#define SD_STAT_512   (2 << 6)
+
+#define IDE0_BASE     0xF000
+
+void fpga_wait_to_reset()
+{
+	printf("sim: FPGA is uninitialized\n");
+	exit(1);
+}
+
+static uint8_t buf_out[64 * 1024];
+static uint8_t buf_in[64 * 1024];
+static uint16_t resp[3 + 256];
+static int failed = 0;
+
+static uint64_t get_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t hash_words(uint32_t hash, const uint16_t *data, uint32_t len)
+{
+	while (len--) hash = fpga_sim_hash(hash, *data++);
+	return hash;
+}
+
+static uint32_t hash_bytes(uint32_t hash, const uint8_t *data, uint32_t len)
+{
+	while (len--) hash = fpga_sim_hash(hash, *data++);
+	return hash;
+}
+
+static void fill(uint8_t *buf, uint32_t size, uint32_t seed)
+{
+	for (uint32_t i = 0; i < size; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+}
+
+// ops: completed operations, words: data words moved per operation
+static void report(const char *name, uint64_t ns, uint32_t ops, uint32_t words, uint32_t bytes, uint32_t transfers, uint32_t hash_exp, int data_ok)
+{
+	fpga_sim_stats stats;
+	fpga_sim_get_stats(&stats);
+
+	int ok = data_ok && !stats.mismatches && stats.transfers == transfers && stats.hash_in == hash_exp;
+	if (!ok)
+	{
+		failed++;
+		printf("%-24s FAILED: mismatches=%u transfers=%u/%u hash=%08X/%08X data=%s\n", name,
+			stats.mismatches, stats.transfers, transfers, stats.hash_in, hash_exp, data_ok ? "ok" : "bad");
+		return;
+	}
+
+	double sec = ns / 1e9;
+	printf("%-24s %8u %10.2f %12.0f %10.1f %10.2f\n", name, ops, ns / 1000.0 / ops,
+		(double)ops * words / sec, (double)ops * bytes / sec / (1024 * 1024), (double)stats.strobes / ops);
+}
+
+static void bench_sd(uint32_t ops, int write)
+{
+	static uint16_t stat[4];
+	stat[0] = SD_STAT_REQ | SD_STAT_512 | (write ? 2 : 1);
+	stat[1] = 0;
+
+	for (uint32_t i = 0; i < 256; i++) resp[1 + i] = ((uint16_t*)buf_out)[i];
+	resp[0] = 0;
+
+	fpga_sim_step steps[2] = {
+		{ SIM_CH_UIO, UIO_GET_SDSTAT, 0xFF, stat, 4, 0 },
+		{ SIM_CH_UIO, (uint16_t)(write ? UIO_SECTOR_WR : UIO_SECTOR_RD), 0xFF, resp, write ? 257u : 0u, write ? 0u : SIM_STEP_HASH_IN },
+	};
+	fpga_sim_script(steps, 2);
+
+	uint32_t hash = FPGA_SIM_HASH_INIT;
+	int data_ok = 1;
+
+	uint64_t start = get_ns();
+	for (uint32_t n = 0; n < ops; n++)
+	{
+		stat[2] = (uint16_t)n;
+		stat[3] = (uint16_t)(n >> 16);
+
+		// same sequence as the SD handler in user_io_poll()
+		uint16_t c = spi_uio_cmd_cont(UIO_GET_SDSTAT);
+		uint32_t lba = 0;
+		int op = 0, disk = 0, sz = 0;
+		if (c & SD_STAT_REQ)
+		{
+			disk = (c >> 2) & 0xF;
+			op = c & 3;
+			spi_w(0);
+			lba = spi_w(0);
+			lba = (lba & 0xFFFF) | (((uint32_t)spi_w(0)) << 16);
+			sz = (128 << ((c >> 6) & 7)) * (((c >> 9) & 0x3F) + 1);
+		}
+		DisableIO();
+
+		if (lba != n || sz != 512) data_ok = 0;
+
+		EnableIO();
+		if (op == 2)
+		{
+			spi_w(UIO_SECTOR_WR | (disk << 8));
+			spi_block_read(buf_in, 1, sz);
+		}
+		else
+		{
+			spi_w(UIO_SECTOR_RD | (disk << 8));
+			spi_block_write(buf_out, 1, sz);
+		}
+		DisableIO();
+	}
+	uint64_t ns = get_ns() - start;
+
+	if (write) data_ok = data_ok && !memcmp(buf_in, buf_out, 512);
+	else for (uint32_t n = 0; n < ops; n++) hash = hash_words(hash, (uint16_t*)buf_out, 256);
+
+	report(write ? "SD sector write" : "SD sector read", ns, ops, 256, 512, ops * 2, hash, data_ok);
+}
+
+static void bench_fio(uint32_t ops, uint32_t size, int fast, int wide)
+{
+	fpga_sim_step steps[1] = {
+		{ SIM_CH_FIO, FIO_FILE_TX_DAT, 0xFF, 0, 0, SIM_STEP_HASH_IN },
+	};
+	fpga_sim_script(steps, 1);
+
+	uint64_t start = get_ns();
+	for (uint32_t n = 0; n < ops; n++)
+	{
+		EnableFpga();
+		spi8(FIO_FILE_TX_DAT);
+		if (fast) spi_block_write(buf_out, wide, size);
+		else spi_write(buf_out, size, wide);
+		DisableFpga();
+	}
+	uint64_t ns = get_ns() - start;
+
+	uint32_t hash = FPGA_SIM_HASH_INIT;
+	for (uint32_t n = 0; n < ops; n++)
+	{
+		hash = wide ? hash_words(hash, (uint16_t*)buf_out, size / 2) : hash_bytes(hash, buf_out, size);
+	}
+
+	char name[64];
+	sprintf(name, "FIO upload %s %d", fast ? "fast" : "hshake", wide ? 16 : 8);
+	report(name, ns, ops, wide ? size / 2 : size, size, ops, hash, 1);
+}
+
+static void bench_ide(uint32_t ops, int read)
+{
+	resp[0] = 0;
+	resp[1] = 0;
+	resp[2] = 0;
+	for (uint32_t i = 0; i < 256; i++) resp[3 + i] = ((uint16_t*)buf_out)[i];
+
+	fpga_sim_step steps[1] = {
+		{ SIM_CH_UIO, (uint16_t)(read ? UIO_DMA_READ : UIO_DMA_WRITE), 0xFF, resp, read ? 259u : 0u, read ? 0u : SIM_STEP_HASH_IN },
+	};
+	fpga_sim_script(steps, 1);
+
+	uint16_t reg = IDE0_BASE + 255;
+
+	// same sequence as ide_sendbuf()/ide_recvbuf()
+	uint64_t start = get_ns();
+	for (uint32_t n = 0; n < ops; n++)
+	{
+		EnableIO();
+		fpga_spi_fast(read ? UIO_DMA_READ : UIO_DMA_WRITE);
+		fpga_spi_fast(reg);
+		fpga_spi_fast(0);
+		if (read) fpga_spi_fast_block_read((uint16_t*)buf_in, 256);
+		else fpga_spi_fast_block_write((uint16_t*)buf_out, 256);
+		DisableIO();
+	}
+	uint64_t ns = get_ns() - start;
+
+	uint32_t hash = FPGA_SIM_HASH_INIT;
+	if (!read)
+	{
+		for (uint32_t n = 0; n < ops; n++)
+		{
+			hash = fpga_sim_hash(hash, reg);
+			hash = fpga_sim_hash(hash, 0);
+			hash = hash_words(hash, (uint16_t*)buf_out, 256);
+		}
+	}
+
+	report(read ? "IDE sector read" : "IDE sector write", ns, ops, 256, 512, ops, hash, !read || !memcmp(buf_in, buf_out, 512));
+}
+
+static void bench_osd(uint32_t ops)
+{
+	fpga_sim_step steps[1] = {
+		{ SIM_CH_OSD, OSD_CMD_WRITE, 0xF0, 0, 0, SIM_STEP_HASH_IN },
+	};
+	fpga_sim_script(steps, 1);
+
+	// same sequence as the line loop in OsdUpdate()
+	uint64_t start = get_ns();
+	for (uint32_t n = 0; n < ops; n++)
+	{
+		spi_osd_cmd_cont(OSD_CMD_WRITE | (n & 15));
+		spi_write(buf_out + (n & 15) * 256, 256, 0);
+		DisableOsd();
+	}
+	uint64_t ns = get_ns() - start;
+
+	uint32_t hash = FPGA_SIM_HASH_INIT;
+	for (uint32_t n = 0; n < ops; n++) hash = hash_bytes(hash, buf_out + (n & 15) * 256, 256);
+
+	report("OSD line write", ns, ops, 256, 256, ops, hash, 1);
+}
+
+static void bench_shmem(uint32_t ops)
+{
+	const uint32_t size = sizeof(buf_out);
+	fpga_sim_script(0, 0);
+
+	int data_ok = 1;
+	uint64_t start = get_ns();
+	for (uint32_t n = 0; n < ops; n++)
+	{
+		uint32_t addr = 0x30000000 + (n & 63) * size;
+		data_ok &= shmem_put(addr, size, buf_out);
+		data_ok &= shmem_get(addr, size, buf_in);
+	}
+	uint64_t ns = get_ns() - start;
+
+	data_ok = data_ok && !memcmp(buf_in, buf_out, size);
+	report("shmem put+get 64KB", ns, ops, size / 2, size * 2, 0, FPGA_SIM_HASH_INIT, data_ok);
+}
+
+int main(int argc, char *argv[])
+{
+	int ack_delay = 0;
+	uint32_t scale = 1;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-d") && i + 1 < argc) ack_delay = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-n") && i + 1 < argc) scale = atoi(argv[++i]);
+		else
+		{
+			printf("usage: %s [-d ack_delay_polls] [-n scale]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (!scale) scale = 1;
+
+	fill(buf_out, sizeof(buf_out), 0x1234);
+	fpga_sim_init(0x5CA62300, 1, 1, ack_delay);
+
+	printf("Simulated FPGA, ACK delay %d poll(s).\n\n", ack_delay);
+	printf("%-24s %8s %10s %12s %10s %10s\n", "path", "ops", "us/op", "words/s", "MB/s", "strobes/op");
+
+	bench_sd(20000 * scale, 0);
+	bench_sd(20000 * scale, 1);
+	bench_fio(50 * scale, sizeof(buf_out), 0, 1);
+	bench_fio(50 * scale, sizeof(buf_out), 1, 1);
+	bench_fio(50 * scale, sizeof(buf_out), 0, 0);
+	bench_fio(50 * scale, sizeof(buf_out), 1, 0);
+	bench_ide(20000 * scale, 0);
+	bench_ide(20000 * scale, 1);
+	bench_osd(20000 * scale);
+	bench_shmem(2000 * scale);
+
+	printf("\n%u handshake stall(s).\n", fpga_spi_stalls());
+	shmem_print_stats();
+
+	if (failed) printf("%d path(s) FAILED.\n", failed);
+	return failed ? 1 : 0;
+}
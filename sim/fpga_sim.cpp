@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../fpga_bus.h"
+#include "fpga_sim.h"
+
+#define SSPI_STROBE  (1<<17)
+#define SSPI_ACK     SSPI_STROBE
+#define SSPI_FPGA_EN (1<<18)
+#define SSPI_OSD_EN  (1<<19)
+#define SSPI_IO_EN   (1<<20)
+
+static uint32_t core_id = 0x5CA62300;
+static uint32_t gpi_status = 0;
+static int ack_delay = 0;
+
+static uint32_t gpo = 0;
+static int channel = 0;
+static uint32_t word_idx = 0;
+static uint16_t data_out = 0;
+static int ack = 0;
+static int ack_wait = 0;
+
+static const fpga_sim_step *script = 0;
+static int script_len = 0;
+static int script_pos = 0;
+static const fpga_sim_step *step = 0;
+
+static fpga_sim_stats stats = {};
+
+uint32_t fpga_sim_hash(uint32_t hash, uint16_t word)
+{
+	return (hash ^ word) * 16777619;
+}
+
+void fpga_sim_init(uint32_t id, int fio_size, int io_ver, int delay)
+{
+	core_id = id;
+	gpi_status = (fio_size ? (1 << 16) : 0) | ((io_ver & 3) << 18);
+	ack_delay = delay;
+
+	gpo = 0;
+	channel = 0;
+	word_idx = 0;
+	data_out = 0;
+	ack = 0;
+	ack_wait = 0;
+	fpga_sim_script(0, 0);
+}
+
+void fpga_sim_script(const fpga_sim_step *steps, int count)
+{
+	script = steps;
+	script_len = count;
+	script_pos = 0;
+	step = 0;
+	memset(&stats, 0, sizeof(stats));
+	stats.hash_in = FPGA_SIM_HASH_INIT;
+}
+
+void fpga_sim_get_stats(fpga_sim_stats *res)
+{
+	*res = stats;
+}
+
+static int sim_channel(uint32_t value)
+{
+	if (value & SSPI_OSD_EN) return SIM_CH_OSD;
+	if (value & SSPI_IO_EN) return SIM_CH_UIO;
+	if (value & SSPI_FPGA_EN) return SIM_CH_FIO;
+	return 0;
+}
+
+// chip select change: the finished transfer consumes its script step
+static void sim_select(int ch)
+{
+	if (step)
+	{
+		stats.transfers++;
+		script_pos = (script_pos + 1) % script_len;
+		step = 0;
+	}
+
+	channel = ch;
+	word_idx = 0;
+}
+
+static void sim_strobe(uint16_t word)
+{
+	stats.strobes++;
+
+	if (!word_idx && script_len)
+	{
+		const fpga_sim_step *next = &script[script_pos];
+		if (next->channel == channel && (word & next->cmd_mask) == next->cmd) step = next;
+		else
+		{
+			stats.mismatches++;
+			if (stats.mismatches == 1) printf("sim: unexpected command 0x%04X on channel %d (step %d)\n", word, channel, script_pos);
+		}
+	}
+
+	if (step && word_idx && (step->flags & SIM_STEP_HASH_IN)) stats.hash_in = fpga_sim_hash(stats.hash_in, word);
+	data_out = (step && word_idx < step->resp_len) ? step->resp[word_idx] : 0;
+	word_idx++;
+}
+
+void fpga_sim_gpo_write(uint32_t value)
+{
+	uint32_t prev = gpo;
+	gpo = value;
+
+	int ch = sim_channel(value);
+	if (ch != channel) sim_select(ch);
+
+	if ((value & SSPI_STROBE) && !(prev & SSPI_STROBE))
+	{
+		if (channel) sim_strobe((uint16_t)value);
+		ack = 1;
+		ack_wait = ack_delay;
+	}
+	else if (!(value & SSPI_STROBE) && (prev & SSPI_STROBE))
+	{
+		ack = 0;
+	}
+}
+
+int fpga_sim_gpi_read()
+{
+	stats.gpi_reads++;
+
+	if (!(gpo & 0x80000000)) return core_id;
+
+	int ack_bit = 0;
+	if (ack)
+	{
+		if (ack_wait) ack_wait--;
+		else ack_bit = SSPI_ACK;
+	}
+
+	return gpi_status | ack_bit | data_out;
+}
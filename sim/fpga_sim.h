@@ -0,0 +1,42 @@
+#ifndef FPGA_SIM_H
+#define FPGA_SIM_H
+
+#include <stdint.h>
+
+// Software model of the core side of the SPI bridge. It answers the GPO/GPI accesses made by
+// fpga_spi.cpp when built with FPGA_SIM and replays a script of expected transfers.
+
+#define SIM_CH_FIO 1
+#define SIM_CH_UIO 2
+#define SIM_CH_OSD 3
+
+#define SIM_STEP_HASH_IN 1    // hash the words the host sends after the command
+
+struct fpga_sim_step
+{
+	int channel;
+	uint16_t cmd;
+	uint16_t cmd_mask;
+	const uint16_t *resp;     // resp[0] answers the command word, resp[n] the n-th word after it
+	uint32_t resp_len;
+	uint32_t flags;
+};
+
+struct fpga_sim_stats
+{
+	uint64_t strobes;
+	uint64_t gpi_reads;
+	uint32_t transfers;
+	uint32_t mismatches;
+	uint32_t hash_in;
+};
+
+void fpga_sim_init(uint32_t core_id, int fio_size, int io_ver, int ack_delay);
+void fpga_sim_script(const fpga_sim_step *steps, int count);
+void fpga_sim_get_stats(fpga_sim_stats *stats);
+
+uint32_t fpga_sim_hash(uint32_t hash, uint16_t word);
+
+#define FPGA_SIM_HASH_INIT 0x811C9DC5
+
+#endif // FPGA_SIM_H
@@ -4,6 +4,12 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
 
 #include "../../sxmlc.h"
 #include "../../user_io.h"
@@ -13,6 +19,11 @@
 #include "../../fpga_io.h"
 #include "../../lib/md5/md5.h"
 #include "../../shmem.h"
+#include "../../hardware.h"
+#include "../../offload.h"
+#include "../../cfg.h"
+#include "../../str_util.h"
+#include "../../lib/miniz/miniz.h"
 
 #include "buffer.h"
 #include "mra_loader.h"
@@ -43,6 +54,9 @@ struct arc_struct {
 	uint32_t crc;
 	buffer_data *data;
 	struct MD5Context context;
+	int romseq;
+	int cached;
+	uint64_t rom_start_us;
 };
 
 static char arcade_error_msg[kBigTextSize] = {};
@@ -271,10 +285,378 @@ static int rom_data(const uint8_t *buf, int chunk, int map, struct MD5Context *m
 	return 1;
 }
 
+/*
+ * Part prefetch
+ *
+ * Before the ROMs are assembled, a pre-pass over the MRA resolves every <part> to a zip member.
+ * Each zip is parsed once and members are looked up by CRC with a hash map. Worker threads then
+ * inflate the parts in MRA order, up to MRA_PREFETCH_MAX bytes ahead of the assembly. rom_file()
+ * takes the inflated data in the same order and chunking as before, so ROMs and MD5s are
+ * identical. Parts that weren't resolved are read the old way.
+ * */
+#define MRA_WORKERS        2
+#define MRA_PREFETCH_MAX   (64 * 1024 * 1024)
+
+struct mra_zip_t
+{
+	std::string path;
+	std::string full_path; // resolved on the main thread, getFullPath() is not thread safe
+	std::unordered_map<uint32_t, int> crc_index;
+	mz_zip_archive handle[MRA_WORKERS + 1]; // one per thread, 0 - main
+	int opened[MRA_WORKERS + 1];
+};
+
+struct mra_part_t
+{
+	int zip;
+	int index;
+	uint32_t size;
+	uint8_t *data;
+	int uses;
+	int state; // 0 - pending, 1 - inflating, 2 - ready, -1 - failed
+};
+
+static std::vector<mra_zip_t*> mra_zips;
+static std::vector<mra_part_t> mra_parts;
+static std::unordered_map<std::string, int> mra_part_map;
+static pthread_t mra_threads[MRA_WORKERS];
+static int mra_thread_cnt = 0;
+static pthread_mutex_t mra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mra_cond = PTHREAD_COND_INITIALIZER;
+static uint32_t mra_next = 0;
+static uint64_t mra_resident = 0;
+static int mra_quit = 0;
+
+static std::string mra_part_key(const char *name, uint32_t crc32)
+{
+	char crc[16];
+	sprintf(crc, ":%08X", crc32);
+	return std::string(name) + crc;
+}
+
+static mz_zip_archive *mra_zip_handle(int zip, int thread)
+{
+	mra_zip_t *z = mra_zips[zip];
+	if (!z->opened[thread])
+	{
+		mz_zip_zero_struct(&z->handle[thread]);
+		z->opened[thread] = mz_zip_reader_init_file(&z->handle[thread], z->full_path.c_str(), 0) ? 1 : -1;
+	}
+
+	return (z->opened[thread] > 0) ? &z->handle[thread] : NULL;
+}
+
+static int mra_zip_get(const char *path)
+{
+	for (size_t i = 0; i < mra_zips.size(); i++) if (mra_zips[i]->path == path) return i;
+
+	mra_zip_t *z = new mra_zip_t();
+	z->path = path;
+	z->full_path = getFullPath(path);
+	mra_zips.push_back(z);
+	int zip = mra_zips.size() - 1;
+
+	mz_zip_archive *a = mra_zip_handle(zip, 0);
+	if (a)
+	{
+		for (unsigned int i = 0; i < a->m_total_files; i++)
+		{
+			mz_zip_archive_file_stat st;
+			if (mz_zip_reader_file_stat(a, i, &st)) z->crc_index.emplace(st.m_crc32, i);
+		}
+	}
+
+	return zip;
+}
+
+// same lookup as FileOpenZip: by crc, then by name
+static void mra_part_add(const char *name, uint32_t crc32, int uses)
+{
+	std::string key = mra_part_key(name, crc32);
+	auto it = mra_part_map.find(key);
+	if (it != mra_part_map.end())
+	{
+		mra_parts[it->second].uses += uses;
+		return;
+	}
+
+	char path[kBigTextSize * 2 + 16];
+	strcpyz(path, sizeof(path), name);
+	char *z = strcasestr(path, ".zip");
+	if (!z) return;
+	z += 4;
+	char *member = (*z == '/') ? z + 1 : z;
+	*z = 0;
+
+	int zip = mra_zip_get(path);
+	mz_zip_archive *a = mra_zip_handle(zip, 0);
+	if (!a) return;
+
+	int index = -1;
+	if (crc32)
+	{
+		auto ci = mra_zips[zip]->crc_index.find(crc32);
+		if (ci != mra_zips[zip]->crc_index.end()) index = ci->second;
+	}
+	if (index < 0) index = mz_zip_reader_locate_file(a, member, NULL, 0);
+
+	mz_zip_archive_file_stat st;
+	if (index < 0 || !mz_zip_reader_file_stat(a, index, &st)) return;
+
+	mra_part_t part = {};
+	part.zip = zip;
+	part.index = index;
+	part.size = st.m_uncomp_size;
+	part.uses = uses;
+	mra_parts.push_back(part);
+	mra_part_map[key] = mra_parts.size() - 1;
+}
+
+static void mra_part_inflate(int k, int thread)
+{
+	mra_part_t *part = &mra_parts[k];
+	mz_zip_archive *a = mra_zip_handle(part->zip, thread);
+
+	size_t size = 0;
+	uint8_t *data = a ? (uint8_t*)mz_zip_reader_extract_to_heap(a, part->index, &size, 0) : NULL;
+
+	pthread_mutex_lock(&mra_lock);
+	if (data && size == part->size)
+	{
+		part->data = data;
+		part->state = 2;
+	}
+	else
+	{
+		if (data) mz_free(data);
+		mra_resident -= part->size;
+		part->state = -1;
+	}
+	pthread_cond_broadcast(&mra_cond);
+	pthread_mutex_unlock(&mra_lock);
+}
+
+static void *mra_worker(void *arg)
+{
+	int thread = (int)(intptr_t)arg;
+
+	pthread_mutex_lock(&mra_lock);
+	while (!mra_quit)
+	{
+		while (mra_next < mra_parts.size() && mra_parts[mra_next].state) mra_next++;
+
+		if (mra_next < mra_parts.size() && (!mra_resident || mra_resident + mra_parts[mra_next].size <= MRA_PREFETCH_MAX))
+		{
+			int k = mra_next++;
+			mra_parts[k].state = 1;
+			mra_resident += mra_parts[k].size;
+			pthread_mutex_unlock(&mra_lock);
+
+			mra_part_inflate(k, thread);
+
+			pthread_mutex_lock(&mra_lock);
+			continue;
+		}
+
+		if (mra_next >= mra_parts.size()) break;
+		pthread_cond_wait(&mra_cond, &mra_lock);
+	}
+	pthread_mutex_unlock(&mra_lock);
+
+	return 0;
+}
+
+struct mra_scan_t
+{
+	int romseq;
+	int skip;
+	int insiderom;
+	char zipname[kBigTextSize];
+	char partzipname[kBigTextSize];
+	char partname[kBigTextSize];
+	uint32_t crc;
+	int repeat;
+};
+
+static int romcache_has(int seq);
+
+static int xml_scan_parts(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const int n, SAX_Data* sd)
+{
+	(void)text;
+	(void)n;
+	mra_scan_t *scan = (mra_scan_t *)sd->user;
+
+	if (evt == XML_EVENT_START_NODE)
+	{
+		if (!strcasecmp(node->tag, "rom"))
+		{
+			scan->insiderom = 1;
+			scan->zipname[0] = 0;
+			scan->skip = romcache_has(++scan->romseq);
+		}
+
+		if (!strcasecmp(node->tag, "part"))
+		{
+			scan->partzipname[0] = 0;
+			scan->partname[0] = 0;
+			scan->crc = 0;
+			scan->repeat = 1;
+		}
+
+		for (int i = 0; i < node->n_attributes; i++)
+		{
+			const char *name = node->attributes[i].name;
+			const char *value = node->attributes[i].value;
+
+			if (!strcasecmp(node->tag, "rom") && !strcasecmp(name, "zip")) strcpyz(scan->zipname, sizeof(scan->zipname), value);
+			if (!strcasecmp(node->tag, "part") && scan->insiderom)
+			{
+				if (!strcasecmp(name, "zip")) strcpyz(scan->partzipname, sizeof(scan->partzipname), value);
+				if (!strcasecmp(name, "name")) strcpyz(scan->partname, sizeof(scan->partname), value);
+				if (!strcasecmp(name, "crc")) scan->crc = strtoul(value, NULL, 16);
+				if (!strcasecmp(name, "repeat")) scan->repeat = strtoul(value, NULL, 0);
+			}
+		}
+	}
+	else if (evt == XML_EVENT_END_NODE)
+	{
+		if (!strcasecmp(node->tag, "rom")) scan->insiderom = 0;
+
+		if (!strcasecmp(node->tag, "part") && scan->insiderom && !scan->skip && scan->partname[0])
+		{
+			char zipnames_list[kBigTextSize];
+			char fname[kBigTextSize * 2 + 16];
+			strcpy(zipnames_list, scan->partzipname[0] ? scan->partzipname : scan->zipname);
+
+			char *zipname = NULL;
+			char *zipptr = zipnames_list;
+			while ((zipname = strsep(&zipptr, "|")) != NULL)
+			{
+				sprintf(fname, (zipname[0] == '/') ? "%s%s/%s" : "%s/mame/%s/%s", get_arcade_root(0), zipname, scan->partname);
+
+				mra_part_add(fname, scan->crc, scan->repeat);
+				if (mra_part_map.count(mra_part_key(fname, scan->crc))) break;
+			}
+		}
+	}
+
+	return true;
+}
+
+static void mra_prefetch_start(const char *xml)
+{
+	mra_scan_t *scan = new mra_scan_t();
+
+	SAX_Callbacks sax;
+	SAX_Callbacks_init(&sax);
+	sax.all_event = xml_scan_parts;
+	XMLDoc_parse_file_SAX(xml, &sax, scan);
+	delete scan;
+
+	mra_next = 0;
+	mra_resident = 0;
+	mra_quit = 0;
+	mra_thread_cnt = 0;
+
+	if (mra_parts.size() < 2) return;
+
+	printf("MRA prefetch: %d parts from %d zips\n", (int)mra_parts.size(), (int)mra_zips.size());
+	for (int i = 0; i < MRA_WORKERS; i++)
+	{
+		if (!pthread_create(&mra_threads[mra_thread_cnt], NULL, mra_worker, (void*)(intptr_t)(i + 1))) mra_thread_cnt++;
+	}
+}
+
+static void mra_prefetch_stop()
+{
+	pthread_mutex_lock(&mra_lock);
+	mra_quit = 1;
+	pthread_cond_broadcast(&mra_cond);
+	pthread_mutex_unlock(&mra_lock);
+
+	for (int i = 0; i < mra_thread_cnt; i++) pthread_join(mra_threads[i], NULL);
+	mra_thread_cnt = 0;
+
+	for (auto &part : mra_parts) if (part.data) mz_free(part.data);
+	for (auto z : mra_zips)
+	{
+		for (int i = 0; i <= MRA_WORKERS; i++) if (z->opened[i] > 0) mz_zip_reader_end(&z->handle[i]);
+		delete z;
+	}
+
+	mra_parts.clear();
+	mra_part_map.clear();
+	mra_zips.clear();
+}
+
+// take the inflated part, inflating it here if no worker has started it yet
+static mra_part_t *mra_part_get(const char *name, uint32_t crc32)
+{
+	auto it = mra_part_map.find(mra_part_key(name, crc32));
+	if (it == mra_part_map.end()) return NULL;
+
+	int k = it->second;
+	mra_part_t *part = &mra_parts[k];
+
+	pthread_mutex_lock(&mra_lock);
+	while (part->state == 1) pthread_cond_wait(&mra_cond, &mra_lock);
+	if (!part->state)
+	{
+		part->state = 1;
+		mra_resident += part->size;
+		pthread_mutex_unlock(&mra_lock);
+		mra_part_inflate(k, 0);
+		pthread_mutex_lock(&mra_lock);
+	}
+	pthread_mutex_unlock(&mra_lock);
+
+	return (part->state == 2) ? part : NULL;
+}
+
+static void mra_part_put(mra_part_t *part)
+{
+	pthread_mutex_lock(&mra_lock);
+	if (--part->uses <= 0 && part->data)
+	{
+		mz_free(part->data);
+		part->data = NULL;
+		part->state = -1;
+		mra_resident -= part->size;
+		pthread_cond_broadcast(&mra_cond);
+	}
+	pthread_mutex_unlock(&mra_lock);
+}
+
 static int rom_file(const char *name, uint32_t crc32, int start, int len, int map, struct MD5Context *md5context)
 {
 	fileTYPE f = {};
 	static uint8_t buf[8192];
+
+	mra_part_t *part = mra_part_get(name, crc32);
+	if (part)
+	{
+		int ret = 1;
+		uint32_t pos = ((uint32_t)start < part->size) ? start : part->size;
+		unsigned long bytes2send = part->size - pos;
+		if (len > 0 && len < (int)bytes2send) bytes2send = len;
+
+		while (bytes2send)
+		{
+			uint16_t chunk = (bytes2send > sizeof(buf)) ? sizeof(buf) : bytes2send;
+			if (!rom_data(part->data + pos, chunk, map, md5context))
+			{
+				ret = 0;
+				break;
+			}
+
+			pos += chunk;
+			bytes2send -= chunk;
+		}
+
+		mra_part_put(part);
+		return ret;
+	}
+
 	if (!FileOpenZip(&f, name, crc32)) return 0;
 	if (start) FileSeek(&f, start, SEEK_SET);
 	unsigned long bytes2send = f.size - f.offset;
@@ -313,7 +695,335 @@ static int rom_patch(const uint8_t *buf, int offset, uint16_t len, int dataop)
 	return 1;
 }
 
-static void rom_finish(int send, uint32_t address, int index)
+/*
+ * Assembled ROM cache (mra_cache=1)
+ *
+ * Every <rom> assembled without an error (md5 matched or the MRA has none) is stored in
+ * config/romcache as <mra name>_<mra path hash>_<rom number>.rom with a header holding the MRA
+ * path and the cache key: md5 of the MRA file plus, for every zip it references, the path and
+ * the name, CRC32 and size of each entry from the central directory (size and mtime for folders).
+ * On a hit the parts are skipped and the blob is sent as is. Files of the same MRA with another
+ * key are removed when it's loaded, leftovers of MRAs that are gone once per session.
+ * */
+#define ROMCACHE_DIR   CONFIG_DIR "/romcache"
+#define ROMCACHE_MAX   (128 * 1024 * 1024)
+
+struct romcache_hdr
+{
+	char     magic[4];
+	uint8_t  key[16];
+	uint32_t len;
+	uint32_t assemble_us;
+	char     mra[1024];
+};
+
+struct romcache_scan_t
+{
+	struct MD5Context ctx;
+	std::vector<std::string> zips;
+};
+
+static int      romcache_valid = 0;
+static uint8_t  romcache_key[16] = {};
+static char     romcache_name[300] = {};
+static char     romcache_mra[1024] = {};
+static fileTYPE romcache_file;
+static romcache_hdr romcache_cur = {};
+
+static void romcache_hash_zips(const char *list, romcache_scan_t *scan)
+{
+	char zipnames_list[kBigTextSize];
+	char fname[kBigTextSize * 2 + 16];
+	strncpy(zipnames_list, list, sizeof(zipnames_list) - 1);
+	zipnames_list[sizeof(zipnames_list) - 1] = 0;
+
+	char *zipname = NULL;
+	char *zipptr = zipnames_list;
+	while ((zipname = strsep(&zipptr, "|")) != NULL)
+	{
+		snprintf(fname, sizeof(fname), (zipname[0] == '/') ? "%s%s" : "%s/mame/%s", get_arcade_root(0), zipname);
+
+		int known = 0;
+		for (auto &z : scan->zips) if (z == fname) known = 1;
+		if (known) continue;
+		scan->zips.push_back(fname);
+
+		MD5Update(&scan->ctx, (uint8_t*)fname, strlen(fname));
+
+		mz_zip_archive zip;
+		mz_zip_zero_struct(&zip);
+		if (mz_zip_reader_init_file(&zip, getFullPath(fname), 0))
+		{
+			for (unsigned int i = 0; i < zip.m_total_files; i++)
+			{
+				mz_zip_archive_file_stat st;
+				if (!mz_zip_reader_file_stat(&zip, i, &st)) continue;
+
+				uint64_t info[2] = { st.m_crc32, st.m_uncomp_size };
+				MD5Update(&scan->ctx, (uint8_t*)st.m_filename, strlen(st.m_filename));
+				MD5Update(&scan->ctx, (uint8_t*)info, sizeof(info));
+			}
+			mz_zip_reader_end(&zip);
+		}
+		else
+		{
+			uint64_t info[2] = {};
+			struct stat64 *st = getPathStat(fname);
+			if (st)
+			{
+				info[0] = st->st_size;
+				info[1] = st->st_mtime;
+			}
+			MD5Update(&scan->ctx, (uint8_t*)info, sizeof(info));
+		}
+	}
+}
+
+static int xml_romcache_scan(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const int n, SAX_Data* sd)
+{
+	(void)text;
+	(void)n;
+
+	if (evt == XML_EVENT_START_NODE && (!strcasecmp(node->tag, "rom") || !strcasecmp(node->tag, "part")))
+	{
+		for (int i = 0; i < node->n_attributes; i++)
+		{
+			if (!strcasecmp(node->attributes[i].name, "zip")) romcache_hash_zips(node->attributes[i].value, (romcache_scan_t *)sd->user);
+		}
+	}
+
+	return true;
+}
+
+// remove the files of this MRA with another key, once per session also unfinished writes,
+// other formats and files of MRAs which don't exist anymore
+static void romcache_clean()
+{
+	static int swept = 0;
+
+	char dir[1024];
+	snprintf(dir, sizeof(dir), "%s/%s", getRootDir(), ROMCACHE_DIR);
+	DIR *d = opendir(dir);
+	if (!d) return;
+
+	char prefix[310];
+	snprintf(prefix, sizeof(prefix), "%s_", romcache_name);
+	size_t prefix_len = strlen(prefix);
+
+	int removed = 0;
+	struct dirent *de;
+	while ((de = readdir(d)))
+	{
+		const char *ext = strrchr(de->d_name, '.');
+		if (!ext || (strcmp(ext, ".rom") && strcmp(ext, ".tmp"))) continue;
+
+		int own = !strncmp(de->d_name, prefix, prefix_len);
+		if (!own && swept) continue;
+
+		char path[1300];
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+
+		int stale = 0;
+		if (!strcmp(ext, ".tmp"))
+		{
+			// a store of this session may still be writing it
+			stale = !swept;
+		}
+		else
+		{
+			static romcache_hdr hdr;
+			int fd = open(path, O_RDONLY | O_CLOEXEC);
+			int ok = fd >= 0 && read(fd, &hdr, sizeof(hdr)) == sizeof(hdr);
+			if (fd >= 0) close(fd);
+			hdr.mra[sizeof(hdr.mra) - 1] = 0;
+
+			if (!ok || memcmp(hdr.magic, "MRC2", 4)) stale = 1;
+			else if (own) stale = memcmp(hdr.key, romcache_key, sizeof(romcache_key));
+			else stale = !FileExists(hdr.mra, 0);
+		}
+
+		if (stale && !unlink(path)) removed++;
+	}
+	closedir(d);
+
+	swept = 1;
+	if (removed) printf("romcache: removed %d stale file(s).\n", removed);
+}
+
+static void romcache_init(const char *xml)
+{
+	romcache_valid = 0;
+	if (!cfg.mra_cache) return;
+
+	int size = FileLoad(xml, 0, 0);
+	if (size <= 0) return;
+
+	uint8_t *buf = (uint8_t*)malloc(size);
+	if (!buf) return;
+
+	romcache_scan_t *scan = new romcache_scan_t();
+	MD5Init(&scan->ctx);
+	if (FileLoad(xml, buf, size) == size) MD5Update(&scan->ctx, buf, size);
+	free(buf);
+
+	SAX_Callbacks sax;
+	SAX_Callbacks_init(&sax);
+	sax.all_event = xml_romcache_scan;
+	XMLDoc_parse_file_SAX(xml, &sax, scan);
+
+	MD5Final(romcache_key, &scan->ctx);
+	delete scan;
+
+	// MRAs with the same name in different folders get their own files
+	struct MD5Context ctx;
+	uint8_t path_hash[16];
+	MD5Init(&ctx);
+	MD5Update(&ctx, (uint8_t*)xml, strlen(xml));
+	MD5Final(path_hash, &ctx);
+
+	const char *p = strrchr(xml, '/');
+	snprintf(romcache_name, sizeof(romcache_name), "%s", p ? p + 1 : xml);
+	char *ext = strcasestr(romcache_name, ".mra");
+	if (ext) *ext = 0;
+	size_t len = strlen(romcache_name);
+	snprintf(romcache_name + len, sizeof(romcache_name) - len, "_%02x%02x%02x%02x", path_hash[0], path_hash[1], path_hash[2], path_hash[3]);
+	snprintf(romcache_mra, sizeof(romcache_mra), "%s", xml);
+
+	FileCreatePath(ROMCACHE_DIR);
+	romcache_clean();
+	romcache_valid = 1;
+}
+
+static void romcache_path(char *path, int len, int seq)
+{
+	snprintf(path, len, ROMCACHE_DIR "/%s_%d.rom", romcache_name, seq);
+}
+
+static int romcache_open(int seq)
+{
+	if (!romcache_valid) return 0;
+
+	char path[512];
+	romcache_path(path, sizeof(path), seq);
+	if (!FileOpen(&romcache_file, path, 1)) return 0;
+
+	if (FileReadAdv(&romcache_file, &romcache_cur, sizeof(romcache_cur)) == sizeof(romcache_cur) &&
+		!memcmp(romcache_cur.magic, "MRC2", 4) && !memcmp(romcache_cur.key, romcache_key, sizeof(romcache_key)) &&
+		romcache_file.size == (__off64_t)(sizeof(romcache_cur) + romcache_cur.len))
+	{
+		return 1;
+	}
+
+	FileClose(&romcache_file);
+	return 0;
+}
+
+static int romcache_has(int seq)
+{
+	if (!romcache_open(seq)) return 0;
+	FileClose(&romcache_file);
+	return 1;
+}
+
+// store the blob on the offload thread, it takes the ownership of data
+static void romcache_store(int seq, uint8_t *data, uint32_t len, uint32_t assemble_us)
+{
+	if (!romcache_valid || len > ROMCACHE_MAX)
+	{
+		free(data);
+		return;
+	}
+
+	char rel[512];
+	char path[1024];
+	romcache_path(rel, sizeof(rel), seq);
+	snprintf(path, sizeof(path), "%s/%s", getRootDir(), rel);
+
+	romcache_hdr *hdr = (romcache_hdr*)calloc(1, sizeof(romcache_hdr));
+	if (!hdr)
+	{
+		free(data);
+		return;
+	}
+
+	memcpy(hdr->magic, "MRC2", 4);
+	memcpy(hdr->key, romcache_key, sizeof(hdr->key));
+	hdr->len = len;
+	hdr->assemble_us = assemble_us;
+	strcpyz(hdr->mra, sizeof(hdr->mra), romcache_mra);
+
+	offload_add_work([=]
+	{
+		char tmp[1040];
+		snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+		int ok = 0;
+		int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+		if (fd >= 0)
+		{
+			ok = write(fd, hdr, sizeof(*hdr)) == sizeof(*hdr) && write(fd, data, len) == (ssize_t)len;
+			ok = !fsync(fd) && ok;
+			close(fd);
+			if (ok) ok = !rename(tmp, path);
+			if (!ok) unlink(tmp);
+		}
+
+		if (!ok) printf("romcache: failed to write %s\n", path);
+		free(hdr);
+		free(data);
+	});
+}
+
+static void romcache_send(uint32_t address, int index, uint64_t start_us)
+{
+	uint32_t len = romcache_cur.len;
+
+	user_io_set_index(romindex);
+	user_io_set_download(1, address ? len : 0);
+
+	if (address)
+	{
+		uint8_t *mem = (uint8_t*)shmem_acquire(fpga_mem(address), len);
+		if (mem)
+		{
+			FileReadAdv(&romcache_file, mem, len);
+			shmem_release(mem);
+		}
+	}
+	else
+	{
+		static uint8_t buf[64 * 1024];
+		char str[32];
+		sprintf(str, "ROM #%d", index);
+
+		ProgressMessage(0, 0, 0, 0);
+		uint32_t remain = len;
+		while (remain)
+		{
+			ProgressMessage("Sending", str, len - remain, len);
+
+			uint32_t chunk = (remain > sizeof(buf)) ? sizeof(buf) : remain;
+			if (FileReadAdv(&romcache_file, buf, chunk) != (int)chunk) memset(buf, 0, chunk);
+
+			for (uint32_t pos = 0; pos < chunk; pos += 4096)
+			{
+				user_io_file_tx_data(buf + pos, ((chunk - pos) > 4096) ? 4096 : (chunk - pos));
+			}
+			remain -= chunk;
+		}
+		ProgressMessage(0, 0, 0, 0);
+	}
+
+	user_io_set_download(0);
+	FileClose(&romcache_file);
+
+	uint32_t ms = (GetTimerUs() - start_us) / 1000;
+	uint32_t was = romcache_cur.assemble_us / 1000;
+	printf("file_finish: 0x%X bytes sent to FPGA from cache in %ums (assembly took %ums, saved %dms)\n\n", len, ms, was, (int)(was - ms));
+}
+
+// seq is the rom number for the cache, 0 - don't cache
+static void rom_finish(int send, uint32_t address, int index, int seq, uint64_t start_us)
 {
 	if (romlen[0] && romdata)
 	{
@@ -321,6 +1031,7 @@ static void rom_finish(int send, uint32_t address, int index)
 		{
 			uint8_t *data = romdata;
 			int len = romlen[0];
+			uint32_t assemble_us = GetTimerUs() - start_us;
 
 			// set index byte (0=bios rom, 1-n=OSD entry index)
 			user_io_set_index(romindex);
@@ -353,7 +1064,14 @@ static void rom_finish(int send, uint32_t address, int index)
 
 			// signal end of transmission
 			user_io_set_download(0);
-			printf("file_finish: 0x%X bytes sent to FPGA\n\n", len);
+			printf("file_finish: 0x%X bytes sent to FPGA (assembled in %ums)\n\n", len, assemble_us / 1000);
+
+			if (romcache_valid && seq)
+			{
+				romcache_store(seq, romdata, len, assemble_us);
+				romdata = 0;
+				return;
+			}
 		}
 		else
 		{
@@ -467,6 +1185,11 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 			arc_info->insideinterleave = 0;
 			MD5Init(&arc_info->context);
 			ProgressMessage(0, 0, 0, 0);
+
+			arc_info->romseq++;
+			arc_info->rom_start_us = GetTimerUs();
+			if (arc_info->cached) FileClose(&romcache_file);
+			arc_info->cached = romcache_open(arc_info->romseq);
 		}
 
 		if (!strcasecmp(node->tag, "switches"))
@@ -765,7 +1488,20 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 		{
 			message[0] = 0;
 
-			if (arc_info->insiderom)
+			if (arc_info->insiderom && arc_info->cached)
+			{
+				// only verified ROMs are cached
+				printf("Using cached ROM #%d\n", arc_info->romindex);
+				if (arc_info->romindex == 0 && strlen(arc_info->md5) && strcasecmp(arc_info->md5, "none"))
+				{
+					arc_info->validrom0 = 1;
+					arc_info->error_msg[0] = 0;
+				}
+
+				romcache_send(arc_info->address, arc_info->romindex, arc_info->rom_start_us);
+				arc_info->cached = 0;
+			}
+			else if (arc_info->insiderom)
 			{
 				unsigned char checksum[16];
 				MD5Final(checksum, &arc_info->context);
@@ -807,7 +1543,7 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 
 				checksumsame |= no_checksum;
 
-				rom_finish(checksumsame, arc_info->address, arc_info->romindex);
+				rom_finish(checksumsame, arc_info->address, arc_info->romindex, !strlen(arc_info->error_msg) ? arc_info->romseq : 0, arc_info->rom_start_us);
 			}
 			arc_info->insiderom = 0;
 		}
@@ -820,6 +1556,7 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 			// this is useful for merged rom sets - if the first one was valid, use it
 			// the second might not be
 			if (arc_info->romindex == 0 && arc_info->validrom0 == 1) break;
+			if (arc_info->cached) break;
 			char fname[kBigTextSize * 2 + 16];
 			int start, length, repeat;
 			uint32_t crc32;
@@ -900,7 +1637,7 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 			if (!arc_info->insideinterleave) unitlen = 1;
 		}
 
-		if (!strcasecmp(node->tag, "patch") && arc_info->insiderom)
+		if (!strcasecmp(node->tag, "patch") && arc_info->insiderom && !arc_info->cached)
 		{
 			size_t len = 0;
 			unsigned char* binary = hexstr_to_char(arc_info->data->content, &len);
@@ -1077,12 +1814,19 @@ int arcade_send_rom(const char *xml)
 	arc_info.data = buffer_init(kBigTextSize);
 	arc_info.error_msg[0] = 0;
 	arc_info.validrom0 = 0;
+	arc_info.romseq = 0;
+	arc_info.cached = 0;
 	struct stat64 *st = getPathStat(xml);
 	if (st) arc_info.file_size = (int)st->st_size;
 	ProgressMessage(0, 0, 0, 0);
 
+	romcache_init(xml);
+	mra_prefetch_start(xml);
+
 	// parse
 	XMLDoc_parse_file_SAX(xml, &sax, &arc_info);
+	if (arc_info.cached) FileClose(&romcache_file);
+	mra_prefetch_stop();
 	if (arc_info.validrom0 == 0 && strlen(arc_info.error_msg))
 	{
 		strcpy(arcade_error_msg, arc_info.error_msg);
@@ -10,6 +10,7 @@
 #include "../../input.h"
 #include "../../support.h"
 #include "../../ide.h"
+#include "../../scheduler.h"
 #include "archie.h"
 
 #define CONFIG_FILENAME  "ARCHIE.CFG"
@@ -475,7 +476,11 @@ void archie_poll(void)
 
 	uint16_t sd_req = ide_check();
 	ide_io(0, sd_req & 7);
-	if (sd_req & 0x0100) ide_cdda_send_sector();
+	if (sd_req & 0x0100)
+	{
+		scheduler_busy();
+		ide_cdda_send_sector();
+	}
 
 	check_cmos(status);
 	check_reset();
@@ -517,6 +522,7 @@ void archie_poll(void)
 	{
 		unsigned char data = spi_in();
 		DisableIO();
+		scheduler_busy();
 
 		//archie_debugf("KBD RX %x", data);
 
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <algorithm>
 #include <vector>
@@ -9,6 +11,7 @@
 #include "../../file_io.h"
 #include "../../user_io.h"
 #include "../../hardware.h"
+#include "../../offload.h"
 
 #include "c64.h"
 
@@ -374,6 +377,10 @@ static int start_sectors[4][85] = {
 	// }
 };
 
+static void gcr_cache_clear(int idx);
+static void gcr_cache_prefill(int idx);
+static void gcr_cache_print_stats(int idx);
+
 int c64_openGCR(const char *path, fileTYPE *f, int idx)
 {
 	// Return value:
@@ -386,6 +393,9 @@ int c64_openGCR(const char *path, fileTYPE *f, int idx)
 	//       1=raw GCR supported  (G64_SUPPORT_GCR)
 	//       2=raw MFM supported  (G64_SUPPORT_MFM)
 
+	gcr_cache_print_stats(idx);
+	gcr_cache_clear(idx);
+
 	gcr_info[idx].f = f;
 	if (!strcasecmp(path + strlen(path) - 4, ".g64") || !strcasecmp(path + strlen(path) - 4, ".g71"))
 	{
@@ -428,12 +438,16 @@ int c64_openGCR(const char *path, fileTYPE *f, int idx)
 		FileReadAdv(f, gcr_info[idx].id, 2);
 		printf("D64/D71 disk id1=%02X, id2=%02X, tracks=%d, sectors=%d\n", gcr_info[idx].id[0], gcr_info[idx].id[1], gcr_info[idx].tracks, gcr_info[idx].sector_map[84]);
 
+		gcr_cache_prefill(idx);
+
 		return G64_SUPPORT_GCR | (gcr_info[idx].tracks > 42 ? G64_SUPPORT_DS : 0);
 	}
 }
 
 void c64_closeGCR(int idx)
 {
+	gcr_cache_print_stats(idx);
+	gcr_cache_clear(idx);
 	gcr_info[idx].type = 0;
 }
 
@@ -451,27 +465,29 @@ static const uint8_t bin_lut[32] = {
 	0, 9, 10, 11, 0, 13, 14, 0
 };
 
-static uint8_t *gcrptr;
-static int gcrcnt = 0;
-
-void bin2gcr(uint8_t bin)
+struct gcr_encoder
 {
-	static uint64_t gcr = 0;
+	uint8_t *ptr;
+	int cnt;
+	uint64_t gcr;
+};
 
-	gcr <<= 5;
-	gcr |= gcr_lut[(bin >> 4) & 0xF];
-	gcr <<= 5;
-	gcr |= gcr_lut[bin & 0xF];
+static inline void bin2gcr(gcr_encoder *enc, uint8_t bin)
+{
+	enc->gcr <<= 5;
+	enc->gcr |= gcr_lut[(bin >> 4) & 0xF];
+	enc->gcr <<= 5;
+	enc->gcr |= gcr_lut[bin & 0xF];
 
-	gcrcnt++;
-	if (gcrcnt == 4)
+	enc->cnt++;
+	if (enc->cnt == 4)
 	{
-		gcrcnt = 0;
-		*gcrptr++ = (uint8_t)(gcr >> 32);
-		*gcrptr++ = (uint8_t)(gcr >> 24);
-		*gcrptr++ = (uint8_t)(gcr >> 16);
-		*gcrptr++ = (uint8_t)(gcr >> 8);
-		*gcrptr++ = (uint8_t)(gcr);
+		enc->cnt = 0;
+		*enc->ptr++ = (uint8_t)(enc->gcr >> 32);
+		*enc->ptr++ = (uint8_t)(enc->gcr >> 24);
+		*enc->ptr++ = (uint8_t)(enc->gcr >> 16);
+		*enc->ptr++ = (uint8_t)(enc->gcr >> 8);
+		*enc->ptr++ = (uint8_t)(enc->gcr);
 	}
 }
 
@@ -492,6 +508,223 @@ void gcr2bin(uint8_t *gcr, uint8_t *bin)
 	}
 }
 
+// Builds the GCR stream of a D64 track from its sectors, returns the stream size
+static uint32_t gcr_encode_track(uint8_t *out, const uint8_t *bin, int size, uint8_t track_h, const uint8_t *id)
+{
+	gcr_encoder enc = { out, 0, 0 };
+
+	uint8_t sec = 0;
+	for (int ptr = 0; ptr < size; ptr += 256)
+	{
+		enc.cnt = 0;
+		*enc.ptr++ = 0xFF; *enc.ptr++ = 0xFF; *enc.ptr++ = 0xFF; *enc.ptr++ = 0xFF; *enc.ptr++ = 0xFF;
+		bin2gcr(&enc, 0x08);
+		bin2gcr(&enc, sec ^ track_h ^ id[0] ^ id[1]);
+		bin2gcr(&enc, sec);
+		bin2gcr(&enc, track_h);
+		bin2gcr(&enc, id[1]);
+		bin2gcr(&enc, id[0]);
+		bin2gcr(&enc, 0x0F);
+		bin2gcr(&enc, 0x0F);
+		*enc.ptr++ = 0x55; *enc.ptr++ = 0x55; *enc.ptr++ = 0x55; *enc.ptr++ = 0x55; *enc.ptr++ = 0x55;
+		*enc.ptr++ = 0x55; *enc.ptr++ = 0x55; *enc.ptr++ = 0x55; *enc.ptr++ = 0x55;
+
+		uint8_t cs = 0;
+		uint8_t bt;
+
+		*enc.ptr++ = 0xFF; *enc.ptr++ = 0xFF; *enc.ptr++ = 0xFF; *enc.ptr++ = 0xFF; *enc.ptr++ = 0xFF;
+		bin2gcr(&enc, 0x07);
+		for (int i = 0; i < 256; i++)
+		{
+			bt = bin[ptr + i];
+			cs ^= bt;
+			bin2gcr(&enc, bt);
+		}
+		bin2gcr(&enc, cs);
+		bin2gcr(&enc, 0);
+		bin2gcr(&enc, 0);
+
+		int gap = (track_h < 18) ? 8 : (track_h < 25) ? 17 : (track_h < 31) ? 12 : 9;
+		while (gap--) *enc.ptr++ = 0x55;
+		sec++;
+	}
+
+	return enc.ptr - out;
+}
+
+/*
+ * GCR track cache for D64/D71 images
+ *
+ * Encoded tracks are kept per image, so stepping back to a track is a memcpy instead of a
+ * file read plus encoding. The cache is filled on demand and by a prefill of the whole image
+ * on the offload thread right after mounting. Writes invalidate the tracks holding the written
+ * sectors (and everything if the disk ID changes). The generation counters make sure the
+ * prefill never stores a track encoded from data that was overwritten in the meantime.
+ */
+struct gcr_cache_t
+{
+	uint8_t *trk[84];
+	uint16_t trk_size[84];
+	uint32_t trk_gen[84];
+	uint32_t gen;
+
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t encoded;
+	uint64_t encode_us;
+};
+
+static gcr_cache_t gcr_cache[16] = {};
+static pthread_mutex_t gcr_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint8_t gcr_track_h(int idx, int track_f)
+{
+	return ((track_f >= 42) ? track_f % 42 + gcr_info[idx].tracks / 2 : track_f) + 1;
+}
+
+static int gcr_cache_get(int idx, int track_f, uint8_t *out, uint32_t *size)
+{
+	gcr_cache_t *c = &gcr_cache[idx];
+	int hit = 0;
+
+	pthread_mutex_lock(&gcr_cache_lock);
+	if (c->trk[track_f])
+	{
+		memcpy(out, c->trk[track_f], c->trk_size[track_f]);
+		*size = c->trk_size[track_f];
+		c->hits++;
+		hit = 1;
+	}
+	else
+	{
+		c->misses++;
+	}
+	pthread_mutex_unlock(&gcr_cache_lock);
+
+	return hit;
+}
+
+static void gcr_cache_put(int idx, int track_f, const uint8_t *data, uint32_t size, uint32_t gen, uint32_t trk_gen, uint32_t encode_us)
+{
+	gcr_cache_t *c = &gcr_cache[idx];
+
+	pthread_mutex_lock(&gcr_cache_lock);
+	c->encoded++;
+	c->encode_us += encode_us;
+	if (c->gen == gen && c->trk_gen[track_f] == trk_gen && !c->trk[track_f])
+	{
+		c->trk[track_f] = (uint8_t*)malloc(size);
+		if (c->trk[track_f])
+		{
+			memcpy(c->trk[track_f], data, size);
+			c->trk_size[track_f] = size;
+		}
+	}
+	pthread_mutex_unlock(&gcr_cache_lock);
+}
+
+// Drops the tracks holding the given sectors
+static void gcr_cache_invalidate(int idx, int sector, int count)
+{
+	gcr_cache_t *c = &gcr_cache[idx];
+	int *map = gcr_info[idx].sector_map;
+
+	pthread_mutex_lock(&gcr_cache_lock);
+	for (int t = 0; t < 84; t++)
+	{
+		if (map[t] >= sector + count || map[t + 1] <= sector) continue;
+
+		c->trk_gen[t]++;
+		free(c->trk[t]);
+		c->trk[t] = 0;
+	}
+	pthread_mutex_unlock(&gcr_cache_lock);
+}
+
+static void gcr_cache_clear(int idx)
+{
+	gcr_cache_t *c = &gcr_cache[idx];
+
+	pthread_mutex_lock(&gcr_cache_lock);
+	c->gen++;
+	for (int t = 0; t < 84; t++)
+	{
+		free(c->trk[t]);
+		c->trk[t] = 0;
+	}
+	pthread_mutex_unlock(&gcr_cache_lock);
+}
+
+static void gcr_cache_print_stats(int idx)
+{
+	gcr_cache_t *c = &gcr_cache[idx];
+
+	// the prefill job updates the counters from the offload thread
+	pthread_mutex_lock(&gcr_cache_lock);
+	uint32_t hits = c->hits;
+	uint32_t total = c->hits + c->misses;
+	uint32_t encoded = c->encoded;
+	uint64_t encode_us = c->encode_us;
+	c->hits = c->misses = c->encoded = 0;
+	c->encode_us = 0;
+	pthread_mutex_unlock(&gcr_cache_lock);
+
+	if (!total && !encoded) return;
+
+	printf("GCR cache %d: %u hits / %u reads (%u%%), %u tracks encoded in %llu us\n", idx, hits, total,
+		total ? hits * 100 / total : 0, encoded, (unsigned long long)encode_us);
+}
+
+// Encodes all tracks of a freshly mounted image in the background
+static void gcr_cache_prefill(int idx)
+{
+	fileTYPE *f = gcr_info[idx].f;
+	if (!f->filp) return;
+
+	// own descriptor, so the image can be closed while the prefill is still running
+	int fd = dup(fileno(f->filp));
+	if (fd < 0) return;
+
+	uint32_t gen = gcr_cache[idx].gen;
+	uint8_t id[2] = { gcr_info[idx].id[0], gcr_info[idx].id[1] };
+
+	uint8_t track_h[84];
+	int sector[85];
+	for (int t = 0; t < 84; t++) track_h[t] = gcr_track_h(idx, t);
+	for (int t = 0; t < 85; t++) sector[t] = gcr_info[idx].sector_map[t];
+
+	offload_add_work([=]
+	{
+		uint8_t *bin = (uint8_t*)malloc(sizeof(trk_buf));
+		uint8_t *gcr = (uint8_t*)malloc(sizeof(gcr_buf));
+
+		for (int t = 0; bin && gcr && t < 84; t++)
+		{
+			int size = (sector[t + 1] - sector[t]) * 256;
+			if (!size) continue;
+
+			pthread_mutex_lock(&gcr_cache_lock);
+			int stale = gcr_cache[idx].gen != gen;
+			int cached = gcr_cache[idx].trk[t] != 0;
+			uint32_t trk_gen = gcr_cache[idx].trk_gen[t];
+			pthread_mutex_unlock(&gcr_cache_lock);
+
+			if (stale) break;
+			if (cached) continue;
+
+			if (pread(fd, bin, size, (off_t)sector[t] * 256) != size) break;
+
+			uint64_t start = GetTimerUs();
+			uint32_t gcr_size = gcr_encode_track(gcr, bin, size, track_h[t], id);
+			gcr_cache_put(idx, t, gcr, gcr_size, gen, trk_gen, (uint32_t)(GetTimerUs() - start));
+		}
+
+		free(bin);
+		free(gcr);
+		close(fd);
+	});
+}
+
 void c64_readGCR(int idx, uint64_t lba, uint32_t blks)
 {
 	// dbgprintf("c64_readGCR: idx=%d, lba=%04llx, blks=%d\n", idx, lba, blks);
@@ -526,52 +759,24 @@ void c64_readGCR(int idx, uint64_t lba, uint32_t blks)
 	}
 	else
 	{
-		uint8_t track_h = ((track_f >= 42) ? track_f%42 + gcr_info[idx].tracks/2 : track_f) + 1;
+		uint8_t track_h = gcr_track_h(idx, track_f);
 		int size = track_f < 84 ? (gcr_info[idx].sector_map[track_f + 1] - gcr_info[idx].sector_map[track_f]) * 256 : 0;
 
 		// dbgprintf("GCR physical track=%d%s, logical track=%d, size=%d\n", (track >> 1) + 1, (track & 1) ? ".5" : "", track_h, size);
 		if (size) {
-			FileSeek(gcr_info[idx].f, gcr_info[idx].sector_map[track_f] * 256, SEEK_SET);
-			FileReadAdv(gcr_info[idx].f, trk_buf, size);
+			uint32_t gen = gcr_cache[idx].gen;
+			uint32_t trk_gen = gcr_cache[idx].trk_gen[track_f];
 
-			uint8_t sec = 0;
-			gcrptr = gcr_buf + 2;
-			for (int ptr = 0; ptr < size; ptr += 256)
+			if (!gcr_cache_get(idx, track_f, gcr_buf + 2, &track_size))
 			{
-				gcrcnt = 0;
-				*gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF;
-				bin2gcr(0x08);
-				bin2gcr(sec ^ track_h ^ gcr_info[idx].id[0] ^ gcr_info[idx].id[1]);
-				bin2gcr(sec);
-				bin2gcr(track_h);
-				bin2gcr(gcr_info[idx].id[1]);
-				bin2gcr(gcr_info[idx].id[0]);
-				bin2gcr(0x0F);
-				bin2gcr(0x0F);
-				*gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55;
-				*gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55;
-
-				uint8_t cs = 0;
-				uint8_t bt;
-
-				*gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF;
-				bin2gcr(0x07);
-				for (int i = 0; i < 256; i++)
-				{
-					bt = trk_buf[ptr + i];
-					cs ^= bt;
-					bin2gcr(bt);
-				}
-				bin2gcr(cs);
-				bin2gcr(0);
-				bin2gcr(0);
+				FileSeek(gcr_info[idx].f, gcr_info[idx].sector_map[track_f] * 256, SEEK_SET);
+				FileReadAdv(gcr_info[idx].f, trk_buf, size);
 
-				int gap = (track_h < 18) ? 8 : (track_h < 25) ? 17 : (track_h < 31) ? 12 : 9;
-				while (gap--) *gcrptr++ = 0x55;
-				sec++;
+				uint64_t t = GetTimerUs();
+				track_size = gcr_encode_track(gcr_buf + 2, trk_buf, size, track_h, gcr_info[idx].id);
+				gcr_cache_put(idx, track_f, gcr_buf + 2, track_size, gen, trk_gen, (uint32_t)(GetTimerUs() - t));
 			}
 
-			track_size = gcrptr - gcr_buf - 2;
 			dbgprintf("Read GCR track %d: bin_size = %d, gcr_size = %d\n", track_f+1, size, track_size);
 		}
 		else {
@@ -785,6 +990,8 @@ void c64_writeGCR(int idx, uint64_t lba, uint32_t blks)
 
 	dbgprintf("\n\nGCR track = %d\n", track + 1);
 
+	uint8_t old_id[2] = { gcr_info[idx].id[0], gcr_info[idx].id[1] };
+
 	int sync = 0;
 	uint8_t prev = 0, started = 0;
 	uint32_t off = 0, ptr = 2;
@@ -872,4 +1079,8 @@ void c64_writeGCR(int idx, uint64_t lba, uint32_t blks)
 
 	FileSeek(gcr_info[idx].f, gcr_info[idx].sector_map[track] * 256, SEEK_SET);
 	FileWriteAdv(gcr_info[idx].f, trk_buf, sec_cnt * 256);
+
+	// the disk ID is part of every sector header
+	if (memcmp(old_id, gcr_info[idx].id, 2)) gcr_cache_clear(idx);
+	else gcr_cache_invalidate(idx, gcr_info[idx].sector_map[track], sec_cnt);
 }
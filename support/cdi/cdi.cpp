@@ -17,8 +17,6 @@
 static char buf[1024];
 #define CD_SECTOR_LEN 2352
 
-static uint8_t *chd_hunkbuf = NULL;
-static int chd_hunknum;
 
 static int sgets(char *out, int sz, char **in)
 {
@@ -57,12 +55,9 @@ static void unload_chd(toc_t *table)
 {
 	if (table->chd_f)
 	{
-		chd_close(table->chd_f);
+		mister_chd_close(table->chd_f);
 	}
-	if (chd_hunkbuf)
-		free(chd_hunkbuf);
 	memset(table, 0, sizeof(toc_t));
-	chd_hunknum = -1;
 }
 
 static void unload_cue(toc_t *table)
@@ -107,9 +102,6 @@ static int load_chd(const char *filename, toc_t *table)
 
 	table->end = table->tracks[table->last - 1].end + 1;
 
-	chd_hunkbuf = (uint8_t *)malloc(table->chd_hunksize);
-	chd_hunknum = -1;
-
 	return 1;
 }
 
@@ -401,7 +393,7 @@ void cdi_read_cd(uint8_t *buffer, int lba, int cnt)
 
 							// The "fake" 150 sector pregap moves all the LBAs up by 150, so adjust here to read where the core actually wants data from
 							int read_lba = lba - toc.tracks[0].indexes[1];
-							if (mister_chd_read_sector(toc.chd_f, (read_lba + toc.tracks[i].offset), 0, 0, CD_SECTOR_LEN, buffer, chd_hunkbuf, &chd_hunknum) == CHDERR_NONE)
+							if (mister_chd_read_sector(toc.chd_f, (read_lba + toc.tracks[i].offset), 0, 0, CD_SECTOR_LEN, buffer) == CHDERR_NONE)
 							{
 								if (!toc.tracks[i].type) // CHD requires byteswap of audio data
 								{
@@ -5,10 +5,211 @@
 #include <string.h>
 #include <inttypes.h>
 #include <time.h>
+#include <pthread.h>
 #include "../../file_io.h"
 #include "../../cd.h"
+#include "../../offload.h"
 #include "mister_chd.h"
 
+int mister_chd_log(const char *format, ...);
+
+// Decompressed hunk cache shared by all CHD consumers.
+// Entries are keyed by (chd_file, hunk) and evicted in LRU order once the byte limit is hit.
+#define CHD_CACHE_ENTRIES   128
+#define CHD_CACHE_BYTES     (4 * 1024 * 1024)
+#define CHD_PREFETCH_HUNKS  4
+#define CHD_STREAMS         4
+
+struct chd_cache_entry_t
+{
+	chd_file *chd_f;
+	int       hunk;
+	uint8_t  *buf;
+	uint32_t  size;
+	uint32_t  stamp;
+};
+
+static chd_cache_entry_t chd_cache[CHD_CACHE_ENTRIES] = {};
+static uint32_t chd_cache_bytes = 0;
+static uint32_t chd_cache_stamp = 0;
+static chd_cache_stats_t chd_stats = {};
+
+// cache_lock protects the cache table, io_lock serializes chd_read() as chd_file is not thread safe.
+static pthread_mutex_t chd_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t chd_io_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// recently entered hunks, used to detect sequential streams (data and CDDA may interleave)
+static chd_file *chd_stream_f = NULL;
+static int chd_stream_hunk[CHD_STREAMS] = {};
+static int chd_stream_pos = 0;
+
+static OffloadEvent chd_prefetch_done;
+static bool chd_prefetch_busy = false;
+
+static chd_cache_entry_t *chd_cache_find(chd_file *chd_f, int hunk)
+{
+	for (int i = 0; i < CHD_CACHE_ENTRIES; i++)
+	{
+		if (chd_cache[i].buf && chd_cache[i].chd_f == chd_f && chd_cache[i].hunk == hunk) return &chd_cache[i];
+	}
+	return NULL;
+}
+
+static void chd_cache_free(chd_cache_entry_t *e)
+{
+	chd_cache_bytes -= e->size;
+	free(e->buf);
+	memset(e, 0, sizeof(chd_cache_entry_t));
+}
+
+// takes ownership of buf. Must be called with cache_lock held.
+static void chd_cache_insert(chd_file *chd_f, int hunk, uint8_t *buf, uint32_t size)
+{
+	if (chd_cache_find(chd_f, hunk))
+	{
+		free(buf);
+		return;
+	}
+
+	chd_cache_entry_t *slot = NULL;
+	for (;;)
+	{
+		chd_cache_entry_t *lru = NULL;
+		slot = NULL;
+		for (int i = 0; i < CHD_CACHE_ENTRIES; i++)
+		{
+			if (!chd_cache[i].buf) slot = &chd_cache[i];
+			else if (!lru || (chd_cache_stamp - chd_cache[i].stamp) > (chd_cache_stamp - lru->stamp)) lru = &chd_cache[i];
+		}
+
+		if (slot && (chd_cache_bytes + size) <= CHD_CACHE_BYTES) break;
+		if (!lru) break;
+
+		chd_cache_free(lru);
+		chd_stats.evicted++;
+	}
+
+	slot->chd_f = chd_f;
+	slot->hunk = hunk;
+	slot->buf = buf;
+	slot->size = size;
+	slot->stamp = ++chd_cache_stamp;
+	chd_cache_bytes += size;
+}
+
+static chd_error chd_cache_load(chd_file *chd_f, int hunk, bool prefetch)
+{
+	const chd_header *chd_header = chd_get_header(chd_f);
+	if (!chd_header) return CHDERR_INVALID_PARAMETER;
+	if ((uint32_t)hunk >= chd_header->totalhunks) return CHDERR_HUNK_OUT_OF_RANGE;
+
+	pthread_mutex_lock(&chd_io_lock);
+
+	// may have been loaded by the other thread while waiting
+	pthread_mutex_lock(&chd_cache_lock);
+	bool cached = chd_cache_find(chd_f, hunk) != NULL;
+	pthread_mutex_unlock(&chd_cache_lock);
+	if (cached)
+	{
+		pthread_mutex_unlock(&chd_io_lock);
+		return CHDERR_NONE;
+	}
+
+	uint8_t *buf = (uint8_t *)malloc(chd_header->hunkbytes);
+	if (!buf)
+	{
+		pthread_mutex_unlock(&chd_io_lock);
+		return CHDERR_OUT_OF_MEMORY;
+	}
+
+	chd_error err = chd_read(chd_f, hunk, buf);
+	pthread_mutex_unlock(&chd_io_lock);
+
+	if (err != CHDERR_NONE)
+	{
+		free(buf);
+		return err;
+	}
+
+	pthread_mutex_lock(&chd_cache_lock);
+	if (prefetch) chd_stats.prefetched++;
+	chd_cache_insert(chd_f, hunk, buf, chd_header->hunkbytes);
+	pthread_mutex_unlock(&chd_cache_lock);
+	return CHDERR_NONE;
+}
+
+static void chd_prefetch(chd_file *chd_f, int hunk)
+{
+	if (chd_prefetch_busy && !chd_prefetch_done.is_set()) return;
+
+	chd_prefetch_busy = true;
+	chd_prefetch_done.reset();
+	offload_add_work([=]
+	{
+		for (int i = 1; i <= CHD_PREFETCH_HUNKS; i++)
+		{
+			if (chd_cache_load(chd_f, hunk + i, true) != CHDERR_NONE) break;
+		}
+		chd_prefetch_done.signal();
+	});
+}
+
+// Called on entering a new hunk. Kicks off read-ahead if the previous hunk was read recently.
+static void chd_stream_update(chd_file *chd_f, int hunk)
+{
+	if (chd_stream_f != chd_f)
+	{
+		chd_stream_f = chd_f;
+		for (int i = 0; i < CHD_STREAMS; i++) chd_stream_hunk[i] = -2;
+	}
+
+	bool sequential = false;
+	for (int i = 0; i < CHD_STREAMS; i++)
+	{
+		if (chd_stream_hunk[i] == hunk) return;
+		if (chd_stream_hunk[i] == hunk - 1)
+		{
+			chd_stream_hunk[i] = hunk;
+			sequential = true;
+		}
+	}
+
+	if (!sequential)
+	{
+		chd_stream_hunk[chd_stream_pos] = hunk;
+		chd_stream_pos = (chd_stream_pos + 1) % CHD_STREAMS;
+		return;
+	}
+
+	chd_prefetch(chd_f, hunk);
+}
+
+void mister_chd_close(chd_file *chd_f)
+{
+	if (!chd_f) return;
+
+	if (chd_prefetch_busy) chd_prefetch_done.wait();
+	chd_prefetch_busy = false;
+
+	pthread_mutex_lock(&chd_cache_lock);
+	for (int i = 0; i < CHD_CACHE_ENTRIES; i++)
+	{
+		if (chd_cache[i].buf && chd_cache[i].chd_f == chd_f) chd_cache_free(&chd_cache[i]);
+	}
+	mister_chd_log("CHD cache: hits %u, misses %u, prefetched %u, evicted %u\n", chd_stats.hits, chd_stats.misses, chd_stats.prefetched, chd_stats.evicted);
+	pthread_mutex_unlock(&chd_cache_lock);
+
+	if (chd_stream_f == chd_f) chd_stream_f = NULL;
+	chd_close(chd_f);
+}
+
+void mister_chd_cache_stats(chd_cache_stats_t *stats)
+{
+	pthread_mutex_lock(&chd_cache_lock);
+	*stats = chd_stats;
+	pthread_mutex_unlock(&chd_cache_lock);
+}
+
 void lba_to_hunkinfo(chd_file *chd_f, int lba, int *hunknumber, int *hunkoffset)
 {
 	const chd_header *chd_header = chd_get_header(chd_f);
@@ -160,27 +361,42 @@ chd_error mister_load_chd(const char *filename, toc_t *cd_toc)
 	return CHDERR_NONE;
 }
 
-chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf, uint8_t *hunkbuf, int *hunknum)
+chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf)
 {
 
 	int tmphnum = 0;
 	int hunkofs = 0;
 
 	lba_to_hunkinfo(chd_f, lba, &tmphnum, &hunkofs);
-
+	int sector_offset = hunkofs * CD_FRAME_SIZE;
 
 	//mister_chd_log("READ LBA: %d, dest_offset: %d sector offset: %d length %d chd_f %p\n", lba, d_offset, s_offset, length, chd_f);
-	if (tmphnum != *hunknum)
+	bool miss = false;
+	for (;;)
 	{
-		chd_error err = chd_read(chd_f, tmphnum, hunkbuf);
+		pthread_mutex_lock(&chd_cache_lock);
+		chd_cache_entry_t *e = chd_cache_find(chd_f, tmphnum);
+		if (e)
+		{
+			e->stamp = ++chd_cache_stamp;
+			if (miss) chd_stats.misses++;
+			else chd_stats.hits++;
+			memcpy(destbuf + d_offset, e->buf + sector_offset + s_offset, length);
+			pthread_mutex_unlock(&chd_cache_lock);
+
+			chd_stream_update(chd_f, tmphnum);
+			return CHDERR_NONE;
+		}
+		pthread_mutex_unlock(&chd_cache_lock);
+
+		if (miss) return CHDERR_OUT_OF_MEMORY;
+		miss = true;
+
+		chd_error err = chd_cache_load(chd_f, tmphnum, false);
 		if (err != CHDERR_NONE)
 		{
 			mister_chd_log("ERROR %s\n", chd_error_string(err));
 			return err;
 		}
-		*hunknum = tmphnum;
 	}
-	int sector_offset = hunkofs * CD_FRAME_SIZE;
-	memcpy(destbuf + d_offset, hunkbuf + sector_offset + s_offset, length);
-	return CHDERR_NONE;
 }
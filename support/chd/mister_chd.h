@@ -5,7 +5,17 @@
 #include <libchdr/cdrom.h>
 #include "../../cd.h"
 
-chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf, uint8_t *hunkbuf, int *hunknum);
+struct chd_cache_stats_t
+{
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t prefetched;
+	uint32_t evicted;
+};
+
+chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf);
 chd_error mister_load_chd(const char *filename, toc_t *cd_toc);
+void mister_chd_close(chd_file *chd_f);
+void mister_chd_cache_stats(chd_cache_stats_t *stats);
 
 #endif
@@ -10,6 +10,7 @@
 #include "../../hardware.h"
 #include "../../menu.h"
 #include "../../cheats.h"
+#include "../../scheduler.h"
 #include "megacd.h"
 
 #define SAVE_IO_INDEX 5 // fake download to trigger save loading
@@ -58,6 +59,7 @@ void mcd_poll()
 	if (req != last_req)
 	{
 		last_req = req;
+		scheduler_busy();
 
 		spi_w(MCD_GET_CMD);
 
@@ -20,8 +20,6 @@ cdd_t::cdd_t() {
 	status = CD_STAT_NO_DISC;
 	audioLength = 0;
 	audioOffset = 0;
-	chd_hunkbuf = NULL;
-	chd_hunknum = -1;
 	SendData = NULL;
 	CanSendData = NULL;
 
@@ -258,14 +256,6 @@ int cdd_t::Load(const char *filename)
 			printf("ERROR %s\n", chd_error_string(err));
 			return -1;
 		}
-
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-		}
-
-		this->chd_hunkbuf = (uint8_t *)malloc(this->toc.chd_hunksize);
-		this->chd_hunknum = -1;
  	} else {
 		return (-1);
 
@@ -273,7 +263,7 @@ int cdd_t::Load(const char *filename)
 
 	if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header, this->chd_hunkbuf, &this->chd_hunknum);
+		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header);
 	} else {
 		fd_img = &this->toc.tracks[0].f;
 
@@ -315,13 +305,7 @@ void cdd_t::Unload()
 	{
 		if (this->toc.chd_f)
 		{
-			chd_close(this->toc.chd_f);
-		}
-
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-			this->chd_hunkbuf = NULL;
+			mister_chd_close(this->toc.chd_f);
 		}
 
 		for (int i = 0; i < this->toc.last; i++)
@@ -928,7 +912,7 @@ void cdd_t::ReadData(uint8_t *buf)
 				read_offset += 16;
 			}
 
-			mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[0].offset, 0, read_offset, 2048, buf, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[0].offset, 0, read_offset, 2048, buf);
 		} else {
 			if (this->sectorSize == 2048)
 			{
@@ -958,7 +942,7 @@ int cdd_t::ReadCDDA(uint8_t *buf)
 	{
 		for(int i = 0; i < this->audioLength / 2352; i++)
 		{
-			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 2352*i, 0, 2352, buf, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 2352*i, 0, 2352, buf);
 		}
 
 		//CHD audio requires byteswap. There's probably a better way to do this...
@@ -1005,9 +989,9 @@ int cdd_t::ReadSubcode(uint16_t* buf)
 	{
 		//Just use the read sector call with an offset, since we previously read that sector, it is already in the hunk cache
 		if (this->toc.tracks[this->index].sbc_type == SUBCODE_RW_RAW) {
-			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 0, CD_MAX_SECTOR_DATA, 96, (uint8_t *)buf, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 0, CD_MAX_SECTOR_DATA, 96, (uint8_t *)buf);
 		} else if (this->toc.tracks[this->index].sbc_type == SUBCODE_RW) {
-			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 0, CD_MAX_SECTOR_DATA, 96, subc, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 0, CD_MAX_SECTOR_DATA, 96, subc);
 			InterleaveSubcode(subc, buf);
 		} else {
 			err = -1;
@@ -24,6 +24,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 // 2010-01-09   - support for variable number of tracks
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "../../hardware.h"
 #include "../../file_io.h"
@@ -31,7 +32,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "minimig_config.h"
 #include "../../debug.h"
 #include "../../user_io.h"
+#include "../../fpga_io.h"
 #include "../../menu.h"
+#include "../../scheduler.h"
 
 unsigned char drives = 0; // number of active drives reported by FPGA (may change only during reset)
 adfTYPE *pdfx;            // drive select pointer
@@ -51,9 +54,28 @@ unsigned char Error;
 
 #define B2W(a,b) (((((uint16_t)(a))<<8) & 0xFF00) | ((uint16_t)(b) & 0x00FF))
 
-						  // sends the data in the sector buffer to the FPGA, translated into an Amiga floppy format sector
-						  // note that we do not insert clock bits because they will be stripped by the Amiga software anyway
-void SendSector(unsigned char *pData, unsigned char sector, unsigned char track, unsigned char dsksynch, unsigned char dsksyncl)
+#define SECTOR_WORDS (SECTOR_SIZE / 2)
+#define TRACK_WORDS (TRACK_SIZE / 2)
+
+// Tracks are MFM encoded once and kept per drive until another disk is inserted.
+// Only the sync words depend on the FPGA state, they are patched in before each sector is sent.
+static uint16_t *mfm_cache[4][MAX_TRACKS] = {};
+
+struct fdd_stats_t
+{
+	uint32_t reads;
+	uint32_t encoded;
+	uint32_t sectors;
+	uint32_t status_words;
+	uint64_t read_us;
+	uint64_t encode_us;
+};
+
+static fdd_stats_t fdd_stats[4] = {};
+
+// encodes the sector data into an Amiga floppy format sector
+// note that we do not insert clock bits because they will be stripped by the Amiga software anyway
+static void EncodeSector(uint16_t *out, unsigned char *pData, unsigned char sector, unsigned char track)
 {
 	unsigned char checksum[4];
 	unsigned short i;
@@ -61,48 +83,48 @@ void SendSector(unsigned char *pData, unsigned char sector, unsigned char track,
 	unsigned char *p;
 
 	// preamble
-	spi_w(0xAAAA);
-	spi_w(0xAAAA);
+	*out++ = 0xAAAA;
+	*out++ = 0xAAAA;
 
-	// synchronization
-	spi_w(B2W(dsksynch, dsksyncl));
-	spi_w(B2W(dsksynch, dsksyncl));
+	// synchronization, patched in ReadTrack
+	*out++ = 0x4489;
+	*out++ = 0x4489;
 
 	// odd bits of header
 	x = 0x55;
 	checksum[0] = x;
 	y = (track >> 1) & 0x55;
 	checksum[1] = y;
-	spi_w(B2W(x,y));
+	*out++ = B2W(x,y);
 
 	x = (sector >> 1) & 0x55;
 	checksum[2] = x;
 	y = ((11 - sector) >> 1) & 0x55;
 	checksum[3] = y;
-	spi_w(B2W(x, y));
+	*out++ = B2W(x, y);
 
 	// even bits of header
 	x = 0x55;
 	checksum[0] ^= x;
 	y = track & 0x55;
 	checksum[1] ^= y;
-	spi_w(B2W(x, y));
+	*out++ = B2W(x, y);
 
 	x = sector & 0x55;
 	checksum[2] ^= x;
 	y = (11 - sector) & 0x55;
 	checksum[3] ^= y;
-	spi_w(B2W(x, y));
+	*out++ = B2W(x, y);
 
 	// sector label and reserved area (changes nothing to checksum)
 	i = 0x10;
-	while (i--) spi_w(0xAAAA);
+	while (i--) *out++ = 0xAAAA;
 
-	// send header checksum
-	spi_w(0xAAAA);
-	spi_w(0xAAAA);
-	spi_w(B2W(checksum[0] | 0xAA, checksum[1] | 0xAA));
-	spi_w(B2W(checksum[2] | 0xAA, checksum[3] | 0xAA));
+	// header checksum
+	*out++ = 0xAAAA;
+	*out++ = 0xAAAA;
+	*out++ = B2W(checksum[0] | 0xAA, checksum[1] | 0xAA);
+	*out++ = B2W(checksum[2] | 0xAA, checksum[3] | 0xAA);
 
 	// calculate data checksum
 	checksum[0] = 0;
@@ -124,11 +146,11 @@ void SendSector(unsigned char *pData, unsigned char sector, unsigned char track,
 		checksum[3] ^= x ^ x >> 1;
 	}
 
-	// send data checksum
-	spi_w(0xAAAA);
-	spi_w(0xAAAA);
-	spi_w(B2W(checksum[0] | 0xAA, checksum[1] | 0xAA));
-	spi_w(B2W(checksum[2] | 0xAA, checksum[3] | 0xAA));
+	// data checksum
+	*out++ = 0xAAAA;
+	*out++ = 0xAAAA;
+	*out++ = B2W(checksum[0] | 0xAA, checksum[1] | 0xAA);
+	*out++ = B2W(checksum[2] | 0xAA, checksum[3] | 0xAA);
 
 	// odd bits of data field
 	i = DATA_SIZE / 4;
@@ -137,7 +159,7 @@ void SendSector(unsigned char *pData, unsigned char sector, unsigned char track,
 	{
 		x = (*p++ >> 1) | 0xAA;
 		y = (*p++ >> 1) | 0xAA;
-		spi_w(B2W(x, y));
+		*out++ = B2W(x, y);
 	}
 
 	// even bits of data field
@@ -147,14 +169,71 @@ void SendSector(unsigned char *pData, unsigned char sector, unsigned char track,
 	{
 		x = *p++ | 0xAA;
 		y = *p++ | 0xAA;
-		spi_w(B2W(x, y));
+		*out++ = B2W(x, y);
 	}
 }
 
-void SendGap(void)
+// returns the encoded current track of the drive (sectors followed by the gap)
+static uint16_t *GetTrackMFM(adfTYPE *drive)
 {
-	unsigned short i = GAP_SIZE/2;
-	while (i--) spi_w(0xAAAA);
+	int idx = drive - df;
+	if (drive->track >= MAX_TRACKS) return NULL;
+
+	uint16_t *mfm = mfm_cache[idx][drive->track];
+	if (mfm) return mfm;
+
+	uint64_t t = GetTimerUs();
+	static uint8_t track_buffer[SECTOR_COUNT * 512];
+	if (!FileSeekLBA(&drive->file, drive->track * SECTOR_COUNT)) return NULL;
+	if (FileReadAdv(&drive->file, track_buffer, sizeof(track_buffer)) != sizeof(track_buffer)) return NULL;
+
+	mfm = (uint16_t*)malloc(TRACK_WORDS * sizeof(uint16_t));
+	if (!mfm) return NULL;
+
+	for (int sector = 0; sector < SECTOR_COUNT; sector++)
+	{
+		EncodeSector(mfm + sector * SECTOR_WORDS, track_buffer + sector * 512, sector, drive->track);
+	}
+
+	for (int i = SECTOR_COUNT * SECTOR_WORDS; i < TRACK_WORDS; i++) mfm[i] = 0xAAAA;
+
+	mfm_cache[idx][drive->track] = mfm;
+	fdd_stats[idx].encoded++;
+	fdd_stats[idx].encode_us += GetTimerUs() - t;
+	return mfm;
+}
+
+static void InvalidateTrackMFM(adfTYPE *drive, int track)
+{
+	int idx = drive - df;
+	if (track < 0)
+	{
+		for (int i = 0; i < MAX_TRACKS; i++)
+		{
+			free(mfm_cache[idx][i]);
+			mfm_cache[idx][i] = 0;
+		}
+	}
+	else if (track < MAX_TRACKS)
+	{
+		free(mfm_cache[idx][track]);
+		mfm_cache[idx][track] = 0;
+	}
+}
+
+static void PrintFddStats(adfTYPE *drive)
+{
+	int idx = drive - df;
+	fdd_stats_t *st = &fdd_stats[idx];
+	if (st->reads)
+	{
+		printf("DF%d: %u track reads (%u encoded in %llu us), %u sectors streamed, %u status words, %llu us per track read.\n",
+			idx, st->reads, st->encoded, (unsigned long long)st->encode_us, st->sectors, st->status_words,
+			(unsigned long long)(st->read_us / st->reads));
+		printf("DF%d: %u handshaked SPI words instead of %u with per-word sector transfer.\n",
+			idx, st->status_words, st->status_words + st->sectors * SECTOR_WORDS + (st->sectors / SECTOR_COUNT) * (TRACK_WORDS - SECTOR_COUNT * SECTOR_WORDS));
+	}
+	memset(st, 0, sizeof(fdd_stats_t));
 }
 
 // read a track from disk
@@ -174,22 +253,22 @@ void ReadTrack(adfTYPE *drive)
 		drive->track = drive->tracks - 1;
 	}
 
-	unsigned long lba;
-
 	if (drive->track != drive->track_prev)
 	{ // track step or track 0, start at beginning of track
 		drive->track_prev = drive->track;
 		sector = 0;
 		drive->sector_offset = sector;
-		lba = drive->track * SECTOR_COUNT;
 	}
 	else
 	{ // same track, start at next sector in track
 		sector = drive->sector_offset;
-		lba = (drive->track * SECTOR_COUNT) + sector;
 	}
 
-	if (!FileSeekLBA(&drive->file, lba))
+	uint64_t t = GetTimerUs();
+	fdd_stats_t *st = &fdd_stats[drive - df];
+
+	uint16_t *mfm = GetTrackMFM(drive);
+	if (!mfm)
 	{
 		return;
 	}
@@ -201,14 +280,13 @@ void ReadTrack(adfTYPE *drive)
 	dsksync = spi_w(0); // disk sync
 	spi_w(0); // mfm words to transfer
 	DisableFpga();
+	st->status_words += 3;
 
 	if (track >= drive->tracks)
 		track = drive->tracks - 1;
 
 	while (1)
 	{
-		FileReadSec(&drive->file, sector_buffer);
-
 		EnableFpga();
 
 		// check if FPGA is still asking for data
@@ -217,6 +295,7 @@ void ReadTrack(adfTYPE *drive)
 		track = (uint8_t)tmp; // track number (cylinder & head)
 		dsksync = spi_w(0); // disk sync
 		spi_w(0); // mfm words to transfer
+		st->status_words += 3;
 
 		if (track >= drive->tracks)
 			track = drive->tracks - 1;
@@ -239,12 +318,13 @@ void ReadTrack(adfTYPE *drive)
 			// send sector if fpga is still asking for data
 			if (status & CMD_RDTRK)
 			{
-				//GenerateHeader(sector_header, sector_buffer, sector, track, dsksync);
-				//SendSector(sector_header, sector_buffer);
-				SendSector(sector_buffer, sector, track, (unsigned char)(dsksync >> 8), (unsigned char)dsksync);
+				uint16_t *p = mfm + sector * SECTOR_WORDS;
+				p[2] = dsksync;
+				p[3] = dsksync;
 
-				if (sector == LAST_SECTOR)
-					SendGap();
+				// the gap follows the last sector in the buffer
+				fpga_spi_fast_block_write(p, (sector == LAST_SECTOR) ? TRACK_WORDS - LAST_SECTOR * SECTOR_WORDS : SECTOR_WORDS);
+				st->sectors++;
 			}
 		}
 
@@ -264,16 +344,14 @@ void ReadTrack(adfTYPE *drive)
 		{
 			// go to the start of current track
 			sector = 0;
-			lba = drive->track * SECTOR_COUNT;
-			if (!FileSeekLBA(&drive->file, lba))
-			{
-				return;
-			}
 		}
 
 		// remember current sector
 		drive->sector_offset = sector;
 	}
+
+	st->reads++;
+	st->read_us += GetTimerUs() - t;
 }
 
 unsigned char FindSync(adfTYPE *drive)
@@ -564,6 +642,7 @@ void WriteTrack(adfTYPE *drive)
 
 	//    drive->track_prev = drive->track + 1; // This causes a read that directly follows a write to the previous track to return bad data.
 	drive->track_prev = -1; // just to force next read from the start of current track
+	InvalidateTrackMFM(drive, drive->track);
 
 	while (FindSync(drive))
 	{
@@ -612,6 +691,8 @@ void HandleFDD(unsigned char c1, unsigned char c2)
 	unsigned char sel;
 	drives = (c1 >> 4) & 0x03; // number of active floppy drives
 
+	if (c1 & (CMD_RDTRK | CMD_WRTRK)) scheduler_busy();
+
 	if (c1 & CMD_RDTRK)
 	{
 		sel = (c1 >> 6) & 0x03;
@@ -636,6 +717,9 @@ void InsertFloppy(adfTYPE *drive, char* path)
 		return;
 	}
 
+	PrintFddStats(drive);
+	InvalidateTrackMFM(drive, -1);
+
 	unsigned long tracks;
 
 	// calculate number of tracks in the ADF image file
@@ -900,7 +900,7 @@ void minimig_share_poll()
 {
 	if (!shmem)
 	{
-		shmem = (uint8_t *)shmem_map(SHMEM_ADDR, SHMEM_SIZE);
+		shmem = (uint8_t *)shmem_acquire(SHMEM_ADDR, SHMEM_SIZE);
 		if (!shmem) shmem = (uint8_t *)-1;
 	}
 	else if(shmem != (uint8_t *)-1)
@@ -2,7 +2,13 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <string>
+#include <vector>
 
 #include "../../hardware.h"
 #include "../../menu.h"
@@ -658,100 +664,292 @@ static bool parse_and_apply_db_tags(char* tags) {
 	return (system_type != SystemType::UNKNOWN && cic_type != CIC::UNKNOWN);
 }
 
-static bool md5_matches(const char* line, const char* md5) {
-	for (size_t i = MD5_LENGTH * 2; i > 0; --i, line++, md5++) {
-		int c = *line;
-		if (!c || *md5 != tolower(c)) {
-			return false;
-		}
+/*
+ * Binary index of the N64 databases
+ *
+ * The text files stay the source of truth. Each one gets a compiled index in config/n64db, which is
+ * rebuilt whenever the size or mtime of the text file changes. MD5 and exact cart ID entries are
+ * sorted for binary search, wildcard/prefix ID patterns are kept in file order (there are few).
+ * The rest of every line is stored as text, so only the matched entry gets parsed.
+ * The first match in file order wins, same as with the linear scan.
+ */
+#define N64DB_INDEX_DIR CONFIG_DIR "/n64db"
+
+struct n64db_hdr {
+	char magic[4];
+	uint32_t src_size;
+	int64_t src_mtime;
+	uint32_t md5_cnt;
+	uint32_t id_cnt;
+	uint32_t wild_cnt;
+	uint32_t text_size;
+};
+
+struct n64db_md5 {
+	uint8_t md5[MD5_LENGTH];
+	uint32_t text;
+};
+
+struct n64db_id {
+	char id[CARTID_LENGTH];
+	uint8_t len;
+	uint8_t reserved;
+	uint32_t order;
+	uint32_t text;
+};
+
+struct n64db_index {
+	~n64db_index() { unmap(); }
+
+	void unmap() {
+		if (map) munmap(map, map_size);
+		map = nullptr;
+		hdr = nullptr;
 	}
 
+	void* map = nullptr;
+	size_t map_size = 0;
+	std::vector<uint8_t> mem; // freshly built index
+
+	const n64db_hdr* hdr = nullptr;
+	const n64db_md5* md5 = nullptr;
+	const n64db_id* ids = nullptr; // id_cnt exact IDs (sorted), then wild_cnt patterns (file order)
+	const char* text = nullptr;
+};
+
+static bool md5_from_hex(const char* hex, uint8_t* md5) {
+	for (size_t i = 0; i < MD5_LENGTH * 2; i++) {
+		if (!isxdigit(hex[i])) return false;
+	}
+
+	for (size_t i = 0; i < MD5_LENGTH; i++) {
+		md5[i] = (hex_to_dec(hex[i * 2]) << 4) | hex_to_dec(hex[i * 2 + 1]);
+	}
+
+	return true;
+}
+
+static bool n64db_set(n64db_index* idx, const uint8_t* data, size_t size) {
+	auto hdr = (const n64db_hdr*)data;
+	if (size < sizeof(n64db_hdr) || memcmp(hdr->magic, "N64I", 4)) return false;
+
+	size_t tables = sizeof(n64db_hdr) + hdr->md5_cnt * sizeof(n64db_md5) + (hdr->id_cnt + hdr->wild_cnt) * sizeof(n64db_id);
+	if (tables + hdr->text_size != size || !hdr->text_size || data[size - 1]) return false;
+
+	idx->hdr = hdr;
+	idx->md5 = (const n64db_md5*)(hdr + 1);
+	idx->ids = (const n64db_id*)(idx->md5 + hdr->md5_cnt);
+	idx->text = (const char*)(data + tables);
 	return true;
 }
 
-// Returns numbers of matching characters if match, otherwize 0
-static size_t cart_id_is_match(const char* line, const char* cart_id) {
+static bool n64db_build(const char* db_path, uint32_t src_size, int64_t src_mtime, std::vector<uint8_t>& out) {
+	fileTextReader reader = {};
+	if (!FileOpenTextReader(&reader, db_path)) return false;
+
+	std::vector<n64db_md5> md5s;
+	std::vector<n64db_id> ids, wild;
+	std::string text(1, '\0'); // offset 0 = empty tags
+
 	const auto prefix_len = strlen(CARTID_PREFIX);
+	uint32_t order = 0;
 
-	// A valid ID line should start with "ID:"
-	if (strncmp(line, CARTID_PREFIX, prefix_len)) {
-		return 0;
-	}
+	while (const char* line = FileReadLine(&reader)) {
+		order++;
 
-	// Skip the line if it doesn't match our cart_id, '_' = don't care
-	const char* lp = line + prefix_len;
-	for (size_t i = 0; i < CARTID_LENGTH && *lp; i++, lp++) {
-		if (i && isspace(*lp)) {
-			return i; // Early termination
+		n64db_md5 m;
+		if (md5_from_hex(line, m.md5)) {
+			m.text = text.size();
+			text.append(line + MD5_LENGTH * 2).push_back('\0');
+			md5s.push_back(m);
+			continue;
 		}
 
-		if (*lp != '_' && *lp != cart_id[i]) {
-			return 0; // Character didn't match pattern
+		if (strncmp(line, CARTID_PREFIX, prefix_len)) continue;
+
+		// A valid ID line starts with "ID:", followed by up to 6 characters ('_' = don't care),
+		// a shorter pattern is terminated by whitespace
+		n64db_id id = {};
+		const char* lp = line + prefix_len;
+		size_t len = 0;
+		while (len < CARTID_LENGTH && lp[len] && !(len && isspace(lp[len]))) {
+			id.id[len] = lp[len];
+			len++;
+		}
+
+		id.len = len;
+		id.order = order;
+		id.text = 0;
+		if (len == CARTID_LENGTH || lp[len]) {
+			id.text = text.size();
+			text.append(lp + len).push_back('\0');
 		}
+
+		if (len == CARTID_LENGTH && !memchr(id.id, '_', len)) ids.push_back(id);
+		else wild.push_back(id);
+	}
+
+	// Sort, keeping only the first entry of duplicates
+	std::stable_sort(md5s.begin(), md5s.end(), [](const n64db_md5& a, const n64db_md5& b) { return memcmp(a.md5, b.md5, MD5_LENGTH) < 0; });
+	md5s.erase(std::unique(md5s.begin(), md5s.end(), [](const n64db_md5& a, const n64db_md5& b) { return !memcmp(a.md5, b.md5, MD5_LENGTH); }), md5s.end());
+	std::stable_sort(ids.begin(), ids.end(), [](const n64db_id& a, const n64db_id& b) { return memcmp(a.id, b.id, CARTID_LENGTH) < 0; });
+	ids.erase(std::unique(ids.begin(), ids.end(), [](const n64db_id& a, const n64db_id& b) { return !memcmp(a.id, b.id, CARTID_LENGTH); }), ids.end());
+
+	n64db_hdr hdr = {};
+	memcpy(hdr.magic, "N64I", 4);
+	hdr.src_size = src_size;
+	hdr.src_mtime = src_mtime;
+	hdr.md5_cnt = md5s.size();
+	hdr.id_cnt = ids.size();
+	hdr.wild_cnt = wild.size();
+	hdr.text_size = text.size();
+
+	out.clear();
+	auto append = [&out](const void* p, size_t sz) { out.insert(out.end(), (const uint8_t*)p, (const uint8_t*)p + sz); };
+	append(&hdr, sizeof(hdr));
+	append(md5s.data(), md5s.size() * sizeof(n64db_md5));
+	append(ids.data(), ids.size() * sizeof(n64db_id));
+	append(wild.data(), wild.size() * sizeof(n64db_id));
+	append(text.data(), text.size());
+
+	printf("N64 DB index: %u MD5, %u ID, %u ID pattern entries.\n", hdr.md5_cnt, hdr.id_cnt, hdr.wild_cnt);
+	return true;
+}
+
+static bool n64db_open(n64db_index* idx, const char* db_file_name) {
+	char db_path[1024];
+	snprintf(db_path, sizeof(db_path), "%s/%s", HomeDir(), db_file_name);
+
+	struct stat64* st = getPathStat(db_path);
+	if (!st) return false;
+
+	uint32_t src_size = st->st_size;
+	int64_t src_mtime = st->st_mtime;
+
+	char idx_path[1024];
+	snprintf(idx_path, sizeof(idx_path), "%s/" N64DB_INDEX_DIR "/%s.idx", getRootDir(), db_file_name);
+
+	int fd = open(idx_path, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		struct stat64 ist;
+		if (!fstat64(fd, &ist) && ist.st_size >= (off64_t)sizeof(n64db_hdr)) {
+			void* map = mmap(nullptr, ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (map != MAP_FAILED) {
+				idx->map = map;
+				idx->map_size = ist.st_size;
+			}
+		}
+		close(fd);
+
+		if (idx->map && n64db_set(idx, (const uint8_t*)idx->map, idx->map_size) &&
+			idx->hdr->src_size == src_size && idx->hdr->src_mtime == src_mtime) {
+			return true;
+		}
+
+		idx->unmap();
 	}
 
-	return CARTID_LENGTH;
+	printf("Building index for N64 data file \"%s\".\n", db_file_name);
+	if (!n64db_build(db_path, src_size, src_mtime, idx->mem)) return false;
+
+	// The index is used from memory this time, a failed write only costs a rebuild next time.
+	FileCreatePath(N64DB_INDEX_DIR);
+	char tmp[1040];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", idx_path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+	if (fd >= 0) {
+		bool ok = write(fd, idx->mem.data(), idx->mem.size()) == (ssize_t)idx->mem.size();
+		close(fd);
+		if (!ok || rename(tmp, idx_path)) {
+			printf("Failed to write N64 DB index \"%s\".\n", idx_path);
+			unlink(tmp);
+		}
+	}
+
+	return n64db_set(idx, idx->mem.data(), idx->mem.size());
 }
 
-static uint8_t detect_rom_settings_in_db(const char* lookup_hash, const char* db_file_name) {
-	fileTextReader reader = {};
+// Returns the text following the MD5 in the matching line, or nullptr
+static const char* n64db_find_md5(const n64db_index* idx, const char* lookup_hash) {
+	n64db_md5 key;
+	if (!md5_from_hex(lookup_hash, key.md5)) return nullptr;
+
+	auto end = idx->md5 + idx->hdr->md5_cnt;
+	auto it = std::lower_bound(idx->md5, end, key, [](const n64db_md5& a, const n64db_md5& b) { return memcmp(a.md5, b.md5, MD5_LENGTH) < 0; });
+	if (it == end || memcmp(it->md5, key.md5, MD5_LENGTH)) return nullptr;
+
+	return idx->text + it->text;
+}
+
+// Returns the matching entry, or nullptr
+static const n64db_id* n64db_find_cartid(const n64db_index* idx, const char* cart_id) {
+	const n64db_id* found = nullptr;
+
+	n64db_id key = {};
+	memcpy(key.id, cart_id, CARTID_LENGTH);
+	auto end = idx->ids + idx->hdr->id_cnt;
+	auto it = std::lower_bound(idx->ids, end, key, [](const n64db_id& a, const n64db_id& b) { return memcmp(a.id, b.id, CARTID_LENGTH) < 0; });
+	if (it != end && !memcmp(it->id, cart_id, CARTID_LENGTH)) found = it;
 
-	snprintf(full_path, sizeof(full_path), "%s/%s", HomeDir(), db_file_name);
+	// A pattern earlier in the file takes precedence
+	for (auto w = end; w < end + idx->hdr->wild_cnt; w++) {
+		if (found && w->order > found->order) break;
 
-	if (!FileOpenTextReader(&reader, full_path)) {
+		size_t i = 0;
+		while (i < w->len && (w->id[i] == '_' || w->id[i] == cart_id[i])) i++;
+		if (i == w->len) return w;
+	}
+
+	return found;
+}
+
+static uint8_t detect_rom_settings_in_db(const char* lookup_hash, const char* db_file_name) {
+	n64db_index idx;
+
+	if (!n64db_open(&idx, db_file_name)) {
 		printf("Failed to open N64 data file \"%s\".\n", db_file_name);
 		return 0;
 	}
 
-	while (const char* line = FileReadLine(&reader)) {
-		// Skip the line if it doesn't start with our hash
-		if (!md5_matches(line, lookup_hash)) continue;
-
-		const char* s = line + (MD5_LENGTH * 2);
-		char* tags = new char[strlen(s) + 1];
-		if (sscanf(s, "%*[ \t]%[^#;]", tags) <= 0) {
-			printf("Found ROM entry for MD5 %s, but the tag was malformed! (%s)\n", lookup_hash, s);
-			return 2;
-		}
-
-		printf("Found ROM entry for MD5 %s: [%s]\n", lookup_hash, tags);
+	// Skip the DB if it doesn't have our hash
+	const char* s = n64db_find_md5(&idx, lookup_hash);
+	if (!s) return 0;
 
-		// 2 = System region and/or CIC wasn't in DB, will need further detection
-		return parse_and_apply_db_tags(tags) ? 3 : 2;
+	char* tags = new char[strlen(s) + 1];
+	if (sscanf(s, "%*[ \t]%[^#;]", tags) <= 0) {
+		printf("Found ROM entry for MD5 %s, but the tag was malformed! (%s)\n", lookup_hash, s);
+		return 2;
 	}
 
-	return 0;
+	printf("Found ROM entry for MD5 %s: [%s]\n", lookup_hash, tags);
+
+	// 2 = System region and/or CIC wasn't in DB, will need further detection
+	return parse_and_apply_db_tags(tags) ? 3 : 2;
 }
 
 static uint8_t detect_rom_settings_in_db_with_cartid(const char* cart_id, const char* db_file_name) {
-	fileTextReader reader = {};
+	n64db_index idx;
 
-	snprintf(full_path, sizeof(full_path), "%s/%s", HomeDir(), db_file_name);
-
-	if (!FileOpenTextReader(&reader, full_path)) {
+	if (!n64db_open(&idx, db_file_name)) {
 		printf("Failed to open N64 data file \"%s\".\n", db_file_name);
 		return 0;
 	}
 
-	while (const char* line = FileReadLine(&reader)) {
-		// Skip lines that doesn't start with our ID
-		size_t i;
-		if (!(i = cart_id_is_match(line, cart_id))) continue;
-
-		auto s = line + strlen(CARTID_PREFIX) + i;
-		auto tags = new char[strlen(s) + 1];
-		if (sscanf(s, "%*[ \t]%[^#;]", tags) <= 0) {
-			printf("Found ROM entry for ID [%s], but the tag was malformed! \"%s\".\n", cart_id, s);
-			return 2;
-		}
-
-		printf("Found ROM entry for ID [%s]: \"%s\".\n", cart_id, tags);
+	// Skip the DB if it doesn't have our ID
+	auto entry = n64db_find_cartid(&idx, cart_id);
+	if (!entry) return 0;
 
-		// 2 = System region and/or CIC wasn't in DB, will need further detection
-		return parse_and_apply_db_tags(tags) ? 3 : 2;
+	auto s = idx.text + entry->text;
+	auto tags = new char[strlen(s) + 1];
+	if (sscanf(s, "%*[ \t]%[^#;]", tags) <= 0) {
+		printf("Found ROM entry for ID [%s], but the tag was malformed! \"%s\".\n", cart_id, s);
+		return 2;
 	}
 
-	return 0;
+	printf("Found ROM entry for ID [%s]: \"%s\".\n", cart_id, tags);
+
+	// 2 = System region and/or CIC wasn't in DB, will need further detection
+	return parse_and_apply_db_tags(tags) ? 3 : 2;
 }
 
 static const char* DB_FILE_NAMES[] = {
@@ -1412,7 +1610,7 @@ void n64_poll() {
 			if (rdram_ptr == (void*)-1) return;
 
 			if (!rdram_ptr) {
-				if (!(rdram_ptr = shmem_map(0x30000000, RAM_SIZE))) {
+				if (!(rdram_ptr = shmem_acquire(0x30000000, RAM_SIZE))) {
 					rdram_ptr = (void*)-1;
 					printf("Failed to map RDRAM!\n");
 					Info("Failed to initialize cheat engine!", 2000);
@@ -1522,7 +1720,7 @@ int n64_rom_tx(const char* name, unsigned char idx, uint32_t load_addr, uint32_t
 	loaded = 0;
 
 	if (rdram_ptr && rdram_ptr != (void*)-1) {
-		shmem_unmap(rdram_ptr, RAM_SIZE);
+		shmem_release(rdram_ptr);
 		rdram_ptr = nullptr;
 	}
 
@@ -1548,7 +1746,7 @@ int n64_rom_tx(const char* name, unsigned char idx, uint32_t load_addr, uint32_t
 	// CRC32 is used for cheat look-up
 	file_crc = 0;
 
-	void* mem = load_addr ? (uint8_t*)shmem_map(fpga_mem(load_addr), data_size) : nullptr;
+	void* mem = load_addr ? (uint8_t*)shmem_acquire(fpga_mem(load_addr), data_size) : nullptr;
 	uint8_t* write_ptr = (uint8_t*)mem;
 
 	MD5Context ctx;
@@ -1698,7 +1896,7 @@ int n64_rom_tx(const char* name, unsigned char idx, uint32_t load_addr, uint32_t
 			}
 		}
 
-		shmem_unmap(mem, data_size);
+		shmem_release(mem);
 	}
 
 	strcpy(current_rom_path, name);
@@ -5,6 +5,9 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <time.h>   // clock_gettime, CLOCK_REALTIME
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 #include "neogeo_loader.h"
 #include "neogeocd.h"
 #include "../../sxmlc.h"
@@ -13,6 +16,8 @@
 #include "../../osd.h"
 #include "../../menu.h"
 #include "../../shmem.h"
+#include "../../hardware.h"
+#include "../../offload.h"
 
 struct NeoFile
 {
@@ -28,7 +33,12 @@ struct NeoFile
 	uint8_t Filler2[4096 - 512];	//fill to 4096
 };
 
-static inline void spr_convert(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+/*
+ * Every conversion has a scalar reference (*_ref), which converts from the given start index to the end.
+ * With NEON available the whole blocks are converted by SIMD and only the tail goes through the reference.
+ * */
+
+static inline void spr_convert_ref(uint16_t* buf_in, uint16_t* buf_out, uint32_t start, uint32_t size)
 {
 	/*
 	In C ROMs, a word provides two bitplanes for an 8-pixel wide line
@@ -52,7 +62,7 @@ static inline void spr_convert(uint16_t* buf_in, uint16_t* buf_out, uint32_t siz
 	Out: FEDCBA9876 15432 0
 	*/
 
-	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
+	for (uint32_t i = start; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
 
 	/*
 	0 <- 20
@@ -73,17 +83,18 @@ static inline void spr_convert(uint16_t* buf_in, uint16_t* buf_out, uint32_t siz
 	*/
 }
 
-static inline void spr_convert_skp(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+// same as spr_convert, but only every other word of the output is written (phase selects odd/even)
+static inline void spr_convert_skp_ref(uint16_t* buf_in, uint16_t* buf_out, uint32_t phase, uint32_t start, uint32_t size)
 {
-	for (uint32_t i = 0; i < size; i++) buf_out[i << 1] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
+	for (uint32_t i = start; i < size; i++) buf_out[(i << 1) | phase] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
 }
 
-static inline void spr_convert_dbl(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+static inline void spr_convert_dbl_ref(uint16_t* buf_in, uint16_t* buf_out, uint32_t start, uint32_t size)
 {
-	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x3F) | ((i ^ 1) & 1) | ((i >> 1) & 0x1E) | (((i & 2) ^ 2) << 4)];
+	for (uint32_t i = start; i < size; i++) buf_out[i] = buf_in[(i & ~0x3F) | ((i ^ 1) & 1) | ((i >> 1) & 0x1E) | (((i & 2) ^ 2) << 4)];
 }
 
-static void fix_convert(uint8_t* buf_in, uint8_t* buf_out, uint32_t size)
+static void fix_convert_ref(uint8_t* buf_in, uint8_t* buf_out, uint32_t start, uint32_t size)
 {
 	/*
 	In S ROMs, a byte provides two pixels
@@ -105,7 +116,228 @@ static void fix_convert(uint8_t* buf_in, uint8_t* buf_out, uint32_t size)
 	In:  FEDCBA9876543210
 	Out: FEDCBA9876510432
 	*/
-	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 2) & 7) | ((i & 1) << 3) | (((i & 2) << 3) ^ 0x10)];
+	for (uint32_t i = start; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 2) & 7) | ((i & 1) << 3) | (((i & 2) << 3) ^ 0x10)];
+}
+
+static inline void spr_bswap_ref(uint32_t* buf, uint32_t start, uint32_t size)
+{
+	for (uint32_t i = start; i < size; i++) buf[i] = (buf[i] & 0xFF0000FF) | ((buf[i] & 0xFF00) << 8) | ((buf[i] & 0xFF0000) >> 8);
+}
+
+#ifdef __ARM_NEON
+
+// 32 words per block: out = interleave(in[16..31], in[0..15])
+static uint32_t spr_convert_neon(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+{
+	uint32_t i;
+	for (i = 0; i + 32 <= size; i += 32)
+	{
+		uint16x8x2_t lo = { { vld1q_u16(buf_in + i + 16), vld1q_u16(buf_in + i) } };
+		uint16x8x2_t hi = { { vld1q_u16(buf_in + i + 24), vld1q_u16(buf_in + i + 8) } };
+		vst2q_u16(buf_out + i, lo);
+		vst2q_u16(buf_out + i + 16, hi);
+	}
+	return i;
+}
+
+// The other C ROM of the pair fills the remaining words, so they are read back and stored
+// together: a single 32-byte burst to uncached DDR is much cheaper than 16 separate halfword stores.
+static uint32_t spr_convert_skp_neon(uint16_t* buf_in, uint16_t* buf_out, uint32_t phase, uint32_t size)
+{
+	uint32_t i;
+	for (i = 0; i + 32 <= size; i += 32)
+	{
+		uint16x8x2_t lo = vzipq_u16(vld1q_u16(buf_in + i + 16), vld1q_u16(buf_in + i));
+		uint16x8x2_t hi = vzipq_u16(vld1q_u16(buf_in + i + 24), vld1q_u16(buf_in + i + 8));
+		uint16x8_t conv[4] = { lo.val[0], lo.val[1], hi.val[0], hi.val[1] };
+
+		uint16_t *out = buf_out + (i << 1);
+		for (int j = 0; j < 4; j++, out += 16)
+		{
+			uint16x8x2_t d = vld2q_u16(out);
+			if (phase) d.val[1] = conv[j];
+			else d.val[0] = conv[j];
+			vst2q_u16(out, d);
+		}
+	}
+	return i;
+}
+
+// 64 words per block, as 32-bit pairs: out32[2k] = swap(in32[16 + k]), out32[2k + 1] = swap(in32[k])
+static uint32_t spr_convert_dbl_neon(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+{
+	uint32_t i;
+	for (i = 0; i + 64 <= size; i += 64)
+	{
+		for (int j = 0; j < 32; j += 8)
+		{
+			uint32x4x2_t d = { {
+				vreinterpretq_u32_u16(vrev32q_u16(vld1q_u16(buf_in + i + 32 + j))),
+				vreinterpretq_u32_u16(vrev32q_u16(vld1q_u16(buf_in + i + j)))
+			} };
+			vst2q_u32((uint32_t*)(buf_out + i + j * 2), d);
+		}
+	}
+	return i;
+}
+
+// 32 bytes per block: out[4r..4r+3] = in[16 + r], in[24 + r], in[r], in[8 + r]
+static uint32_t fix_convert_neon(uint8_t* buf_in, uint8_t* buf_out, uint32_t size)
+{
+	uint32_t i;
+	for (i = 0; i + 32 <= size; i += 32)
+	{
+		uint8x16_t a = vld1q_u8(buf_in + i);
+		uint8x16_t b = vld1q_u8(buf_in + i + 16);
+		uint8x8x4_t d = { { vget_low_u8(b), vget_high_u8(b), vget_low_u8(a), vget_high_u8(a) } };
+		vst4_u8(buf_out + i, d);
+	}
+	return i;
+}
+
+static uint32_t spr_bswap_neon(uint32_t* buf, uint32_t size)
+{
+	static const uint8_t order[8] = { 0, 2, 1, 3, 4, 6, 5, 7 };
+	uint8x8_t tbl = vld1_u8(order);
+
+	uint32_t i;
+	for (i = 0; i + 4 <= size; i += 4)
+	{
+		uint8x16_t v = vld1q_u8((uint8_t*)(buf + i));
+		v = vcombine_u8(vtbl1_u8(vget_low_u8(v), tbl), vtbl1_u8(vget_high_u8(v), tbl));
+		vst1q_u8((uint8_t*)(buf + i), v);
+	}
+	return i;
+}
+
+#define NEO_SIMD(x) x
+#else
+#define NEO_SIMD(x) 0
+#endif
+
+static inline void spr_convert(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+{
+	spr_convert_ref(buf_in, buf_out, NEO_SIMD(spr_convert_neon(buf_in, buf_out, size)), size);
+}
+
+static inline void spr_convert_skp(uint16_t* buf_in, uint16_t* buf_out, uint32_t phase, uint32_t size)
+{
+	spr_convert_skp_ref(buf_in, buf_out, phase, NEO_SIMD(spr_convert_skp_neon(buf_in, buf_out, phase, size)), size);
+}
+
+static inline void spr_convert_dbl(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+{
+	spr_convert_dbl_ref(buf_in, buf_out, NEO_SIMD(spr_convert_dbl_neon(buf_in, buf_out, size)), size);
+}
+
+static inline void fix_convert(uint8_t* buf_in, uint8_t* buf_out, uint32_t size)
+{
+	fix_convert_ref(buf_in, buf_out, NEO_SIMD(fix_convert_neon(buf_in, buf_out, size)), size);
+}
+
+static inline void spr_bswap(uint32_t* buf, uint32_t size)
+{
+	spr_bswap_ref(buf, NEO_SIMD(spr_bswap_neon(buf, size)), size);
+}
+
+// MiSTer_cmd: neogeo_bench
+// Checks every conversion against its scalar reference and reports the throughput of both.
+struct neo_kernel
+{
+	const char *name;
+	void (*fast)(uint8_t *in, uint8_t *out, uint32_t size);
+	void (*ref)(uint8_t *in, uint8_t *out, uint32_t size);
+};
+
+static const neo_kernel neo_kernels[] =
+{
+	{ "spr_convert",
+		[](uint8_t *in, uint8_t *out, uint32_t size) { spr_convert((uint16_t*)in, (uint16_t*)out, size / 2); },
+		[](uint8_t *in, uint8_t *out, uint32_t size) { spr_convert_ref((uint16_t*)in, (uint16_t*)out, 0, size / 2); } },
+	{ "spr_convert_skp",
+		[](uint8_t *in, uint8_t *out, uint32_t size) { spr_convert_skp((uint16_t*)in, (uint16_t*)out, 1, size / 2); },
+		[](uint8_t *in, uint8_t *out, uint32_t size) { spr_convert_skp_ref((uint16_t*)in, (uint16_t*)out, 1, 0, size / 2); } },
+	{ "spr_convert_dbl",
+		[](uint8_t *in, uint8_t *out, uint32_t size) { spr_convert_dbl((uint16_t*)in, (uint16_t*)out, size / 2); },
+		[](uint8_t *in, uint8_t *out, uint32_t size) { spr_convert_dbl_ref((uint16_t*)in, (uint16_t*)out, 0, size / 2); } },
+	{ "fix_convert",
+		[](uint8_t *in, uint8_t *out, uint32_t size) { fix_convert(in, out, size); },
+		[](uint8_t *in, uint8_t *out, uint32_t size) { fix_convert_ref(in, out, 0, size); } },
+	{ "spr_bswap",
+		[](uint8_t *in, uint8_t *out, uint32_t size) { memcpy(out, in, size); spr_bswap((uint32_t*)out, size / 4); },
+		[](uint8_t *in, uint8_t *out, uint32_t size) { memcpy(out, in, size); spr_bswap_ref((uint32_t*)out, 0, size / 4); } },
+};
+
+void neogeo_bench()
+{
+	// odd size, so the scalar tails get exercised as well
+	const uint32_t size = LOADBUF_SZ - 36;
+	const int loops = 8;
+
+	// the conversions read the whole 32/64 element block of the last index, so the input
+	// is padded to a multiple of the largest block (64 x 16 bit) with zeroes
+	const uint32_t in_size = (size + 127) & ~127;
+
+	uint8_t *in = (uint8_t*)malloc(in_size);
+	uint8_t *out1 = (uint8_t*)malloc(size * 2);
+	uint8_t *out2 = (uint8_t*)malloc(size * 2);
+	if (!in || !out1 || !out2)
+	{
+		free(in);
+		free(out1);
+		free(out2);
+		return;
+	}
+
+	srand(1);
+	for (uint32_t i = 0; i < size; i++) in[i] = rand();
+	memset(in + size, 0, in_size - size);
+
+#ifdef __ARM_NEON
+	printf("NeoGeo conversion benchmark (NEON), %u bytes x %d:\n", size, loops);
+#else
+	printf("NeoGeo conversion benchmark (no NEON, scalar only), %u bytes x %d:\n", size, loops);
+#endif
+
+	for (auto &k : neo_kernels)
+	{
+		memset(out1, 0x5A, size * 2);
+		memset(out2, 0x5A, size * 2);
+
+		uint64_t t = GetTimerUs();
+		for (int i = 0; i < loops; i++) k.ref(in, out1, size);
+		uint64_t t_ref = GetTimerUs() - t;
+
+		t = GetTimerUs();
+		for (int i = 0; i < loops; i++) k.fast(in, out2, size);
+		uint64_t t_fast = GetTimerUs() - t;
+
+		int ok = !memcmp(out1, out2, size * 2);
+		printf("  %-16s ref %6.1f MB/s, fast %6.1f MB/s: %s\n", k.name,
+			(double)size * loops / (t_ref ? t_ref : 1), (double)size * loops / (t_fast ? t_fast : 1), ok ? "OK" : "MISMATCH");
+	}
+
+	free(in);
+	free(out1);
+	free(out2);
+}
+
+/*
+ * Pipelined reading: the next chunk is read on the offload thread into the other buffer
+ * while the current one is converted and written to DDR.
+ * */
+static uint8_t neo_loadbuf2[LOADBUF_SZ];
+static OffloadEvent neo_read_done;
+
+static void neo_read_start(fileTYPE *f, uint8_t *buf, uint32_t clear, uint32_t size)
+{
+	neo_read_done.reset();
+	offload_add_work([=]
+	{
+		if (clear) memset(buf, 0, clear);
+		if (size) FileReadAdv(f, buf, size);
+		neo_read_done.signal();
+	});
 }
 
 static const char *get_name(const char *path, const char *name)
@@ -239,26 +471,35 @@ static uint32_t load_crom_to_mem(const char* path, const char* name, uint8_t ind
 	uint32_t remain = size;
 	uint32_t map_addr = 0x38000000 + (((index - 64) >> 1) * 1024 * 1024);
 
+	uint8_t *bufs[2] = { loadbuf, neo_loadbuf2 };
+	int cur = 0;
+
 	ProgressMessage();
+	neo_read_start(&f, bufs[cur], 0, ((remain > LOADBUF_SZ) ? LOADBUF_SZ : remain) / 2);
 	while (remain)
 	{
 		uint32_t partsz = remain;
 		if (partsz > LOADBUF_SZ) partsz = LOADBUF_SZ;
 
+		neo_read_done.wait();
+
 		//printf("partsz=%d, map_addr=0x%X\n", partsz, map_addr);
-		void *base = shmem_map(map_addr, partsz);
+		void *base = shmem_acquire(map_addr, partsz);
 		if (!base)
 		{
 			FileClose(&f);
 			return 0;
 		}
 
-		FileReadAdv(&f, loadbuf, partsz/2);
-		spr_convert_skp((uint16_t*)loadbuf, ((uint16_t*)base) + ((index ^ 1) & 1), partsz / 4);
+		uint32_t next = remain - partsz;
+		if (next) neo_read_start(&f, bufs[cur ^ 1], 0, ((next > LOADBUF_SZ) ? LOADBUF_SZ : next) / 2);
+
+		spr_convert_skp((uint16_t*)bufs[cur], (uint16_t*)base, (index ^ 1) & 1, partsz / 4);
+		cur ^= 1;
 
 		ProgressMessage("Loading", dispname, size - (remain - partsz), size);
 
-		shmem_unmap(base, partsz);
+		shmem_release(base);
 		remain -= partsz;
 		map_addr += partsz;
 	}
@@ -269,11 +510,6 @@ static uint32_t load_crom_to_mem(const char* path, const char* name, uint8_t ind
 	return map_addr - 0x38000000;
 }
 
-static inline void spr_bswap(uint32_t* buf, uint32_t size)
-{
-	for (uint32_t i = 0; i < size; i++) buf[i] = (buf[i] & 0xFF0000FF) | ((buf[i] & 0xFF00) << 8) | ((buf[i] & 0xFF0000) >> 8);
-}
-
 static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_file_type, uint8_t index, uint32_t offset, uint32_t size, uint32_t expand, int swap, uint32_t addr)
 {
 	fileTYPE f = {};
@@ -299,35 +535,44 @@ static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_
 
 	uint32_t map_addr = 0x30000000 + (addr ? (addr + 0x8000000) : ((index >= 16) && (index < 64)) ? (index - 16) * 0x80000 : (index == 9) ? 0x2000000 : 0x8000000);
 
+	// converted types go through the read pipeline, raw data is read straight into DDR
+	int pipelined = (neo_file_type == NEO_FILE_FIX || neo_file_type == NEO_FILE_SPR);
+	uint8_t *bufs[2] = { loadbuf, neo_loadbuf2 };
+	int cur = 0;
+
+	uint32_t partszf = remainf;
+	if (partszf > LOADBUF_SZ) partszf = LOADBUF_SZ;
+
 	ProgressMessage();
+	if (pipelined) neo_read_start(&f, bufs[cur], (remain > LOADBUF_SZ) ? LOADBUF_SZ : remain, partszf);
 	while (remain)
 	{
 		uint32_t partsz = remain;
 		if (partsz > LOADBUF_SZ) partsz = LOADBUF_SZ;
 
-		uint32_t partszf = remainf;
-		if (partszf > LOADBUF_SZ) partszf = LOADBUF_SZ;
+		if (pipelined) neo_read_done.wait();
 
 		//printf("partsz=%d, map_addr=0x%X\n", partsz, map_addr);
-		void *base = shmem_map(map_addr, partsz);
+		void *base = shmem_acquire(map_addr, partsz);
 		if (!base)
 		{
 			FileClose(&f);
 			return 0;
 		}
 
+		uint32_t next = remain - partsz;
+		if (pipelined && next) neo_read_start(&f, bufs[cur ^ 1], (next > LOADBUF_SZ) ? LOADBUF_SZ : next, partszf);
+
 		if (neo_file_type == NEO_FILE_FIX)
 		{
-			memset(loadbuf, 0, partsz);
-			if (partszf) FileReadAdv(&f, loadbuf, partszf);
-			fix_convert(loadbuf, (uint8_t*)base, partsz);
+			fix_convert(bufs[cur], (uint8_t*)base, partsz);
+			cur ^= 1;
 		}
 		else if (neo_file_type == NEO_FILE_SPR)
 		{
-			memset(loadbuf, 0, partsz);
-			if (partszf) FileReadAdv(&f, loadbuf, partszf);
-			if (swap) spr_bswap((uint32_t*)loadbuf, partsz / 4);
-			spr_convert_dbl((uint16_t*)loadbuf, (uint16_t*)base, partsz / 2);
+			if (swap) spr_bswap((uint32_t*)bufs[cur], partsz / 4);
+			spr_convert_dbl((uint16_t*)bufs[cur], (uint16_t*)base, partsz / 2);
+			cur ^= 1;
 		}
 		else
 		{
@@ -337,7 +582,7 @@ static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_
 
 		ProgressMessage("Loading", dispname, size - (remain - partsz), size);
 
-		shmem_unmap(base, partsz);
+		shmem_release(base);
 		remain -= partsz;
 		map_addr += partsz;
 	}
@@ -380,10 +625,10 @@ static void notify_core(uint8_t index, uint32_t size, uint32_t memcp_force = 0)
 
 static uint32_t fill_ram(uint32_t size, uint8_t pattern)
 {
-	void *base = shmem_map(0x38000000, size);
+	void *base = shmem_acquire(0x38000000, size);
 	if (!base) return 0;
 	memset(base, pattern, size);
-	shmem_unmap(base, size);
+	shmem_release(base);
 
 	notify_core(18, size, 1);
 	return 1;
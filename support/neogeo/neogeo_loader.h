@@ -8,3 +8,4 @@
 int neogeo_romset_tx(char* name, int cd_en);
 int neogeo_scan_xml(char *path);
 char *neogeo_get_altname(char *path, char *name, char *altname);
+void neogeo_bench();
@@ -10,6 +10,7 @@
 #include "../../hardware.h"
 #include "../../menu.h"
 #include "../../cheats.h"
+#include "../../scheduler.h"
 #include "../megacd/megacd.h"
 #include "neogeocd.h"
 #include "neogeo_loader.h"
@@ -56,6 +57,7 @@ void neocd_poll()
 	if (req != last_req)
 	{
 		last_req = req;
+		scheduler_busy();
 
 		spi_w(NEOCD_GET_CMD);
 
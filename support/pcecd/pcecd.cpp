@@ -9,6 +9,7 @@
 #include "../../spi.h"
 #include "../../hardware.h"
 #include "../../menu.h"
+#include "../../scheduler.h"
 #include "pcecd.h"
 
 
@@ -52,6 +53,7 @@ void pcecd_poll()
 	if (req != last_req)
 	{
 		last_req = req;
+		scheduler_busy();
 
 		uint16_t data_in[7];
 		data_in[0] = spi_w(0);
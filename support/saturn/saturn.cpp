@@ -9,6 +9,7 @@
 #include "../../hardware.h"
 #include "../../menu.h"
 #include "../../cheats.h"
+#include "../../scheduler.h"
 #include "saturn.h"
 
 static int need_reset = 0;
@@ -54,6 +55,7 @@ void saturn_poll()
 		if (req != last_req)
 		{
 			last_req = req;
+			scheduler_busy();
 
 			for (int i = 0; i < 6; i++) data_in[i] = spi_w(0);
 			DisableIO();
@@ -82,8 +82,6 @@ private:
 	uint8_t cd_buf[4096 + 2];
 	int audioLength;
 	int audioFirst;
-	int chd_hunknum;
-	uint8_t *chd_hunkbuf;
 	int chd_audio_read_lba;
 
 
@@ -28,8 +28,6 @@ satcdd_t::satcdd_t() {
 	speed = 0;
 	audioLength = 0;
 	audioFirst = 0;
-	chd_hunkbuf = NULL;
-	chd_hunknum = -1;
 	SendData = NULL;
 
 	stat[0] = SATURN_STAT_OPEN;
@@ -333,14 +331,6 @@ int satcdd_t::Load(const char *filename)
 			printf("ERROR %s\n", chd_error_string(err));
 			return -1;
 		}
-
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-		}
-
-		this->chd_hunkbuf = (uint8_t *)malloc(this->toc.chd_hunksize);
-		this->chd_hunknum = -1;
 		if (this->toc.tracks[0].sector_size)
 		{
 			this->sectorSize = this->toc.tracks[0].sector_size;
@@ -353,7 +343,7 @@ int satcdd_t::Load(const char *filename)
 
 	/*if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header, this->chd_hunkbuf, &this->chd_hunknum);
+		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header);
 	}
 	else {
 		fd_img = &this->toc.tracks[0].f;
@@ -398,13 +388,7 @@ void satcdd_t::Unload()
 	{
 		if (this->toc.chd_f)
 		{
-			chd_close(this->toc.chd_f);
-		}
-
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-			this->chd_hunkbuf = NULL;
+			mister_chd_close(this->toc.chd_f);
 		}
 
 		for (int i = 0; i < this->toc.last; i++)
@@ -439,7 +423,7 @@ int satcdd_t::GetBootHeader(uint8_t *buf) {
 
 	if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, 0, 0, offset, 256, buf, this->chd_hunkbuf, &this->chd_hunknum);
+		mister_chd_read_sector(this->toc.chd_f, 0, 0, offset, 256, buf);
 	}
 	else 
 	{
@@ -1128,7 +1112,7 @@ void satcdd_t::ReadData(uint8_t *buf)
 				read_offset += 16;
 			}
 
-			mister_chd_read_sector(this->toc.chd_f, lba_ + this->toc.tracks[this->track].offset, read_offset, 0, this->sectorSize, buf, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, lba_ + this->toc.tracks[this->track].offset, read_offset, 0, this->sectorSize, buf);
 		}
 		else {
 			if (this->sectorSize == 2048)
@@ -1160,7 +1144,7 @@ int satcdd_t::ReadCDDA(uint8_t *buf, int first)
 	{
 		for (int i = sec_offs; i < 2; i++, dest += 4096)
 		{
-			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->track].offset + i, 0, 0, 2352, dest, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->track].offset + i, 0, 0, 2352, dest);
 
 			//CHD audio requires byteswap. There's probably a better way to do this...
 			for (int swapidx = 0; swapidx < 2352; swapidx += 2)
@@ -1198,7 +1182,9 @@ int satcdd_t::DataSectorSend(uint8_t* header, int speed)
 {
 	static int buf_num_read = 0, buf_num_write = 0;
 
-	uint8_t *shmem_ptr = (uint8_t*)shmem_map(SHMEM_ADDR, 4096 * 4);
+	uint8_t *shmem_ptr = (uint8_t*)shmem_acquire(SHMEM_ADDR, 4096 * 4);
+	if (!shmem_ptr) return 0;
+
 	uint8_t *data_ptr = shmem_ptr + (buf_num_write * 4096);
 	if (header) {
 		ReadData(data_ptr);
@@ -1208,7 +1194,7 @@ int satcdd_t::DataSectorSend(uint8_t* header, int speed)
 		ReadData(data_ptr);
 	}
 	int boot = (data_ptr[12] == 0x00 && data_ptr[13] == 0x02 && data_ptr[14] == 0x00 && data_ptr[15] == 0x01);
-	shmem_unmap(shmem_ptr, 4096 * 4);
+	shmem_release(shmem_ptr);
 
 
 	buf_num_write++;
@@ -1227,14 +1213,16 @@ int satcdd_t::DataSectorSend(uint8_t* header, int speed)
 
 int satcdd_t::RingDataSend(uint8_t* header, int speed)
 {
-	uint8_t *shmem_ptr = (uint8_t*)shmem_map(SHMEM_ADDR, 4096 * 4);
+	uint8_t *shmem_ptr = (uint8_t*)shmem_acquire(SHMEM_ADDR, 4096 * 4);
+	if (!shmem_ptr) return 0;
+
 	uint8_t *data_ptr = shmem_ptr;
 	if (header) {
 		MakeSecureRingData(data_ptr);
 		memcpy(data_ptr + 12, header, 12);
 		memset(data_ptr + 2348, 0, 4);
 	}
-	shmem_unmap(shmem_ptr, 4096 * 4);
+	shmem_release(shmem_ptr);
 
 	uint16_t mode = (speed == 2 ? 0x0101 : 0x0000) | 0x0404;
 
@@ -1250,11 +1238,13 @@ int satcdd_t::AudioSectorSend(int first)
 
 	if (first) buf_num_read = buf_num_write = 0;
 
-	uint8_t *shmem_ptr = (uint8_t*)shmem_map(SHMEM_ADDR, 4096 * 4);
+	uint8_t *shmem_ptr = (uint8_t*)shmem_acquire(SHMEM_ADDR, 4096 * 4);
+	if (!shmem_ptr) return 0;
+
 	uint8_t *data_ptr = shmem_ptr + (buf_num_write * 4096);
 
 	ReadCDDA(data_ptr, first);
-	shmem_unmap(shmem_ptr, 4096 * 4);
+	shmem_release(shmem_ptr);
 
 	if (first) buf_num_write++;
 	buf_num_write++;
@@ -5,10 +5,16 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <glob.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
 
 #include "../../file_io.h"
 #include "../../user_io.h"
 #include "../../spi.h"
+#include "../../offload.h"
+#include "../../scheduler.h"
 
 static uint8_t hdr[512];
 
@@ -368,6 +374,14 @@ static void msu_send_command(uint64_t cmd)
 	DisableIO();
 }
 
+static void msu_send_chunk(const uint8_t *chunk, int idx)
+{
+	user_io_set_index(idx);
+	user_io_set_download(1);
+	user_io_file_tx_data(chunk, sizeof(buf));
+	user_io_set_download(0);
+}
+
 static int msu_send_data(fileTYPE *f, int idx)
 {
 	int chunk = sizeof(buf);
@@ -375,18 +389,262 @@ static int msu_send_data(fileTYPE *f, int idx)
 	memset(buf, 0, chunk);
 	if (f->size) FileReadAdv(f, buf, chunk);
 
-	user_io_set_index(idx);
-	user_io_set_download(1);
-	user_io_file_tx_data(buf, chunk);
-	user_io_set_download(0);
-
+	msu_send_chunk(buf, idx);
 	return 1;
 }
 
+/*
+ * MSU-1 audio streaming
+ *
+ * Every open track keeps a ring of the chunks following the play position, which the offload
+ * thread reads ahead. The first chunks of the track and of its loop point are kept as well, so
+ * restarts and loop jumps (0x36) are served from memory. Selecting a track pre-opens its
+ * neighbours, and the most recent tracks stay open, so switching tracks doesn't wait for the
+ * media either. Tracks that can't be opened directly (zipped sets) use the plain file path.
+ */
+#define MSU_CHUNK  1024
+#define MSU_RING   64 // read ahead, in chunks
+#define MSU_BATCH  16
+#define MSU_WARM   16 // chunks kept from the track start and from the loop point
+#define MSU_SLOTS  4
+
+struct msu_track_t
+{
+	int open;
+	int num;
+	int fd;
+	uint32_t size;
+	uint32_t used;
+
+	uint32_t loop; // first chunk of the loop point
+	uint8_t head[MSU_WARM * MSU_CHUNK];
+	uint8_t loop_buf[MSU_WARM * MSU_CHUNK];
+
+	uint8_t ring[MSU_RING * MSU_CHUNK];
+	uint32_t first;    // chunk number of the first valid ring entry
+	uint32_t count;    // valid entries
+	uint32_t fill_cnt; // entries being read after the valid ones
+
+	int busy;
+	OffloadEvent done;
+};
+
+static msu_track_t msu_tracks[MSU_SLOTS];
+static msu_track_t *msu_cur = NULL;
+static uint32_t msu_pos = 0; // next chunk to send
+static uint32_t msu_clock = 0;
+static int msu_fallback = 0;
+
+static struct
+{
+	uint32_t chunks;
+	uint32_t hits;
+	uint32_t underruns;
+	uint32_t seeks;
+	uint32_t seek_hits;
+	uint32_t tracks;
+	uint32_t preopened;
+} msu_stats = {};
+
+static void msu_print_stats()
+{
+	if (!msu_stats.chunks) return;
+
+	printf("MSU: %u chunks, %u buffered, %u underruns, %u of %u seeks buffered, %u of %u tracks pre-opened\n",
+		msu_stats.chunks, msu_stats.hits, msu_stats.underruns, msu_stats.seek_hits, msu_stats.seeks, msu_stats.preopened, msu_stats.tracks);
+	memset(&msu_stats, 0, sizeof(msu_stats));
+}
+
+// zero filled past the end
+static void msu_read(int fd, uint8_t *dst, uint32_t chunk, uint32_t cnt)
+{
+	memset(dst, 0, cnt * MSU_CHUNK);
+	if (fd >= 0 && pread(fd, dst, cnt * MSU_CHUNK, (off_t)chunk * MSU_CHUNK) < 0) memset(dst, 0, cnt * MSU_CHUNK);
+}
+
+static void msu_sync(msu_track_t *t, int wait)
+{
+	if (!t->busy) return;
+	if (!wait && !t->done.is_set()) return;
+
+	t->done.wait();
+	t->count += t->fill_cnt;
+	t->fill_cnt = 0;
+	t->busy = 0;
+}
+
+static void msu_close(msu_track_t *t)
+{
+	msu_sync(t, 1);
+	if (t->open && t->fd >= 0) close(t->fd);
+	t->fd = -1;
+	t->open = 0;
+	t->count = 0;
+}
+
+static void msu_close_all()
+{
+	for (auto &t : msu_tracks) msu_close(&t);
+	msu_cur = NULL;
+	msu_fallback = 0;
+	FileClose(&f_audio);
+}
+
+// Opens the track (if not yet open) and warms its start and loop point in the background
+static msu_track_t *msu_open(int num)
+{
+	msu_track_t *t = NULL;
+	for (auto &slot : msu_tracks)
+	{
+		if (slot.open && slot.num == num)
+		{
+			slot.used = ++msu_clock;
+			return &slot;
+		}
+
+		if (&slot != msu_cur && (!t || !slot.open || (t->open && slot.used < t->used))) t = &slot;
+	}
+
+	msu_close(t);
+	t->open = 1;
+	t->num = num;
+	t->fd = -1;
+	t->size = 0;
+	t->loop = 0;
+	t->first = 0;
+	t->count = 0;
+	t->used = ++msu_clock;
+
+	char name[1100];
+	snprintf(name, sizeof(name), "%s-%d.pcm", snes_romFileName, num);
+	std::string path = getFullPath(name);
+
+	t->busy = 1;
+	t->done.reset();
+	offload_add_work([t, path]
+	{
+		t->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+		struct stat64 st;
+		if (t->fd >= 0 && !fstat64(t->fd, &st)) t->size = st.st_size;
+
+		msu_read(t->fd, t->head, 0, MSU_WARM);
+		if (t->size >= 8 && !memcmp(t->head, "MSU1", 4))
+		{
+			// loop point is in samples (4 bytes each) after the 8 byte header
+			uint32_t loop = t->head[4] | (t->head[5] << 8) | (t->head[6] << 16) | (t->head[7] << 24);
+			t->loop = (8 + (uint64_t)loop * 4) / MSU_CHUNK;
+			if (t->loop >= MSU_WARM) msu_read(t->fd, t->loop_buf, t->loop, MSU_WARM);
+		}
+
+		t->done.signal();
+	});
+
+	return t;
+}
+
+// the warm chunks at the track start and loop point don't need to be in the ring
+static uint32_t msu_ring_pos(msu_track_t *t, uint32_t pos)
+{
+	if (pos < MSU_WARM) return MSU_WARM;
+	if (t->loop >= MSU_WARM && pos >= t->loop && pos < t->loop + MSU_WARM) return t->loop + MSU_WARM;
+	return pos;
+}
+
+// Keeps the ring right after the play position and schedules the next batch
+static void msu_fill(msu_track_t *t)
+{
+	uint32_t pos = msu_ring_pos(t, msu_pos);
+
+	msu_sync(t, 0);
+	if (pos < t->first || pos > t->first + t->count + t->fill_cnt)
+	{
+		msu_sync(t, 1);
+		t->first = pos;
+		t->count = 0;
+	}
+	else if (pos > t->first + t->count)
+	{
+		// inside the batch being read, let it land first
+		msu_sync(t, 1);
+	}
+
+	// drop the chunks already sent
+	t->count -= pos - t->first;
+	t->first = pos;
+
+	if (t->busy || t->count > MSU_RING - MSU_BATCH) return;
+
+	uint32_t from = t->first + t->count;
+	if ((uint64_t)from * MSU_CHUNK >= t->size) return;
+
+	int fd = t->fd;
+	t->busy = 1;
+	t->fill_cnt = MSU_BATCH;
+	t->done.reset();
+	offload_add_work([t, fd, from]
+	{
+		for (uint32_t i = 0; i < MSU_BATCH; i++) msu_read(fd, t->ring + ((from + i) % MSU_RING) * MSU_CHUNK, from + i, 1);
+		t->done.signal();
+	});
+}
+
+static const uint8_t *msu_get_chunk(msu_track_t *t, uint32_t chunk)
+{
+	if (chunk < MSU_WARM) return t->head + chunk * MSU_CHUNK;
+	if (t->loop >= MSU_WARM && chunk >= t->loop && chunk < t->loop + MSU_WARM) return t->loop_buf + (chunk - t->loop) * MSU_CHUNK;
+
+	msu_sync(t, 0);
+	if (t->busy && chunk >= t->first + t->count && chunk < t->first + t->count + t->fill_cnt)
+	{
+		// read ahead didn't keep up
+		msu_sync(t, 1);
+		msu_stats.underruns++;
+	}
+
+	if (chunk >= t->first && chunk < t->first + t->count) return t->ring + (chunk % MSU_RING) * MSU_CHUNK;
+	return NULL;
+}
+
+static void msu_send_next(int seek)
+{
+	msu_stats.chunks++;
+
+	if (!msu_cur)
+	{
+		memset(buf, 0, sizeof(buf));
+		msu_send_chunk(buf, 2);
+		return;
+	}
+
+	const uint8_t *chunk = msu_get_chunk(msu_cur, msu_pos);
+	if (chunk)
+	{
+		msu_stats.hits++;
+		if (seek) msu_stats.seek_hits++;
+	}
+	else
+	{
+		if (!seek) msu_stats.underruns++;
+
+		msu_sync(msu_cur, 1);
+		msu_cur->first = msu_pos;
+		msu_cur->count = 1;
+		chunk = msu_cur->ring + (msu_pos % MSU_RING) * MSU_CHUNK;
+		msu_read(msu_cur->fd, (uint8_t*)chunk, msu_pos, 1);
+	}
+
+	msu_send_chunk(chunk, 2);
+
+	msu_pos++;
+	msu_fill(msu_cur);
+}
+
 void snes_msu_init(const char* name)
 {
 	static fileTYPE f = {};
-	FileClose(&f_audio);
+	msu_print_stats();
+	msu_close_all();
 
 	memset(snes_romFileName, 0, 1024);
 	int extSize = strlen(strrchr(name, '.'));
@@ -419,6 +677,7 @@ void snes_poll(void)
 	if (req != last_req)
 	{
 		last_req = req;
+		scheduler_busy();
 
 		uint16_t command = spi_w(0);
 		uint32_t data = spi_w(0);
@@ -432,21 +691,57 @@ void snes_poll(void)
 			break;
 
 		case 0x35:
+		{
 			snprintf(SelectedPath, sizeof(SelectedPath), "%s-%d.pcm", snes_romFileName, data);
 			printf("MSU: New track selected: %s\n", SelectedPath);
-			FileOpen(&f_audio, SelectedPath);
-			printf(f_audio.size ? "MSU: Track mounted\n" : "MSU: Track not found!\n");
-			msu_send_command((f_audio.size << 16) | MSU_AUDIO_TRACK_MOUNTED);
+			msu_print_stats();
+
+			msu_stats.tracks++;
+			for (auto &t : msu_tracks) if (t.open && t.num == (int)data) msu_stats.preopened++;
+
+			msu_cur = msu_open(data);
+			msu_sync(msu_cur, 1);
+			msu_pos = 0;
+
+			uint32_t size = msu_cur->size;
+			FileClose(&f_audio);
+			msu_fallback = (msu_cur->fd < 0);
+			if (msu_fallback)
+			{
+				FileOpen(&f_audio, SelectedPath);
+				size = f_audio.size;
+			}
+
+			printf(size ? "MSU: Track mounted\n" : "MSU: Track not found!\n");
+			msu_send_command(((uint64_t)size << 16) | MSU_AUDIO_TRACK_MOUNTED);
+
+			if (!msu_fallback)
+			{
+				msu_fill(msu_cur);
+				msu_open(data + 1);
+				if (data) msu_open(data - 1);
+			}
 			break;
+		}
 
 		case 0x36:
 			printf("MSU: Jump to offset: 0x%X\n", data * 1024);
-			FileSeek(&f_audio, data * 1024, SEEK_SET);
-			// fallthrough
+			if (msu_fallback)
+			{
+				FileSeek(&f_audio, data * 1024, SEEK_SET);
+				msu_send_data(&f_audio, 2);
+				break;
+			}
+
+			msu_stats.seeks++;
+			msu_pos = data;
+			msu_send_next(1);
+			break;
 
 		case 0x34:
 			// Next sector requested
-			msu_send_data(&f_audio, 2);
+			if (msu_fallback) msu_send_data(&f_audio, 2);
+			else msu_send_next(0);
 			break;
 		}
 	}
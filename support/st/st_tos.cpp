@@ -8,6 +8,7 @@
 #include "../../debug.h"
 #include "../../user_io.h"
 #include "../../fpga_io.h"
+#include "../../scheduler.h"
 #include "st_tos.h"
 
 #define ST_WRITE_MEMORY 0x08
@@ -387,7 +388,11 @@ static void get_dmastate()
 	spi_read(buffer, 16, 0);
 	DisableIO();
 
-	if (buffer[10] & 0x01) handle_acsi(buffer);
+	if (buffer[10] & 0x01)
+	{
+		scheduler_busy();
+		handle_acsi(buffer);
+	}
 }
 
 static void fill_tx(uint16_t fill, uint32_t len, int index)
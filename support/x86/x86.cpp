@@ -38,6 +38,7 @@
 #include "../../fpga_io.h"
 #include "../../shmem.h"
 #include "../../ide.h"
+#include "../../scheduler.h"
 #include "x86_share.h"
 
 #define FDD0_BASE   0xF200
@@ -301,11 +302,11 @@ static void x86_dma_recvbuf(uint32_t address, uint32_t length, uint32_t *data)
 
 static int mem_set(uint32_t offset, uint8_t fill_byte, uint32_t size)
 {
-	void *buf = shmem_map(SHMEM_ADDR + offset, size);
+	void *buf = shmem_acquire(SHMEM_ADDR + offset, size);
 	if (!buf) return 0;
 
 	memset(buf, fill_byte, size);
-	shmem_unmap(buf, size);
+	shmem_release(buf);
 
 	return 1;
 }
@@ -314,12 +315,12 @@ static int load_bios(const char* name, uint8_t index)
 {
 	printf("BIOS: %s\n", name);
 
-	void *buf = shmem_map(SHMEM_ADDR + (index ? 0xC0000 : 0xF0000), BIOS_SIZE);
+	void *buf = shmem_acquire(SHMEM_ADDR + (index ? 0xC0000 : 0xF0000), BIOS_SIZE);
 	if (!buf) return 0;
 
 	memset(buf, 0, BIOS_SIZE);
 	FileLoad(name, buf, BIOS_SIZE);
-	shmem_unmap(buf, BIOS_SIZE);
+	shmem_release(buf);
 
 	return 1;
 }
@@ -750,6 +751,7 @@ void x86_poll(int only_ide)
 	uint16_t sd_req = ide_check();
 	if (sd_req)
 	{
+		scheduler_busy();
 		if (sd_req & 0x400) ide_cdda_send_sector();
 
 		ide_io(0, sd_req & 7);
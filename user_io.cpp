@@ -9,12 +9,15 @@
 #include <ctype.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <map>
+#include <vector>
 
 #include "lib/imlib2/Imlib2.h"
 
 #include "hardware.h"
 #include "osd.h"
 #include "user_io.h"
+#include "scheduler.h"
 #include "debug.h"
 #include "spi.h"
 #include "cfg.h"
@@ -36,6 +39,7 @@
 #include "ide.h"
 #include "ide_cdrom.h"
 #include "profiling.h"
+#include "offload.h"
 
 #include "support.h"
 
@@ -52,6 +56,373 @@ static uint64_t buffer_lba[16] = { ULLONG_MAX,ULLONG_MAX,ULLONG_MAX,ULLONG_MAX,
 
 static int use_save = 0;
 
+// SD read-ahead. Windows following the current sector buffer are read on the offload thread,
+// so sequential reads are served from RAM instead of waiting for the storage.
+#define SD_BUF_SIZE    16384
+#define SD_RA_WINDOWS  3
+
+struct sd_ra_window_t
+{
+	uint8_t      data[SD_BUF_SIZE];
+	uint64_t     lba;
+	uint32_t     blksz;
+	int          len;
+	uint32_t     wb_gen;
+	bool         pending;
+	bool         used;
+	OffloadEvent done;
+};
+
+static sd_ra_window_t sd_ra[16][SD_RA_WINDOWS];
+static sd_cache_stats_t sd_stats[16] = {};
+static int sd_ra_init = 0;
+
+// a window still being read stays pending, so it isn't reused until its job is done
+static void sd_ra_drop(int disk, sd_ra_window_t *w)
+{
+	if (w->pending && w->done.is_set()) w->pending = false;
+	if (w->lba != ULLONG_MAX && !w->used) sd_stats[disk].dropped++;
+	w->lba = ULLONG_MAX;
+}
+
+static void sd_ra_invalidate(int disk)
+{
+	if (!sd_ra_init)
+	{
+		for (int i = 0; i < 16; i++) for (int n = 0; n < SD_RA_WINDOWS; n++) sd_ra[i][n].lba = ULLONG_MAX;
+		sd_ra_init = 1;
+	}
+
+	for (int n = 0; n < SD_RA_WINDOWS; n++) sd_ra_drop(disk, &sd_ra[disk][n]);
+}
+
+// only plain image files can be read concurrently with pread()
+static int sd_ra_enabled(int disk)
+{
+	return sd_image[disk].filp && sd_image[disk].type != 2 && !sd_type[disk];
+}
+
+// fill dst with the read-ahead window containing the request. A window still being read is not
+// waited for: the offload thread may be busy with a write-back flush or MSU/CDDA refills queued
+// ahead of it, the request is read synchronously instead.
+static int sd_wb_enabled(int disk);
+static uint32_t sd_wb_generation();
+static int sd_wb_overlay(int disk, uint64_t offset, uint8_t *buf, uint32_t len, uint32_t gen);
+
+static int sd_ra_take(int disk, uint64_t lba, uint32_t blksz, uint32_t blks, uint32_t buf_n, uint8_t *dst, uint64_t *dst_lba)
+{
+	if (!sd_ra_init) return 0;
+
+	for (int n = 0; n < SD_RA_WINDOWS; n++)
+	{
+		sd_ra_window_t *w = &sd_ra[disk][n];
+		if (w->lba == ULLONG_MAX || w->blksz != blksz || lba < w->lba || (lba + blks - w->lba) > buf_n) continue;
+
+		if (w->pending)
+		{
+			if (!w->done.is_set()) return 0;
+			w->pending = false;
+		}
+
+		if (w->len <= 0 || (lba + blks - w->lba) * blksz > (uint32_t)w->len)
+		{
+			sd_ra_drop(disk, w);
+			return 0;
+		}
+
+		memcpy(dst, w->data, w->len);
+		if (w->len < SD_BUF_SIZE) memset(dst + w->len, 0, SD_BUF_SIZE - w->len);
+		if (sd_wb_enabled(disk) && !sd_wb_overlay(disk, w->lba * blksz, dst, SD_BUF_SIZE, w->wb_gen))
+		{
+			// write-back finished after the window was read
+			sd_ra_drop(disk, w);
+			return 0;
+		}
+		*dst_lba = w->lba;
+		w->used = true;
+		w->lba = ULLONG_MAX;
+		sd_stats[disk].hits++;
+		return 1;
+	}
+
+	return 0;
+}
+
+// keep the windows right after the current buffer in flight, recycle the others
+static void sd_ra_schedule(int disk, uint64_t buf_lba, uint32_t blksz, uint32_t buf_n)
+{
+	if (!sd_ra_enabled(disk)) return;
+	if (!sd_ra_init) sd_ra_invalidate(disk);
+
+	uint64_t first = buf_lba + buf_n;
+	uint64_t last = buf_lba + (uint64_t)buf_n * SD_RA_WINDOWS;
+
+	for (int n = 0; n < SD_RA_WINDOWS; n++)
+	{
+		sd_ra_window_t *w = &sd_ra[disk][n];
+		if (w->pending && w->done.is_set()) w->pending = false;
+		if (w->lba == ULLONG_MAX || w->pending) continue;
+		if (w->blksz != blksz || w->lba < first || w->lba > last || ((w->lba - first) % buf_n)) sd_ra_drop(disk, w);
+	}
+
+	int fd = fileno(sd_image[disk].filp);
+	for (uint64_t lba = first; lba <= last; lba += buf_n)
+	{
+		if (lba * blksz >= (uint64_t)sd_image[disk].size) break;
+
+		sd_ra_window_t *w = 0;
+		int present = 0;
+		for (int n = 0; n < SD_RA_WINDOWS; n++)
+		{
+			if (sd_ra[disk][n].lba == lba && sd_ra[disk][n].blksz == blksz) present = 1;
+			else if (!w && sd_ra[disk][n].lba == ULLONG_MAX && !sd_ra[disk][n].pending) w = &sd_ra[disk][n];
+		}
+
+		if (present) continue;
+		if (!w) return;
+
+		w->lba = lba;
+		w->blksz = blksz;
+		w->len = 0;
+		w->used = false;
+		w->pending = true;
+		w->done.reset();
+
+		off64_t offset = lba * blksz;
+		if (!offload_try_add_work([=]
+		{
+			w->wb_gen = sd_wb_generation();
+			w->len = pread64(fd, w->data, SD_BUF_SIZE, offset);
+			w->done.signal();
+		}))
+		{
+			w->pending = false;
+			w->lba = ULLONG_MAX;
+			return;
+		}
+
+		sd_stats[disk].prefetched++;
+	}
+}
+
+void user_io_sd_cache_stats(unsigned char index, sd_cache_stats_t *stats)
+{
+	*stats = sd_stats[index & 0xF];
+}
+
+// SD write-back (sd_writeback=1). Written sectors are kept as runs of contiguous dirty data keyed
+// by byte offset and written out by the offload thread periodically and on unmount/core change.
+// Runs being written are moved to the inflight map, so reads overlay inflight then dirty data.
+// The generation changes when inflight runs are dropped, a read started before that must be repeated.
+#define SD_WB_FLUSH_MS   1000
+#define SD_WB_MAX_DIRTY  (4 * 1024 * 1024)
+
+typedef std::map<uint64_t, std::vector<uint8_t>> sd_runs_t;
+
+static sd_runs_t sd_wb_dirty[16];
+static sd_runs_t sd_wb_inflight[16];
+static uint32_t sd_wb_dirty_size = 0;
+static unsigned long sd_wb_timer = 0;
+static uint32_t sd_wb_gen = 0;
+static bool sd_wb_busy = false;
+static OffloadEvent sd_wb_done;
+static pthread_mutex_t sd_wb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int sd_wb_enabled(int disk)
+{
+	return cfg.sd_writeback && sd_image[disk].filp && sd_image[disk].type != 2 && !sd_type[disk];
+}
+
+static void sd_runs_insert(sd_runs_t &runs, uint64_t offset, const uint8_t *data, uint32_t len)
+{
+	uint64_t end = offset + len;
+
+	auto it = runs.upper_bound(offset);
+	if (it != runs.begin())
+	{
+		auto prev = std::prev(it);
+		uint64_t prev_end = prev->first + prev->second.size();
+		if (prev_end >= end)
+		{
+			// rewrite inside an existing run
+			memcpy(prev->second.data() + (offset - prev->first), data, len);
+			return;
+		}
+
+		if (prev_end == offset && (it == runs.end() || it->first > end))
+		{
+			// sequential append
+			prev->second.insert(prev->second.end(), data, data + len);
+			return;
+		}
+
+		if (prev_end >= offset) it = prev;
+	}
+
+	uint64_t start = offset;
+	auto first = it;
+	while (it != runs.end() && it->first <= end)
+	{
+		if (it->first < start) start = it->first;
+		uint64_t run_end = it->first + it->second.size();
+		if (run_end > end) end = run_end;
+		it++;
+	}
+
+	std::vector<uint8_t> run(end - start);
+	for (auto r = first; r != it; r++) memcpy(run.data() + (r->first - start), r->second.data(), r->second.size());
+	memcpy(run.data() + (offset - start), data, len);
+	runs.erase(first, it);
+	runs.emplace(start, std::move(run));
+}
+
+static void sd_runs_overlay(const sd_runs_t &runs, uint64_t offset, uint8_t *buf, uint32_t len)
+{
+	uint64_t end = offset + len;
+
+	auto it = runs.upper_bound(offset);
+	if (it != runs.begin()) it--;
+
+	for (; it != runs.end() && it->first < end; it++)
+	{
+		uint64_t run_end = it->first + it->second.size();
+		if (run_end <= offset) continue;
+
+		uint64_t s = (it->first > offset) ? it->first : offset;
+		uint64_t e = (run_end < end) ? run_end : end;
+		memcpy(buf + (s - offset), it->second.data() + (s - it->first), e - s);
+	}
+}
+
+static uint32_t sd_wb_generation()
+{
+	pthread_mutex_lock(&sd_wb_lock);
+	uint32_t gen = sd_wb_gen;
+	pthread_mutex_unlock(&sd_wb_lock);
+	return gen;
+}
+
+// gen: sd_wb_generation() taken before the data was read, returns 0 if it's outdated
+static int sd_wb_overlay(int disk, uint64_t offset, uint8_t *buf, uint32_t len, uint32_t gen)
+{
+	pthread_mutex_lock(&sd_wb_lock);
+	int ok = (gen == sd_wb_gen);
+	if (ok)
+	{
+		if (!sd_wb_inflight[disk].empty()) sd_runs_overlay(sd_wb_inflight[disk], offset, buf, len);
+		if (!sd_wb_dirty[disk].empty()) sd_runs_overlay(sd_wb_dirty[disk], offset, buf, len);
+	}
+	pthread_mutex_unlock(&sd_wb_lock);
+	return ok;
+}
+
+static void sd_wb_wait()
+{
+	if (sd_wb_busy) sd_wb_done.wait();
+	sd_wb_busy = false;
+}
+
+// Move all dirty runs to inflight and write them on the offload thread.
+static void sd_wb_kick()
+{
+	if (sd_wb_busy && !sd_wb_done.is_set()) return;
+	sd_wb_busy = false;
+
+	int fds[16];
+	int any = 0;
+
+	pthread_mutex_lock(&sd_wb_lock);
+	for (int i = 0; i < 16; i++)
+	{
+		fds[i] = -1;
+		if (sd_wb_dirty[i].empty()) continue;
+
+		fds[i] = fileno(sd_image[i].filp);
+		sd_wb_inflight[i].swap(sd_wb_dirty[i]);
+		any = 1;
+	}
+	sd_wb_dirty_size = 0;
+	pthread_mutex_unlock(&sd_wb_lock);
+
+	sd_wb_timer = 0;
+	if (!any) return;
+
+	sd_wb_busy = true;
+	sd_wb_done.reset();
+	offload_add_work([=]
+	{
+		for (int i = 0; i < 16; i++)
+		{
+			if (fds[i] < 0) continue;
+
+			for (auto &run : sd_wb_inflight[i])
+			{
+				if (pwrite64(fds[i], run.second.data(), run.second.size(), run.first) != (ssize_t)run.second.size())
+				{
+					printf("SD write-back error on %d at %llu\n", i, (unsigned long long)run.first);
+				}
+			}
+			fdatasync(fds[i]);
+
+			pthread_mutex_lock(&sd_wb_lock);
+			sd_wb_inflight[i].clear();
+			sd_wb_gen++;
+			pthread_mutex_unlock(&sd_wb_lock);
+		}
+		sd_wb_done.signal();
+	});
+}
+
+static void sd_wb_write(int disk, uint64_t offset, const uint8_t *data, uint32_t len)
+{
+	pthread_mutex_lock(&sd_wb_lock);
+	sd_runs_insert(sd_wb_dirty[disk], offset, data, len);
+	sd_wb_dirty_size += len;
+	pthread_mutex_unlock(&sd_wb_lock);
+
+	if (offset + len > (uint64_t)sd_image[disk].size) sd_image[disk].size = offset + len;
+	if (!sd_wb_timer) sd_wb_timer = GetTimer(SD_WB_FLUSH_MS);
+	if (sd_wb_dirty_size >= SD_WB_MAX_DIRTY) sd_wb_kick();
+}
+
+static void sd_wb_poll()
+{
+	if (sd_wb_timer && CheckTimer(sd_wb_timer)) sd_wb_kick();
+}
+
+// Durability barrier: everything written to SD images so far is passed to the storage.
+// With wait=0 the flush is only started.
+void user_io_sd_flush(int wait)
+{
+	if (wait) sd_wb_wait();
+	sd_wb_kick();
+	if (wait) sd_wb_wait();
+}
+
+// read from the image, including the data still held by write-back
+static int sd_read(int disk, uint64_t offset, uint8_t *buf, uint32_t len)
+{
+	int ret;
+	if (sd_image[disk].filp)
+	{
+		uint32_t gen;
+		do
+		{
+			gen = sd_wb_generation();
+			ret = pread64(fileno(sd_image[disk].filp), buf, len, offset);
+			if (ret < 0) ret = 0;
+			if ((uint32_t)ret < len) memset(buf + ret, 0, len - ret);
+			if (offset < (uint64_t)sd_image[disk].size && !ret && sd_wb_enabled(disk)) ret = len;
+		} while (ret > 0 && sd_wb_enabled(disk) && !sd_wb_overlay(disk, offset, buf, len, gen));
+	}
+	else
+	{
+		ret = FileSeek(&sd_image[disk], offset, SEEK_SET) ? FileReadAdv(&sd_image[disk], buf, len) : 0;
+	}
+
+	return ret;
+}
+
 // mouse and keyboard emulation state
 static int emu_mode = EMU_NONE;
 
@@ -62,6 +433,86 @@ static unsigned char dual_sdr = 0;
 static int fio_size = 0;
 static int io_ver = 0;
 
+// FIO file data is sent with the ACK handshake of every word, or streamed like the SD sectors
+// when fio_fast=1 is set in the section of a core known to keep up. Streaming drops words if the
+// core holds off the transfer (ioctl_wait), so every FIO_CHECK_SIZE bytes of streamed data end with
+// a handshake word. A hold-off seen there switches to handshake until the next core is loaded and
+// counts a failure, user_io_file_tx() then sends the file again. Uploads are small (NVRAM, CMOS)
+// and always use handshake.
+#define FIO_CHECK_SIZE 4096
+
+enum
+{
+	FIO_MODE_SAFE = 0,
+	FIO_MODE_FAST
+};
+
+static int fio_mode = FIO_MODE_SAFE;
+static uint32_t fio_failed = 0;
+
+static void fio_reset()
+{
+	fio_mode = cfg.fio_fast ? FIO_MODE_FAST : FIO_MODE_SAFE;
+}
+
+// streamed blocks end with handshake, so a core holding off the transfer is seen as a stall
+static uint32_t fio_stream_len(uint32_t len, int wide)
+{
+	if (len <= 2) return 0;
+	return wide ? ((len - 2) & ~1) : len - 1;
+}
+
+static void fio_write(const uint8_t *addr, uint32_t len, int mode, int wide)
+{
+	uint32_t blk = (mode == FIO_MODE_FAST) ? fio_stream_len(len, wide) : 0;
+	if (blk) spi_block_write(addr, wide, blk);
+	spi_write(addr + blk, len - blk, wide);
+}
+
+static void fio_read(uint8_t *addr, uint32_t len, int mode, int wide)
+{
+	uint32_t blk = (mode == FIO_MODE_FAST) ? fio_stream_len(len, wide) : 0;
+	if (blk) spi_block_read(addr, wide, blk);
+	spi_read(addr + blk, len - blk, wide);
+}
+
+// Measure the FIO throughput of each mode and width. Runs on the menu core only, as the data
+// is sent without an active download, which the menu core ignores.
+static void fio_bench()
+{
+	const uint32_t size = 256 * 1024;
+	uint8_t *buf = (uint8_t*)malloc(size);
+	if (!buf) return;
+	for (uint32_t i = 0; i < size; i++) buf[i] = (uint8_t)i;
+
+	printf("FIO bench (%u bytes, core fio_size=%d):\n", size, fio_size);
+	for (int wide = 0; wide < 2; wide++)
+	{
+		for (int mode = FIO_MODE_SAFE; mode <= FIO_MODE_FAST; mode++)
+		{
+			uint32_t stalls = fpga_spi_stalls();
+			unsigned long long t = GetTimerUs();
+			EnableFpga();
+			spi8(FIO_FILE_TX_DAT);
+			fio_write(buf, size, mode, wide);
+			DisableFpga();
+			unsigned long long tw = GetTimerUs() - t;
+
+			t = GetTimerUs();
+			EnableFpga();
+			spi8(FIO_FILE_TX_DAT);
+			fio_read(buf, size, mode, wide);
+			DisableFpga();
+			unsigned long long tr = GetTimerUs() - t;
+
+			printf("  %2d-bit %-9s: write %6.2f MB/s, read %6.2f MB/s, %u stalls\n", wide ? 16 : 8, (mode == FIO_MODE_FAST) ? "stream" : "handshake",
+				tw ? size / (double)tw : 0.0, tr ? size / (double)tr : 0.0, fpga_spi_stalls() - stalls);
+		}
+	}
+
+	free(buf);
+}
+
 // keep state of caps lock
 static char caps_lock_toggle = 0;
 
@@ -1379,6 +1830,9 @@ void user_io_init(const char *path, const char *xml)
 
 	cfg_parse();
 	cfg_print();
+	fio_reset();
+	if (cfg.fio_bench && is_menu()) fio_bench();
+
 	while (cfg.waitmount[0] && !is_menu())
 	{
 		printf("> > > wait for %s mount < < <\n", cfg.waitmount);
@@ -1819,6 +2273,107 @@ static void kbd_fifo_poll()
 	kbd_fifo_r = (kbd_fifo_r + 1)&(KBD_FIFO_SIZE - 1);
 }
 
+// Compressed savestate file: header followed by zlib stream of raw_size bytes.
+#define SS_COMPRESSED_MAGIC 0x315A5353 // "SSZ1"
+
+struct ss_header_t
+{
+	uint32_t magic;
+	uint32_t raw_size;
+};
+
+static int ss_load(const char *name, void *base, uint32_t len)
+{
+	fileTYPE f = {};
+	if (!FileOpen(&f, name))
+	{
+		printf("Unable to open file: %s\n", name);
+		return 0;
+	}
+
+	ss_header_t hdr = {};
+	int ret = 0;
+	if (f.size > (int)sizeof(hdr) && FileReadAdv(&f, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == SS_COMPRESSED_MAGIC)
+	{
+		uint32_t comp_size = f.size - sizeof(hdr);
+		uint8_t *comp = (uint8_t *)malloc(comp_size);
+		if (comp && FileReadAdv(&f, comp, comp_size) == (int)comp_size)
+		{
+			mz_ulong out_len = len;
+			int res = mz_uncompress((uint8_t *)base, &out_len, comp, comp_size);
+			if (res == MZ_OK) ret = out_len;
+			else printf("process_ss: failed to decompress %s (%d)\n", name, res);
+		}
+		free(comp);
+	}
+	else
+	{
+		FileSeek(&f, 0, SEEK_SET);
+		ret = FileReadAdv(&f, base, len);
+	}
+
+	FileClose(&f);
+	printf("process_ss: read %d bytes from file: %s\n", ret, name);
+	return ret;
+}
+
+// Writes a snapshot of the slot on the offload thread. The file is replaced atomically
+// so a crash or power loss during the write leaves the previous savestate intact.
+static void ss_save_async(const char *name, const void *data, uint32_t size, int compress)
+{
+	uint8_t *snap = (uint8_t *)malloc(size);
+	if (!snap)
+	{
+		printf("Unable to allocate %u bytes for savestate %s\n", size, name);
+		return;
+	}
+	memcpy(snap, data, size);
+
+	char path[1024];
+	snprintf(path, sizeof(path), "%s", getFullPath(name));
+	offload_add_work([=]
+	{
+		uint8_t *buf = snap;
+		uint32_t len = size;
+
+		if (compress)
+		{
+			mz_ulong comp_len = mz_compressBound(size);
+			uint8_t *comp = (uint8_t *)malloc(sizeof(ss_header_t) + comp_len);
+			if (comp && mz_compress2(comp + sizeof(ss_header_t), &comp_len, snap, size, MZ_BEST_SPEED) == MZ_OK)
+			{
+				ss_header_t *hdr = (ss_header_t *)comp;
+				hdr->magic = SS_COMPRESSED_MAGIC;
+				hdr->raw_size = size;
+				buf = comp;
+				len = sizeof(ss_header_t) + comp_len;
+			}
+			else
+			{
+				free(comp);
+			}
+		}
+
+		char tmp[1024 + 8];
+		snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+		int ok = 0;
+		int fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+		if (fd >= 0)
+		{
+			ok = (write(fd, buf, len) == (ssize_t)len) && !fsync(fd);
+			close(fd);
+			if (ok) ok = !rename(tmp, path);
+			if (!ok) unlink(tmp);
+		}
+
+		if (ok) printf("Wrote %u bytes (%u raw) to file: %s\n", len, size, path);
+		else printf("Unable to write file: %s\n", path);
+
+		if (buf != snap) free(buf);
+		free(snap);
+	});
+}
+
 int process_ss(const char *rom_name, int enable)
 {
 	static char ss_name[1024] = {};
@@ -1836,11 +2391,10 @@ int process_ss(const char *rom_name, int enable)
 
 		uint32_t len = ss_size;
 		uint32_t map_addr = ss_base;
-		fileTYPE f = {};
 
 		for (int i = 0; i < 4; i++)
 		{
-			if (!base[i]) base[i] = shmem_map(map_addr, len);
+			if (!base[i]) base[i] = shmem_acquire(map_addr, len);
 			if (!base[i])
 			{
 				printf("Unable to mmap (0x%X, %d)!\n", map_addr, len);
@@ -1861,19 +2415,7 @@ int process_ss(const char *rom_name, int enable)
 					FileGenerateSavestatePath(rom_name, ss_name, i + 1);
 				}
 
-				if (FileExists(ss_name))
-				{
-					if (!FileOpen(&f, ss_name))
-					{
-						printf("Unable to open file: %s\n", ss_name);
-					}
-					else
-					{
-						int ret = FileReadAdv(&f, base[i], len);
-						FileClose(&f);
-						printf("process_ss: read %d bytes from file: %s\n", ret, ss_name);
-					}
-				}
+				if (FileExists(ss_name)) ss_load(ss_name, base[i], len);
 				*(uint32_t*)(base[i]) = 0xFFFFFFFF;
 			}
 
@@ -1891,7 +2433,6 @@ int process_ss(const char *rom_name, int enable)
 	if (ss_timer && !CheckTimer(ss_timer)) return 0;
 	ss_timer = GetTimer(1000);
 
-	fileTYPE f = {};
 	for (int i = 0; i < 4; i++)
 	{
 		if (base[i])
@@ -1909,16 +2450,7 @@ int process_ss(const char *rom_name, int enable)
 					Info("Saving the state", 500);
 
 					*ss_sufx = i + '1';
-					if (FileOpenEx(&f, ss_name, O_CREAT | O_TRUNC | O_RDWR | O_SYNC))
-					{
-						int ret = FileWriteAdv(&f, base[i], size);
-						FileClose(&f);
-						printf("Wrote %d bytes to file: %s\n", ret, ss_name);
-					}
-					else
-					{
-						printf("Unable to create file: %s\n", ss_name);
-					}
+					ss_save_async(ss_name, base[i], size, cfg.savestate_compress);
 				}
 			}
 		}
@@ -1960,7 +2492,31 @@ void user_io_file_tx_data(const uint8_t *addr, uint32_t len)
 {
 	EnableFpga();
 	spi8(FIO_FILE_TX_DAT);
-	spi_write(addr, len, fio_size);
+	if (fio_mode == FIO_MODE_SAFE)
+	{
+		spi_write(addr, len, fio_size);
+	}
+	else
+	{
+		while (len)
+		{
+			uint32_t chunk = (len > FIO_CHECK_SIZE) ? FIO_CHECK_SIZE : len;
+			uint32_t stalls = fpga_spi_stalls();
+			fio_write(addr, chunk, fio_mode, fio_size);
+			addr += chunk;
+			len -= chunk;
+
+			if (fpga_spi_stalls() != stalls)
+			{
+				// the rest still has to reach the core to keep its address in step
+				fio_mode = FIO_MODE_SAFE;
+				fio_failed++;
+				printf("FIO: core held off streamed data, switching to handshake.\n");
+				spi_write(addr, len, fio_size);
+				break;
+			}
+		}
+	}
 	DisableFpga();
 }
 
@@ -2005,6 +2561,15 @@ int user_io_file_mount(const char *name, unsigned char index, char pre, int pre_
 	int len = strlen(name);
 	int img_type = 0; // disk image type (for C128 core): bit 0=dual sided, 1=raw GCR supported, 2=raw MFM supported, 3=high density
 
+	sd_ra_invalidate(index);
+	user_io_sd_flush(1);
+	if (sd_image[index].size && (sd_stats[index].hits || sd_stats[index].misses))
+	{
+		printf("SD cache %d: hits %u, misses %u, prefetched %u, dropped %u\n", index,
+			sd_stats[index].hits, sd_stats[index].misses, sd_stats[index].prefetched, sd_stats[index].dropped);
+	}
+	memset(&sd_stats[index], 0, sizeof(sd_stats[index]));
+
 	sd_image_cangrow[index] = (pre != 0);
 	sd_type[index] = 0;
 
@@ -2042,7 +2607,7 @@ int user_io_file_mount(const char *name, unsigned char index, char pre, int pre_
 			else
 			{
 				writable = FileCanWrite(name);
-				ret = FileOpenEx(&sd_image[index], name, writable ? (O_RDWR | O_SYNC) : O_RDONLY);
+				ret = FileOpenEx(&sd_image[index], name, writable ? (cfg.sd_writeback ? O_RDWR : (O_RDWR | O_SYNC)) : O_RDONLY);
 				if (ret && len > 4) {
 					if (!strcasecmp(name + len - 4, ".d64")
 						|| !strcasecmp(name + len - 4, ".g64")
@@ -2135,6 +2700,7 @@ int user_io_file_mount(const char *name, unsigned char index, char pre, int pre_
 void user_io_bufferinvalidate(unsigned char index)
 {
 	buffer_lba[index] = -1;
+	sd_ra_invalidate(index);
 }
 
 static unsigned char col_attr[1025];
@@ -2508,10 +3074,99 @@ int user_io_file_tx_a(const char* name, uint16_t index)
 	return 1;
 }
 
+// Streaming upload pipeline: offload thread reads chunks ahead into the ring and hashes
+// them in a separate job, while the main thread pushes already filled chunks to the FPGA.
+#define FILE_TX_BUF_NUM  4
+#define FILE_TX_BUF_SIZE (128 * 1024)
+
+struct file_tx_buf_t
+{
+	uint8_t data[FILE_TX_BUF_SIZE];
+	uint32_t size;
+	OffloadEvent read_done;
+	OffloadEvent hash_done;
+};
+
+static file_tx_buf_t file_tx_ring[FILE_TX_BUF_NUM];
+
+struct file_tx_stat_t
+{
+	uint64_t read_us;
+	uint64_t xfer_us;
+	uint64_t hash_us;
+};
+
+static void file_tx_queue(fileTYPE *f, file_tx_buf_t *b, uint32_t chunk, uint32_t skip, uint32_t *crc, file_tx_stat_t *stat)
+{
+	b->size = chunk;
+	b->read_done.reset();
+	b->hash_done.reset();
+
+	offload_add_work([=]
+	{
+		uint64_t t = GetTimerUs();
+		FileReadAdv(f, b->data, chunk);
+		stat->read_us += GetTimerUs() - t;
+		b->read_done.signal();
+	});
+
+	// jobs are executed in order, so CRC is chained in file order
+	offload_add_work([=]
+	{
+		uint64_t t = GetTimerUs();
+		if (skip < chunk) *crc = crc32(*crc, b->data + skip, chunk - skip);
+		stat->hash_us += GetTimerUs() - t;
+		b->hash_done.signal();
+	});
+}
+
+static uint32_t file_tx_stream(fileTYPE *f, uint32_t bytes2send, uint32_t skip, int use_progress, file_tx_stat_t *stat)
+{
+	uint32_t crc = 0;
+	uint32_t size = bytes2send;
+	uint32_t queued = 0;
+	uint32_t head = 0, tail = 0;
+
+	while (queued < size && (head - tail) < FILE_TX_BUF_NUM)
+	{
+		uint32_t chunk = ((size - queued) > FILE_TX_BUF_SIZE) ? FILE_TX_BUF_SIZE : (size - queued);
+		file_tx_queue(f, &file_tx_ring[head++ % FILE_TX_BUF_NUM], chunk, (skip > queued) ? skip - queued : 0, &crc, stat);
+		queued += chunk;
+	}
+
+	while (bytes2send)
+	{
+		file_tx_buf_t *b = &file_tx_ring[tail % FILE_TX_BUF_NUM];
+		b->read_done.wait();
+
+		uint64_t t = GetTimerUs();
+		user_io_file_tx_data(b->data, b->size);
+		stat->xfer_us += GetTimerUs() - t;
+
+		bytes2send -= b->size;
+		if (use_progress) ProgressMessage("Loading", f->name, size - bytes2send, size);
+
+		// refill the slot just sent. Its hash job is ahead in the queue, but it has to finish
+		// before the slot's event is reset, or the final wait could return too early.
+		tail++;
+		if (queued < size)
+		{
+			b->hash_done.wait();
+			uint32_t chunk = ((size - queued) > FILE_TX_BUF_SIZE) ? FILE_TX_BUF_SIZE : (size - queued);
+			file_tx_queue(f, &file_tx_ring[head++ % FILE_TX_BUF_NUM], chunk, (skip > queued) ? skip - queued : 0, &crc, stat);
+			queued += chunk;
+		}
+	}
+
+	if (head) file_tx_ring[(head - 1) % FILE_TX_BUF_NUM].hash_done.wait();
+	return crc;
+}
+
 int user_io_file_tx(const char* name, unsigned char index, char opensave, char mute, char composite, uint32_t load_addr)
 {
 	fileTYPE f = {};
 	static uint8_t buf[4096];
+	uint32_t fio_failed_start = fio_failed;
 
 	if (!FileOpen(&f, name, mute)) return 0;
 
@@ -2638,6 +3293,9 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 
 	if(ss_base && opensave) process_ss(name);
 
+	file_tx_stat_t stat = {};
+	uint64_t start_us = GetTimerUs();
+
 	if (is_gba())
 	{
 		if ((index >> 6) == 1 || (index >> 6) == 2)
@@ -2676,7 +3334,7 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 	if (dosend && load_addr >= 0x20000000 && (load_addr + bytes2send) <= 0x40000000)
 	{
 		uint32_t map_size = bytes2send + ((is_snes() && load_addr < 0x22000000) ? 0x800000 : 0);
-		uint8_t *mem = (uint8_t *)shmem_map(fpga_mem(load_addr), map_size);
+		uint8_t *mem = (uint8_t *)shmem_acquire(fpga_mem(load_addr), map_size);
 		if (mem)
 		{
 			while (bytes2send)
@@ -2684,20 +3342,29 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 				uint32_t gap = (is_snes() && (load_addr < 0x22000000) && (load_addr + size - bytes2send) >= 0x22000000) ? 0x800000 : 0;
 
 				uint32_t chunk = (bytes2send > (256 * 1024)) ? (256 * 1024) : bytes2send;
+				uint64_t t = GetTimerUs();
 				FileReadAdv(&f, mem + size - bytes2send + gap, chunk);
+				stat.read_us += GetTimerUs() - t;
 
+				t = GetTimerUs();
 				if(!is_snes() && use_cheats) file_crc = crc32(file_crc, mem + skip + size - bytes2send, chunk - skip);
+				stat.hash_us += GetTimerUs() - t;
 				skip = 0;
 
 				if (use_progress) ProgressMessage("Loading", f.name, size - bytes2send, size);
 				bytes2send -= chunk;
 			}
 
-			shmem_unmap(mem, map_size);
+			shmem_release(mem);
 		}
 	}
+	else if (dosend && bytes2send && snes_file != SNES_FILE_BS)
+	{
+		file_crc = file_tx_stream(&f, bytes2send, skip, use_progress, &stat);
+	}
 	else
 	{
+		// BS header patch relies on 4K chunks and file offset, so keep it sequential
 		while (dosend && bytes2send)
 		{
 			uint32_t chunk = (bytes2send > sizeof(buf)) ? sizeof(buf) : bytes2send;
@@ -2723,9 +3390,19 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 
 	printf("Done.\n");
 	printf("CRC32: %08X\n", file_crc);
+	printf("Load time: %llums (read %llums, transfer %llums, hash %llums)\n", (GetTimerUs() - start_us) / 1000,
+		stat.read_us / 1000, stat.xfer_us / 1000, stat.hash_us / 1000);
 
 	FileClose(&f);
 
+	if (fio_failed != fio_failed_start)
+	{
+		// words were lost while streaming, FIO is in handshake mode now
+		printf("FIO: sending the file again with handshake.\n");
+		user_io_set_download(0);
+		return user_io_file_tx(name, index, opensave, mute, composite, load_addr);
+	}
+
 	if (opensave)
 	{
 		FileGenerateSavePath(name, (char*)buf);
@@ -2950,6 +3627,7 @@ void user_io_poll()
 	}
 
 	user_io_send_buttons(0);
+	sd_wb_poll();
 
 	if (is_minimig())
 	{
@@ -2969,7 +3647,11 @@ void user_io_poll()
 		uint16_t sd_req = ide_check();
 		ide_io(0, sd_req & 7);
 		ide_io(1, (sd_req >> 3) & 7);
-		if (sd_req & 0x0100) ide_cdda_send_sector();
+		if (sd_req & 0x0100)
+		{
+			scheduler_busy();
+			ide_cdda_send_sector();
+		}
 		UpdateDriveStatus();
 
 		kbd_fifo_poll();
@@ -3004,7 +3686,7 @@ void user_io_poll()
 			int disk = -1;
 			int ack = 0;
 			int op = 0;
-			static uint8_t buffer[16][16384];
+			static uint8_t buffer[16][SD_BUF_SIZE];
 			uint64_t lba;
 			uint32_t blksz, blks, sz;
 
@@ -3082,6 +3764,7 @@ void user_io_poll()
 				blks = 1;
 			}
 			DisableIO();
+			if (op) scheduler_busy();
 
 			if ((blks == G64_BLOCK_COUNT_1541+1 || blks == G64_BLOCK_COUNT_1571+1) && sd_type[disk])
 			{
@@ -3100,6 +3783,7 @@ void user_io_poll()
 				if (use_save) menu_process_save();
 
 				buffer_lba[disk] = -1;
+				sd_ra_invalidate(disk);
 
 				// Fetch sector data from FPGA ...
 				EnableIO();
@@ -3127,7 +3811,21 @@ void user_io_poll()
 				{
 					// ... and write it to disk
 					uint64_t size = sd_image[disk].size / blksz;
-					if (sz && lba <= size)
+					if (sz && lba <= size && sd_wb_enabled(disk))
+					{
+						diskled_on();
+						if (!sd_image_cangrow[disk])
+						{
+							__off64_t rem = sd_image[disk].size - (__off64_t)(lba * blksz);
+							sz = (rem >= sz) ? sz : (int)rem;
+						}
+
+						if (sz) sd_wb_write(disk, lba * blksz, buffer[disk], sz);
+
+						// saves are passed to the storage right away
+						if (use_save) user_io_sd_flush(0);
+					}
+					else if (sz && lba <= size)
 					{
 						diskled_on();
 						if (FileSeek(&sd_image[disk], lba * blksz, SEEK_SET))
@@ -3184,16 +3882,18 @@ void user_io_poll()
 						done = 1;
 						buffer_lba[disk] = lba;
 					}
+					else if (sd_image[disk].size && sd_ra_take(disk, lba, blksz, blks, buf_n, buffer[disk], &buffer_lba[disk]))
+					{
+						done = 1;
+					}
 					else if (sd_image[disk].size)
 					{
 						diskled_on();
-						if (FileSeek(&sd_image[disk], lba * blksz, SEEK_SET))
+						sd_stats[disk].misses++;
+						if (sd_read(disk, lba * blksz, buffer[disk], sizeof(buffer[disk])))
 						{
-							if (FileReadAdv(&sd_image[disk], buffer[disk], sizeof(buffer[disk])))
-							{
-								done = 1;
-								buffer_lba[disk] = lba;
-							}
+							done = 1;
+							buffer_lba[disk] = lba;
 						}
 					}
 
@@ -3234,7 +3934,8 @@ void user_io_poll()
 						}
 					}
 
-					offset = 0;
+					// a read-ahead window may start before the requested sector
+					offset = (buffer_lba[disk] != ULLONG_MAX) ? (lba - buffer_lba[disk]) * blksz : 0;
 				}
 				else
 				{
@@ -3266,17 +3967,25 @@ void user_io_poll()
 						cdi_read_cd(buffer[disk], lba, buf_n);
 						buffer_lba[disk] = lba;
 					}
-					else if (FileSeek(&sd_image[disk], lba * blksz, SEEK_SET) &&
-						FileReadAdv(&sd_image[disk], buffer[disk], sizeof(buffer[disk])))
-					{
-						buffer_lba[disk] = lba;
-					}
-					else
+					else if (!sd_ra_take(disk, lba, blksz, blks, buf_n, buffer[disk], &buffer_lba[disk]))
 					{
-						memset(buffer[disk], 0, sizeof(buffer[disk]));
-						buffer_lba[disk] = -1;
+						sd_stats[disk].misses++;
+						if (sd_read(disk, lba * blksz, buffer[disk], sizeof(buffer[disk])))
+						{
+							buffer_lba[disk] = lba;
+						}
+						else
+						{
+							memset(buffer[disk], 0, sizeof(buffer[disk]));
+							buffer_lba[disk] = -1;
+						}
 					}
 				}
+
+				if (done && buffer_lba[disk] != ULLONG_MAX && !(blksz == 2352 && (is_psx() || is_cdi())))
+				{
+					sd_ra_schedule(disk, buffer_lba[disk], blksz, buf_n);
+				}
 			}
 			else break;
 		}
@@ -186,6 +186,17 @@ void user_io_status_reset();
 uint32_t user_io_get_file_crc();
 int  user_io_file_mount(const char *name, unsigned char index = 0, char pre = 0, int pre_size = 0);
 void user_io_bufferinvalidate(unsigned char index);
+
+struct sd_cache_stats_t
+{
+	uint32_t hits;       // reads served from read-ahead windows
+	uint32_t misses;     // reads done synchronously
+	uint32_t prefetched; // windows read ahead
+	uint32_t dropped;    // read-ahead windows discarded before use
+};
+
+void user_io_sd_cache_stats(unsigned char index, sd_cache_stats_t *stats);
+void user_io_sd_flush(int wait);
 char *user_io_make_filepath(const char *path, const char *filename);
 char *user_io_get_core_name(int orig = 0);
 char *user_io_get_core_name2();